@@ -0,0 +1,29 @@
+#!/bin/sh
+# check.sh runs climate --verify on the example files and on a large
+# synthetic file, and fails if any reading mode gives a different report,
+# a report differs from its .expected file, or a mode is more than
+# THRESHOLD percent (default 40) slower than in the checked-in baselines
+# or, for the columnar modes, than fgets. The synthetic file has 50 states
+# interleaved record by record, so the columnar batch kernels only ever
+# see short runs.
+#
+# It builds climate first, with $CC (default cc). The baselines were
+# recorded on one machine; on another, record them again with
+#   ./check.sh --save-baseline
+# and keep the old ones if the new rates only differ by the hardware.
+set -e
+cd "$(dirname "$0")"
+${CC:-cc} -O2 -pthread -o climate climate.c -lm
+
+threshold=${THRESHOLD:-40}
+if [ "$1" = "--save-baseline" ]; then
+    data="--save-baseline verify_data.baseline"
+    synthetic="--save-baseline verify_synthetic.baseline"
+else
+    data="--baseline verify_data.baseline --threshold $threshold"
+    synthetic="--baseline verify_synthetic.baseline --threshold $threshold"
+fi
+
+./climate --verify $data data_tn.tdv data_wa.tdv data_multi.tdv
+./climate --verify $synthetic --records 2000000 --states 50
+echo "check.sh: all checks passed"
@@ -19,7 +19,7 @@
  * Average Humidity: 49.4%
  * Average Temperature: 58.3F
  * Max Temperature: 110.4F 
- * Max Temperatuer on: Mon Aug  3 11:00:00 2015
+ * Max Temperature on: Mon Aug  3 11:00:00 2015
  * Min Temperature: -11.1F
  * Min Temperature on: Fri Feb 20 04:00:00 2015
  * Lightning Strikes: 781
@@ -62,209 +62,8717 @@
  *      surface temperature (Kelvin)
  */
 
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNEL 1
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define HAVE_INOTIFY 1
+#endif
 
 #define NUM_STATES 50
 
+/**
+ * Partial result (.agg) files written by --save-partial start with this
+ * magic and version, followed by the number of states and then one fixed
+ * size little-endian record per state, each followed by that state's
+ * quantile sketch (possibly empty). See save_partial.
+ */
+#define PARTIAL_MAGIC "CLIMAGG"
+#define PARTIAL_VERSION 4
+#define PARTIAL_HEADER_SIZE 16
+#define PARTIAL_RECORD_SIZE 136
+
+/**
+ * Columnar cache (.col) files written by --convert hold already parsed
+ * records, in blocks of up to COLUMNAR_BLOCK_RECORDS. The header carries
+ * the dictionary of state codes the one byte code ids index into, and the
+ * offset of the block index at the end of the file. See columnar_flush for
+ * the block layout and columnar_index_entry for the index.
+ */
+#define COLUMNAR_MAGIC "CLIMCOL"
+#define COLUMNAR_VERSION 4
+#define COLUMNAR_HEADER_SIZE 576
+#define COLUMNAR_INDEX_OFFSET 544
+#define COLUMNAR_BLOCK_HEADER_SIZE 24
+#define COLUMNAR_INDEX_ENTRY_SIZE 88
+#define COLUMNAR_BLOCK_RECORDS 65536
+#define COLUMNAR_MAX_CODES 255
+
+/**
+ * Size of the read buffer used by analyze_stream. Lines longer than this
+ * are dropped.
+ */
+#define STREAM_BUFFER_SIZE (1 << 20)
+
+/**
+ * Number of STREAM_BUFFER_SIZE buffers analyze_prefetch's reader thread
+ * can fill ahead of the parser.
+ */
+#define PREFETCH_BUFFERS 4
+
+/**
+ * Size of the chunks an arena hands out memory from, and the size above
+ * which an allocation gets a chunk of its own instead: anything past a
+ * page gains nothing from sharing one, and can then be given back with
+ * arena_free.
+ */
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define ARENA_LARGE_SIZE (4 << 10)
+
+/**
+ * Size of the buffer reports are collected in before being written out
+ * (see struct output).
+ */
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+/**
+ * Range and resolution of the quantile sketches (see quantile_sketch).
+ * Values are kept in tenths: temperatures from -150.0F to 200.0F and
+ * humidity from 0.0% to 100.0%, anything outside falling in the end bins.
+ */
+#define SKETCH_TEMPERATURE_MIN (-1500)
+#define SKETCH_TEMPERATURE_BINS 3501
+#define SKETCH_HUMIDITY_BINS 1001
+
+/**
+ * Number of optional per-record metrics (see metric_defs) that --metrics
+ * can turn on.
+ */
+#define NUM_METRICS 2
+
+/**
+ * Time buckets for --bucket. With anything but BUCKET_NONE, every state
+ * also keeps a series of bucket_accum, one per hour, day or month (UTC).
+ */
+enum bucket_kind {
+    BUCKET_NONE,
+    BUCKET_HOUR,
+    BUCKET_DAY,
+    BUCKET_MONTH
+};
+
+/**
+ * Most buckets a state's series covers, from its first to its last: a bit
+ * over 119 years of hours, or 32 MB of bucket_accum. Records further from
+ * the others are left out of the series (see series_slot).
+ */
+#define SERIES_MAX_BUCKETS (1L << 20)
+
+/**
+ * bucket_accum holds the totals for one state in one time bucket.
+ */
+struct bucket_accum {
+    unsigned long num_records;
+    double sum_temperature;
+    double sum_humidity;
+    float max_temperature;
+    float min_temperature;
+};
+
+/**
+ * geo_cell holds the totals for one geohash cell. key is the cell's
+ * geohash as packed by geohash_pack, cut to the index's precision.
+ */
+struct geo_cell {
+    uint64_t key;
+    unsigned long num_records;
+    double sum_temperature;
+    double sum_humidity;
+    unsigned long snow_records;
+    unsigned long lightning_strikes;
+    float max_temperature;
+    float min_temperature;
+};
+
+/**
+ * geo_index is an open addressing hash table of geo_cells, all at the same
+ * precision (number of geohash characters). It never holds more than
+ * max_cells cells: when it would, it is rolled up to a coarser precision
+ * instead (see geo_coarsen), so memory stays bounded however many distinct
+ * cells the input has. Cells with num_records of 0 are empty slots.
+ */
+struct geo_index {
+    int precision;
+    size_t count;
+    size_t capacity;
+    size_t max_cells;
+    struct geo_cell *cells;
+};
+
+/**
+ * quantile_sketch is a histogram of a state's temperatures and humidities
+ * with one bin per tenth of a unit. Quantiles read from it are off by at
+ * most half a bin (0.05F or 0.05%) from the exact ones for values inside
+ * the sketch range, and are exact for data given to one decimal, such as
+ * the humidities in TDV files. Unlike t-digest or KLL the error does not
+ * grow with merging: two sketches merge by adding bins, which gives just
+ * the sketch of the combined records, so -j and --merge report what a
+ * serial run would.
+ */
+struct quantile_sketch {
+    uint64_t temperature[SKETCH_TEMPERATURE_BINS];
+    uint64_t humidity[SKETCH_HUMIDITY_BINS];
+};
+
+/**
+ * compensated_sum is a double sum with Neumaier's running correction for
+ * the low bits each addition rounds off, so that sum + correction stays
+ * accurate to about a unit in the last place of a double however many
+ * values are added, as the long double sums it replaces were.
+ */
+struct compensated_sum {
+    double sum;
+    double correction;
+};
+
+/**
+ * running_moments holds the mean and the sum of squared deviations from
+ * it (m2) of the values seen so far, kept up to date with Welford's
+ * method; the count is the num_records of the struct it is part of.
+ */
+struct running_moments {
+    double mean;
+    double m2;
+};
+
+/**
+ * metric_accum totals one optional metric for a state: the number of
+ * records it could be computed for, their sum, and the lowest and highest
+ * value.
+ */
+struct metric_accum {
+    unsigned long count;
+    struct compensated_sum sum;
+    double min;
+    double max;
+};
+
+/**
+ * arena_chunk is one block of memory of an arena; its size bytes of space
+ * follow the header, of which used are handed out.
+ */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+};
+
+/**
+ * arena holds the per-state aggregates of a state_table (bucket series,
+ * quantile sketches and metric totals). They are bumped out of a few
+ * large zeroed chunks instead of being allocated one by one, so they sit
+ * together in memory, and are not freed on their own: everything goes at
+ * once in arena_release, when the table is freed. Only the large arrays a
+ * growing series leaves behind are given back early (see arena_free).
+ */
+struct arena {
+    struct arena_chunk *chunks;
+};
+
 /**
  * climate_info structs set up to hold values that will be needed to 
  * for the report. Types dependent on what is necessary to hold their
- * respective data.
+ * respective data. The members every record updates come first, in the
+ * first 112 bytes without padding, and the ones that are only read or
+ * written now and then (the code, the timestamps of new extremes, the
+ * series and sketch pointers) come after them. That is only an ordering:
+ * the struct is 184 bytes and the table keeps them in one unaligned
+ * array, so the cold members of one state still share cache lines with
+ * the accumulators of the next, and the effect on cache misses has not
+ * been measured. buckets, sketch and metrics come from arena, that of the
+ * table holding the struct.
  */
 struct climate_info {
-    char code[3];
     unsigned long num_records;
-    long double sum_temperature;
-    long double sum_humidity;
+    struct compensated_sum sum_temperature;
+    struct compensated_sum sum_humidity;
+    struct compensated_sum sum_cloud_cover;
+    struct running_moments temperature_moments;
+    struct running_moments humidity_moments;
     unsigned long snow_records;
-    long double sum_cloud_cover;
     unsigned long lightning_strikes; 
     float max_temperature;
     float min_temperature;
     long max_timestamp;
     long min_timestamp;
+    char code[3];
+    long first_bucket;
+    long num_buckets;
+    unsigned long series_skipped;
+    struct bucket_accum *buckets;
+    struct quantile_sketch *sketch;
+    struct metric_accum *metrics;
+    struct arena *arena;
 };
 
-void analyze_file(FILE *file, struct climate_info *states[], int num_states);
-void print_report(struct climate_info *states[], int num_states);
+/**
+ * record_filter is what --from, --to and --states keep: records are only
+ * counted if their timestamp (in seconds) is in [from, to) and, when
+ * num_codes is not 0, their state code is one of codes.
+ */
+struct record_filter {
+    long from;
+    long to;
+    int num_codes;
+    char (*codes)[3];
+};
 
 /**
- * main is meant to take arguments of file names.
+ * run_stats counts what went into a state_table, for --stats: bytes of
+ * input, lines handed to analyze_line and how many of them did not parse
+ * (malformed) or were dropped by the filter (filtered; only told apart
+ * from malformed ones when stats is set on the table, as that takes a
+ * second parse), lines cut or dropped for being too long (truncated), the
+ * time spent waiting for read() or the prefetch thread, and the time
+ * analyze_parallel spent merging. The tables of worker threads keep their
+ * own, which merge_table adds up, so counting takes no locks.
  */
-int main(int argc, char *argv[]) {
+struct run_stats {
+    uint64_t bytes;
+    uint64_t lines;
+    uint64_t malformed;
+    uint64_t filtered;
+    uint64_t truncated;
+    double read_seconds;
+    double merge_seconds;
+    double merge_cpu;
+};
 
-    /**
-     * If no arguments were passed beyond the name of the program, a message
-     * will be provided and the program will terminate.
-     */
+/**
+ * worker_stats is what one worker thread of analyze_parallel did: the
+ * tasks it took, their bytes and lines, the wall time spent on them and
+ * the CPU time of the thread.
+ */
+struct worker_stats {
+    int tasks;
+    uint64_t bytes;
+    uint64_t lines;
+    double busy_seconds;
+    double cpu_seconds;
+};
 
-    if (argc < 2) {
-        printf("Usage: %s tdv_file1 tdv_file2 ... tdv_fileN \n", argv[0]);
-        return EXIT_FAILURE;
-    }
+/**
+ * state_table keeps the climate_info structs in the order their states were
+ * first seen, which is the order print_report lists them in, in a single
+ * array that grows as new codes turn up, so there is no limit on the
+ * number of states, provinces or other regions. slot maps a code of two
+ * uppercase letters straight to its position in states (plus one, so 0
+ * means not seen yet); any other code is found through other_slot, a
+ * small open addressing hash table holding positions the same way.
+ * Positions stay put as the array grows, pointers into it do not.
+ * bucket says which time series, if any, add_record also fills in, geo
+ * (when not NULL) is the geohash index it also adds records to, and with
+ * quantiles set every state also keeps a quantile_sketch. filter, when not
+ * NULL, drops records while they are parsed (see record_filter). metrics
+ * lists the num_metrics optional metrics (ids into metric_defs) that every
+ * record is also added to. arena, created with the first state, holds the
+ * aggregates of all of the states. counts are the run_stats of the table,
+ * and with stats set (--stats) analyze_parallel also leaves the
+ * worker_stats of its num_workers threads in workers. rejects, when not
+ * NULL, is the file (shared by all the tables of a run) malformed lines
+ * are copied to.
+ */
+struct state_table {
+    struct climate_info *states;
+    int num_states;
+    int capacity;
+    int slot[26 * 26];
+    int *other_slot;
+    int other_capacity;
+    int num_others;
+    enum bucket_kind bucket;
+    struct geo_index *geo;
+    int quantiles;
+    const struct record_filter *filter;
+    int metrics[NUM_METRICS];
+    int num_metrics;
+    struct arena *arena;
+    int stats;
+    struct run_stats counts;
+    struct worker_stats *workers;
+    int num_workers;
+    FILE *rejects;
+};
 
-    /* Let's create an array to store our state data in. As we know, there are
-     * 50 US states. */
-    struct climate_info *states[NUM_STATES] = { NULL };
-    int i;
+/**
+ * output collects report text and hands it to file in large pieces. The
+ * out_ functions format the few kinds of field the reports have (text,
+ * counts, values to one decimal and timestamps) straight into the buffer,
+ * so reports with millions of lines do not go through printf per field.
+ * The local time of the last hour a timestamp fell in is kept (see
+ * out_ctime), so most timestamps need no time zone lookup at all.
+ */
+struct output {
+    FILE *file;
+    size_t len;
+    long cached_hour;
+    int cached_valid;
+    struct tm cached_tm;
+    char data[OUTPUT_BUFFER_SIZE];
+};
 
-    /**
-     * Loop will run for each file name that was found. Attempts to open the file,
-     * if it is not found, an error message is outputted and it moves on to the 
-     * next one. Otherwise, the file is sent through analyze_value to collect
-     * its data and closed afterward.
-     */
-    for (i = 1; i < argc; ++i) {
-	FILE *file = fopen(argv[i], "r");
-	if (file == NULL) {
-	    printf("ERROR: %s does not exist\n", argv[i]);
-	    continue;
-	}
-	printf("Opening file: %s\n", argv[i]);
-        analyze_file(file, states, NUM_STATES); 
-	fclose(file);
-    }
+/**
+ * Report formats for --format. Besides the text report there are CSV and
+ * JSON Lines with one row per state (JSON Lines also covering the time
+ * series and geohash rows), and a fixed-width binary file laid out as
+ * described at write_report_bin.
+ */
+enum report_format {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSONL,
+    FORMAT_BIN
+};
 
-    /**
-     * If no files were read from (first entry of the array is still null), 
-     * nothing further needs to be done. In most cases though, print_report 
-     * will be called in order to output the statistics.
-     */
-    if (*states != NULL) {
-        print_report(states, NUM_STATES);
-    }
+/**
+ * Binary reports (--format bin) start with this magic and version, see
+ * write_report_bin.
+ */
+#define REPORT_MAGIC "CLIMREP"
+#define REPORT_VERSION 1
+#define REPORT_HEADER_SIZE 32
+#define REPORT_RECORD_SIZE 152
 
-    return 0;
-}
+/**
+ * --workers talks to --serve-shards in frames of a u32 type and a u32
+ * length (little-endian, as in the partial result format) followed by
+ * that many bytes; see start_shard and receive_shard. Each worker gets
+ * SHARDS_PER_WORKER shards to start with, and a shard is tried up to
+ * SHARD_ATTEMPTS times.
+ */
+#define SHARD_FRAME_HEADER 8
+#define SHARD_FRAME_MAX (1u << 30)
+#define SHARD_RUN 1
+#define SHARD_LOG 2
+#define SHARD_PARTIAL 3
+#define SHARD_FAILED 4
+#define SHARDS_PER_WORKER 4
+#define SHARD_ATTEMPTS 3
 
 /**
- * analyze_file works with the passed file to fill appropriate members of
- * the structs of the array. *token will be used to initially tokenize the
- * current line of the file, timestamp will hold the time value of the 
- * current line, and temperature carries the current temperature. delim has
- * the points strtok() will need to split each line.
+ * Limits on the text of a --query: how many words (names, numbers and
+ * punctuation) it can have and how long each can be, and how many
+ * aggregates and conditions.
  */
-void analyze_file(FILE *file, struct climate_info **states, int num_states) {
-    const int line_sz = 100;
-    char line[line_sz];
-    char *token;
-    char delim[] = "\t\n";
+#define QUERY_MAX_WORDS 256
+#define QUERY_MAX_WORD 64
+#define QUERY_MAX_TERMS 16
+
+/**
+ * Shortest average run of records of one state for which query_batches
+ * is used on a block.
+ */
+#define QUERY_MIN_RUN 64
+
+/**
+ * report_options are the choices that change what print_report prints:
+ * show_stddev adds standard deviations, iso_time prints timestamps as
+ * ISO 8601 in UTC instead of ctime's local time, and format picks the
+ * text report or one of the machine-readable ones.
+ */
+struct report_options {
+    int show_stddev;
+    int iso_time;
+    enum report_format format;
+};
+
+/**
+ * tdv_record holds the fields of one parsed line, already converted to the
+ * units they are aggregated in: the timestamp is in seconds and the
+ * temperature in Fahrenheit. geohash points back into the line it was
+ * parsed from and is not NUL-terminated.
+ */
+struct tdv_record {
+    char code[3];
     long timestamp;
+    const char *geohash;
+    size_t geohash_len;
+    double humidity;
+    int snow;
+    double cloud_cover;
+    int lightning;
+    double pressure;
     float temperature;
-	
-    /**
-     * Loop here stores retrieves and stores each line one at a time 
-     * until the end of the file has been reached.
-     */
-    while (fgets(line, line_sz, file) != NULL) {
-        /* 
-         * For the process for each line, to start, the line is tokenized,
-	 * getting the state code first. A for loop is then ran to check
-	 * through the state of the matching code already has data stored
-	 * in a struct. If not, memory is allocated for one. Program exits
-	 * if this fails. This struct then has all its members set to 
-	 * the ones of the current line and the function can move on to the
-	 * next line. If there was already a struct for the current state,
-	 * values are updated including max and mins if it makes sense in the 
-	 * given case. Can then move on to the next line.
-         */
-	token = strtok(line, delim);
-	for (int i = 0; i < num_states; ++i) {
-	    if (*(states + i) == NULL) {
-	        *(states + i)  = malloc(sizeof(struct climate_info));
-
-		if (*(states + i) == NULL) {
-		    printf("ERROR: Memory could not be allocated\n");
-		    exit(EXIT_FAILURE);
-		}
-
-		strcpy((*(states + i))->code, token);
-		(*(states + i))->num_records = 1; 
-		timestamp = atoll(strtok(NULL, delim)) / 1000;
-		(*(states + i))->max_timestamp = timestamp;
-                (*(states + i))->min_timestamp = timestamp;
-		strtok(NULL, delim);
-		(*(states + i))->sum_humidity = atof(strtok(NULL, delim));
-		(*(states + i))->snow_records = atoi(strtok(NULL, delim));		
-	    	(*(states + i))->sum_cloud_cover = atof(strtok(NULL, delim));
-		(*(states + i))->lightning_strikes = atoi(strtok(NULL, delim));	
-	    	strtok(NULL, delim);
-		temperature = atof(strtok(NULL, delim)) * 1.8 - 459.67;
-		(*(states + i))->sum_temperature = temperature;
-		(*(states + i))->max_temperature = temperature;
-		(*(states + i))->min_temperature = temperature;
-		break;
-			
-	    }
-	
-	    if (strcmp((*(states + i))->code, token) == 0) {
-		((*(states + i))->num_records)++;
-		timestamp = atoll(strtok(NULL, delim)) / 1000;
-		strtok(NULL, delim);
-		(*(states + i))->sum_humidity += atof(strtok(NULL, delim));
-		(*(states + i))->snow_records += atoi(strtok(NULL, delim));
-		(*(states + i))->sum_cloud_cover += atof(strtok(NULL, delim));
-		(*(states + i))->lightning_strikes += atoi(strtok(NULL, delim));
-		strtok(NULL, delim);
-		temperature = atof(strtok(NULL, delim)) * 1.8 - 459.67;
-		(*(states + i))->sum_temperature += temperature;
-		
-		if (temperature > (*(states + i))->max_temperature) {
-		    (*(states + i))->max_temperature = temperature;
-	    	    (*(states + i))->max_timestamp = timestamp;
-		}
-		if (temperature < (*(states + i))->min_temperature) {
-		    (*(states + i))->min_temperature = temperature;
-                    (*(states + i))->min_timestamp = timestamp;
-		}
-		
-		break;
-	    }
-	}
+};
 
-    }
-}
+/**
+ * columnar_writer collects parsed records for --convert one block at a
+ * time, in one array per column, and writes each block out when it fills.
+ * offset is where in the file the next block goes, and index holds the
+ * index entries of the blocks written so far, to go after the last one.
+ */
+struct columnar_writer {
+    FILE *file;
+    uint64_t offset;
+    unsigned char *index;
+    uint64_t num_records;
+    uint32_t num_blocks;
+    uint32_t count;
+    int num_codes;
+    char codes[COLUMNAR_MAX_CODES][2];
+    int64_t *timestamp;
+    uint64_t *geohash;
+    double *humidity;
+    double *cloud_cover;
+    double *pressure;
+    float *temperature;
+    int32_t *snow;
+    int32_t *lightning;
+    uint8_t *code;
+};
 
 /**
- * print_report handles all of the ouput for the program starting by
- * giving the codes of the states that were found in the files. A for
- * loop that goes through non-NULL members of the array to is utilized
- * for this.
+ * column_run points at the columns of a run of consecutive columnar
+ * records that all belong to one state, for the batch kernels.
+ */
+struct column_run {
+    const float *temperature;
+    const double *humidity;
+    const double *cloud_cover;
+    const int32_t *snow;
+    const int32_t *lightning;
+    uint32_t count;
+};
+
+/**
+ * batch_stats is what a batch kernel computes over a column_run. argmax
+ * and argmin are the positions in the run of the first record holding the
+ * max and min temperature.
+ */
+struct batch_stats {
+    uint32_t num_records;
+    double sum_temperature;
+    double sum_humidity;
+    double sum_cloud_cover;
+    int64_t snow_records;
+    int64_t lightning_strikes;
+    float max_temperature;
+    float min_temperature;
+    uint32_t argmax;
+    uint32_t argmin;
+};
+
+/**
+ * Batch kernels all follow the same summation order so that they give
+ * bit-for-bit the same batch_stats: each sum is split over four lanes,
+ * record i going to lane i % 4 in record order, and the lanes are
+ * combined as (lane 0 + lane 1) + (lane 2 + lane 3). Counts are exact
+ * integer sums, and the max and min are defined as those of the first
+ * record holding them, which does not depend on order either.
+ */
+typedef void (*batch_kernel_fn)(const struct column_run *run, struct batch_stats *out);
+
+/**
+ * Shortest run that run_batch_kernel hands to the selected batch kernel.
+ * Shorter runs, as in files where the states are interleaved, go to
+ * batch_stats_scalar, since setting up and reducing the vector lanes costs
+ * more than the few records they would cover.
+ */
+#define BATCH_MIN_RUN 16
+
+/**
+ * Ways a file can be read in. INGEST_FGETS reads line by line through
+ * stdio, INGEST_MMAP maps the whole file and parses straight out of the
+ * mapping, and INGEST_STREAM reads large blocks into a fixed buffer and
+ * parses the whole lines in each. INGEST_PREFETCH reads the same blocks
+ * on a separate thread, ahead of the parser (see analyze_prefetch).
+ * Inputs that cannot seek (pipes, "-" for stdin) are always streamed,
+ * with or without prefetching.
+ */
+enum ingest_mode {
+    INGEST_FGETS,
+    INGEST_MMAP,
+    INGEST_STREAM,
+    INGEST_PREFETCH
+};
+
+/**
+ * Inputs run_verify reads the same records from: the TDV files as given, a
+ * columnar file converted from them, gzip and zstd copies of each, and a
+ * partial result saved from the first run.
+ */
+enum verify_input {
+    VERIFY_TDV,
+    VERIFY_COLUMNAR,
+    VERIFY_GZIP,
+    VERIFY_ZSTD,
+    VERIFY_PARTIAL
+};
+
+/**
+ * verify_mode is one way run_verify reads its input: which copy of it,
+ * the ingest mode, and whether it goes through analyze_parallel.
+ */
+struct verify_mode {
+    const char *name;
+    enum verify_input input;
+    enum ingest_mode mode;
+    int parallel;
+};
+
+/**
+ * input_file tracks one command line file while running with -j. The file
+ * is opened (and mapped, with --mmap) up front so it can be cut into tasks,
+ * and closed once all tasks are merged. file is NULL if it did not open.
+ * A .zst file is mapped as is and compressed is set, so split_tasks can
+ * cut it between frames; any other compressed file is read through a
+ * single decompressor process, whose pid is kept in decompressor.
+ */
+struct input_file {
+    FILE *file;
+    void *map;
+    size_t map_len;
+    int compressed;
+    pid_t decompressor;
+};
+
+/**
+ * parse_task is one unit of work for the worker threads of
+ * analyze_parallel: either a newline aligned byte range of a mapped file,
+ * a run of whole blocks of a mapped columnar file (columnar then points at
+ * its header), a run of whole frames of a mapped .zst file (compressed is
+ * set), or (when data is NULL) a whole file to read with analyze_opened.
+ * Each task collects its records into its own state_table. Frames do not
+ * end on line boundaries, so a compressed task other than the first of its
+ * file keeps the text before its first newline in head (head_ended tells
+ * if there was one) and every compressed task keeps its unfinished last
+ * line in tail, for analyze_parallel to join up. tail_skipped is set if
+ * that line was already too long to keep, and failed if the decompressor
+ * did not exit cleanly.
+ */
+struct parse_task {
+    int input;
+    FILE *file;
+    const char *columnar;
+    const char *data;
+    size_t len;
+    int compressed;
+    int first;
+    char *head;
+    size_t head_len;
+    int head_ended;
+    char *tail;
+    size_t tail_len;
+    int tail_skipped;
+    int failed;
+    struct state_table table;
+};
+
+/**
+ * decompressor_feed is handed to the feed_decompressor thread: the
+ * compressed bytes to write into the decompressor's stdin pipe fd.
+ */
+struct decompressor_feed {
+    int fd;
+    const char *data;
+    size_t len;
+};
+
+/**
+ * task_pool is shared by the worker threads. Each worker takes the next
+ * unclaimed task under lock until none are left, and keeps its totals in
+ * its own entry of workers.
+ */
+struct task_pool {
+    enum ingest_mode mode;
+    struct parse_task *tasks;
+    int num_tasks;
+    int next;
+    struct worker_stats *workers;
+    int num_workers;
+    pthread_mutex_t lock;
+};
+
+/**
+ * prefetch_ring is the bounded queue between analyze_prefetch and its
+ * reader thread: PREFETCH_BUFFERS buffers used in turn, of which the ones
+ * from tail up to head are filled and waiting to be parsed. Each filled
+ * buffer holds whole lines from start to len (only the very last one may
+ * end without a newline). done is set once the reader has reached the
+ * end of the file or failed. truncated counts the lines the reader
+ * dropped for being too long.
+ */
+struct prefetch_ring {
+    int fd;
+    char *buffers[PREFETCH_BUFFERS];
+    size_t start[PREFETCH_BUFFERS];
+    size_t len[PREFETCH_BUFFERS];
+    unsigned head;
+    unsigned tail;
+    int done;
+    uint64_t truncated;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+};
+
+/**
+ * watched_file is a .tdv file in the directory --watch follows. offset is
+ * how far it has been read: always just past a newline, so the next read
+ * starts at a whole line. skipping is set while the rest of a line too
+ * long for the read buffer is being dropped.
+ */
+struct watched_file {
+    char *name;
+    off_t offset;
+    int skipping;
+};
+
+/**
+ * Columns a --query can aggregate or compare, and what it can do with
+ * them (see parse_query).
+ */
+enum query_column {
+    QUERY_TEMPERATURE,
+    QUERY_HUMIDITY,
+    QUERY_CLOUD_COVER,
+    QUERY_PRESSURE,
+    QUERY_SNOW,
+    QUERY_LIGHTNING,
+    NUM_QUERY_COLUMNS
+};
+
+enum query_func {
+    QUERY_COUNT,
+    QUERY_SUM,
+    QUERY_AVG,
+    QUERY_MIN,
+    QUERY_MAX
+};
+
+enum query_op {
+    QUERY_EQ,
+    QUERY_NE,
+    QUERY_LT,
+    QUERY_LE,
+    QUERY_GT,
+    QUERY_GE
+};
+
+/**
+ * query_agg is one aggregate of a query (column is -1 for count), and
+ * query_cond one condition comparing a column with a number.
+ */
+struct query_agg {
+    enum query_func func;
+    int column;
+};
+
+struct query_cond {
+    int column;
+    enum query_op op;
+    double value;
+};
+
+/**
+ * query is a parsed --query. Records are grouped by state if by_state is
+ * set and by time bucket unless bucket is BUCKET_NONE; conditions on time
+ * and state are kept in filter, the rest in conds. used marks the columns
+ * some aggregate reads, and batched is set if all the aggregates can be
+ * taken from batch_stats.
+ */
+struct query {
+    struct query_agg aggs[QUERY_MAX_TERMS];
+    int num_aggs;
+    struct query_cond conds[QUERY_MAX_TERMS];
+    int num_conds;
+    int by_state;
+    enum bucket_kind bucket;
+    struct record_filter filter;
+    int used[NUM_QUERY_COLUMNS];
+    int batched;
+};
+
+/**
+ * query_group holds the aggregates of one group of a query: the number of
+ * records, and the totals of each column (count, sum, min and max, as for
+ * the optional metrics). key packs code and bucket for the hash.
+ */
+struct query_group {
+    uint64_t key;
+    char code[3];
+    long bucket;
+    unsigned long count;
+    struct metric_accum columns[NUM_QUERY_COLUMNS];
+};
+
+/**
+ * query_table holds the count groups of a query in the order they were
+ * found, with an open addressing hash of capacity slots over them, each
+ * holding a position in groups plus 1, or 0 if empty.
+ */
+struct query_table {
+    struct query_group *groups;
+    size_t count;
+    size_t capacity;
+    uint32_t *hash;
+};
+
+/**
+ * column_block points at all the columns of one block of a columnar file
+ * that a query can use; see block_columns.
+ */
+struct column_block {
+    const int64_t *timestamp;
+    const double *humidity;
+    const double *cloud_cover;
+    const double *pressure;
+    const float *temperature;
+    const int32_t *snow;
+    const int32_t *lightning;
+    const uint8_t *code;
+    uint32_t count;
+};
+
+/**
+ * shard is a run of count command line files from first on that
+ * --workers hands to a worker as one unit. running counts the workers it
+ * is out on (two once a copy is started for a straggler), and failures
+ * the attempts that came back without a result. Once done, log holds the
+ * messages the worker printed and partial its aggregates, in the
+ * --save-partial format.
+ */
+struct shard {
+    int first;
+    int count;
+    int running;
+    int failures;
+    int done;
+    char *log;
+    size_t log_len;
+    char *partial;
+    size_t partial_len;
+};
+
+/**
+ * shard_worker is one host:port given to --workers. fd is the connection
+ * it is running shard on, or -1 while it is idle, and buf collects the
+ * len bytes received on it so far. dead is set once it could not be
+ * connected to or has failed, so it is not sent any more work.
+ */
+struct shard_worker {
+    char *address;
+    int fd;
+    int shard;
+    char *buf;
+    size_t len;
+    int dead;
+};
+
+void analyze_path(const char *path, enum ingest_mode mode, struct state_table *table);
+void analyze_parallel(char *paths[], int num_paths, enum ingest_mode mode, int jobs,
+        struct state_table *table);
+int split_tasks(struct input_file *inputs, int num_inputs, int jobs, struct parse_task **tasks);
+void *analyze_worker(void *arg);
+void merge_table(struct state_table *dst, const struct state_table *src);
+void free_table(struct state_table *table);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_free(struct arena *arena, void *p, size_t size);
+void arena_release(struct arena *arena);
+int save_partial(const char *path, const struct state_table *table);
+int save_sketch(FILE *file, const struct quantile_sketch *sketch);
+int load_partial(const char *path, struct state_table *table);
+int read_partial_header(FILE *file, const char *name, uint32_t *count);
+int read_partial_states(FILE *file, const char *name, uint32_t count, struct state_table *table);
+void put_u32(unsigned char *p, uint32_t v);
+void put_u64(unsigned char *p, uint64_t v);
+void put_f64(unsigned char *p, double v);
+uint32_t get_u32(const unsigned char *p);
+uint64_t get_u64(const unsigned char *p);
+double get_f64(const unsigned char *p);
+void analyze_opened(FILE *file, enum ingest_mode mode, struct state_table *table);
+void analyze_file(FILE *file, struct state_table *table);
+void analyze_stream(FILE *file, struct state_table *table);
+void analyze_prefetch(FILE *file, struct state_table *table);
+void *prefetch_reader(void *arg);
+FILE *open_input(const char *path, pid_t *child);
+void close_input(FILE *file, pid_t child, const char *path);
+const char *decompressor_for(const char *path);
+int spawn_decompressor(const char *tool, const char *path, int in, pid_t *child);
+int open_pipe(int fds[2]);
+const char *zstd_frame_end(const char *p, const char *end);
+void analyze_zstd_frames(struct parse_task *task);
+void *feed_decompressor(void *arg);
+void append_text(char **buf, size_t *len, const char *text, size_t n);
+int is_seekable(FILE *file);
+void *map_file(FILE *file, size_t *len);
+int analyze_mapped(FILE *file, struct state_table *table);
+void analyze_buffer(const char *data, size_t len, struct state_table *table);
+void analyze_line(const char *line, const char *eol, struct state_table *table);
+int parse_record(const char *line, const char *eol, const struct record_filter *filter,
+        struct tdv_record *rec);
+int filter_code(const struct record_filter *filter, const char *code);
+int parse_time_arg(const char *text, long *out);
+int parse_state_list(char *list, struct record_filter *filter);
+int parse_record_strtok(char *line, struct tdv_record *rec);
+const char *parse_decimal(const char *p, const char *eol, double *out, int *bad);
+const char *parse_integer(const char *p, const char *eol, long long *out, int *bad);
+void write_reject(FILE *file, const char *line, const char *eol, int end_line);
+struct climate_info *find_state(struct state_table *table, const char *code);
+int state_index(struct state_table *table, const char *code);
+int add_state(struct state_table *table, const char *code);
+unsigned other_slot_of(const struct state_table *table, const char *code);
+void add_record(struct state_table *table, const struct tdv_record *rec);
+void update_state(struct climate_info *info, const struct tdv_record *rec);
+int find_metric(const char *name);
+double metric_pressure(const struct tdv_record *rec);
+double metric_dew_point(const struct tdv_record *rec);
+void add_metrics(const struct state_table *table, struct climate_info *info,
+        const struct tdv_record *rec);
+void add_metric(struct metric_accum *accum, double value);
+void merge_metrics(struct climate_info *dst, const struct climate_info *src);
+int save_metrics(FILE *file, const struct metric_accum *metrics);
+long bucket_of(long timestamp, enum bucket_kind kind);
+struct bucket_accum *series_slot(struct climate_info *info, long bucket);
+void add_to_bucket(struct climate_info *info, long bucket, float temperature, double humidity);
+void merge_series(struct climate_info *dst, const struct climate_info *src);
+void print_series(struct output *out, const struct state_table *table,
+        const struct report_options *options);
+void bucket_label(char *label, size_t size, long bucket, enum bucket_kind kind);
+long sketch_bin(double value, long min, long bins);
+void sketch_add(struct climate_info *info, float temperature, double humidity);
+void merge_sketch(struct climate_info *dst, const struct climate_info *src);
+double sketch_quantile(const uint64_t *bins, long num_bins, long min, uint64_t count, double q);
+uint64_t geohash_pack(const char *geohash, size_t len);
+uint64_t geohash_prefix(uint64_t packed, int precision);
+struct geo_index *geo_create(int precision, size_t max_cells);
+void geo_free(struct geo_index *geo);
+struct geo_cell *geo_slot(struct geo_index *geo, uint64_t key);
+void geo_add(struct geo_index *geo, uint64_t packed, float temperature, double humidity,
+        int snow, int lightning);
+void geo_fold(struct geo_index *geo, const struct geo_cell *from, uint64_t key);
+void geo_coarsen(struct geo_index *geo, int precision);
+void geo_merge(struct geo_index *dst, const struct geo_index *src);
+void print_geo(struct output *out, const struct geo_index *geo, const int *levels,
+        int num_levels, const struct report_options *options);
+int compare_geo_cells(const void *a, const void *b);
+long days_from_civil(long year, unsigned month, unsigned day);
+void civil_from_days(long days, long *year, unsigned *month, unsigned *day);
+int convert_files(const char *out_path, char *paths[], int num_paths,
+        const struct record_filter *filter);
+int columnar_add(struct columnar_writer *writer, const struct tdv_record *rec);
+int columnar_flush(struct columnar_writer *writer);
+void columnar_index_entry(const struct columnar_writer *writer, unsigned char *entry);
+size_t columnar_block_size(uint32_t count);
+int is_columnar(FILE *file);
+int columnar_header_ok(const char *data, size_t len);
+void analyze_columnar(const char *data, size_t len, struct state_table *table);
+void analyze_columnar_blocks(const char *header, const char *blocks, const char *end,
+        struct state_table *table);
+void fold_batch(struct climate_info *info, const struct column_run *run,
+        const struct batch_stats *stats, const int64_t *timestamp);
+int select_batch_kernel(const char *name);
+void run_batch_kernel(const struct column_run *run, struct batch_stats *out);
+void batch_stats_scalar(const struct column_run *run, struct batch_stats *out);
+void finish_batch_stats(const struct column_run *run, uint32_t i,
+        double temperature[4], double humidity[4], double cloud_cover[4],
+        int64_t snow, int64_t lightning, float max[8], uint32_t argmax[8],
+        float min[8], uint32_t argmin[8], struct batch_stats *out);
+#ifdef HAVE_AVX2_KERNEL
+void batch_stats_avx2(const struct column_run *run, struct batch_stats *out);
+double sum_lanes_avx2(__m256d lanes);
+int64_t count_lanes_avx2(__m256i lanes);
+float pick_lane_avx2(__m256 values, __m256i positions, int max, uint32_t *at);
+#endif
+#ifdef HAVE_NEON_KERNEL
+void batch_stats_neon(const struct column_run *run, struct batch_stats *out);
+#endif
+void print_report(struct output *out, const struct climate_info *states, int num_states,
+        const struct report_options *options);
+void out_init(struct output *out, FILE *file);
+void out_flush(struct output *out);
+void out_bytes(struct output *out, const char *text, size_t len);
+void out_str(struct output *out, const char *text);
+void out_ulong(struct output *out, unsigned long value, int width);
+void out_fixed1(struct output *out, double value);
+void out_ctime(struct output *out, long timestamp);
+void out_iso_time(struct output *out, long timestamp);
+void out_time(struct output *out, long timestamp, const struct report_options *options);
+void out_summary(struct output *out, const struct report_options *options, const char *label,
+        unsigned long num_records, double sum_temperature, double sum_humidity,
+        float max_temperature, float min_temperature);
+void print_rows(struct output *out, const struct climate_info *states, int num_states,
+        const struct report_options *options);
+void write_report_bin(struct output *out, const struct climate_info *states, int num_states);
+void out_double(struct output *out, double value, enum report_format format);
+void out_quoted(struct output *out, const char *text, enum report_format format);
+void out_key(struct output *out, const char *name, enum report_format format);
+void add_compensated(struct compensated_sum *total, double value);
+void merge_compensated(struct compensated_sum *total, const struct compensated_sum *from);
+double compensated_value(const struct compensated_sum *total);
+void add_moment(struct running_moments *moments, double weight, double value);
+void merge_moments(struct running_moments *moments, unsigned long count,
+        const struct running_moments *from, unsigned long from_count);
+double moments_stddev(const struct running_moments *moments, unsigned long count);
+int bench_parser(const char *path);
+double now_seconds(void);
+double cpu_seconds(clockid_t clock);
+void print_stats(const struct state_table *table, const double stage[4]);
+int generate_tdv(const char *path, unsigned long records, int states);
+uint64_t next_random(uint64_t *state);
+double min_seconds(double a, double b);
+int run_bench(const char *path, unsigned long records, int states, const char *baseline,
+        const char *save_baseline, double threshold);
+double baseline_rate(FILE *base, const char *name);
+int run_verify(char *paths[], int num_paths, unsigned long records, int states, int jobs,
+        const struct record_filter *filter, const char *baseline, const char *save_baseline,
+        double threshold);
+int verify_run(const struct verify_mode *mode, char *inputs[], int num_inputs, int jobs,
+        struct state_table *table);
+char *verify_report(const struct state_table *table, size_t *len);
+int check_expected(const char *path);
+void verify_table(struct state_table *table, const struct record_filter *filter);
+long differing_line(const char *report, size_t len, const char *expected, size_t expected_len);
+int compress_file(const char *tool, const char *path, const char *out_path);
+int quiet_stdout(void);
+void restore_stdout(int saved);
+void print_all(struct output *out, const struct state_table *table,
+        const struct report_options *options, const int *geo_levels, int num_geo_levels);
+int run_daemon(const char *dir, const char *socket_path, struct state_table *table,
+        const struct report_options *options, const int *geo_levels, int num_geo_levels);
+void follow_file(const char *dir, struct watched_file *watched, char *buf,
+        struct state_table *table);
+struct watched_file *watch_file(struct watched_file **files, int *num_files,
+        const char *name);
+int is_tdv_name(const char *name);
+int open_report_socket(const char *path);
+int fetch_report(const char *path);
+void stop_daemon(int signal_number);
+int shard_option_arity(const char *arg);
+int run_workers(const char *workers, const char *options, size_t options_len, char *paths[],
+        int num_paths, struct state_table *table);
+void split_shards(char *paths[], int num_paths, struct shard *shards, int num_shards);
+int next_shard(const struct shard *shards, int num_shards);
+void start_shard(struct shard_worker *worker, int s, struct shard *shard, const char *options,
+        size_t options_len, char *paths[]);
+int receive_shard(struct shard_worker *worker, struct shard *shard);
+void stop_shard(struct shard_worker *worker, struct shard *shard);
+int serve_shards(const char *address, const char *self);
+void serve_shard(int client, const char *self);
+int run_shard(int client, const char *self, char *args[], char **log, size_t *log_len,
+        char **partial, size_t *partial_len);
+int open_tcp(const char *address, int listening);
+int send_frame(int fd, uint32_t type, const char *data, size_t len);
+int run_query(const char *text, const struct record_filter *filter, char *paths[],
+        int num_paths);
+int parse_query(const char *text, struct query *query);
+int parse_query_cond(char words[][QUERY_MAX_WORD], int num_words, int *t, struct query *query);
+void intersect_states(struct record_filter *filter, struct record_filter *picked);
+int find_query_column(const char *name);
+void query_columnar(const struct query *query, const char *data, struct query_table *groups,
+        uint32_t *sel, uint32_t *slots, double *values);
+void query_batches(const struct query *query, const unsigned char *head,
+        const struct column_block *cols, const unsigned char *wanted, struct query_table *groups);
+void fold_accum(struct metric_accum *accum, unsigned long count, double sum, double min,
+        double max);
+void block_columns(const char *block, uint32_t n, struct column_block *cols);
+const double *column_values(const struct column_block *cols, int column, double *scratch);
+uint32_t select_matching(const double *values, enum query_op op, double value, uint32_t *sel,
+        uint32_t count);
+int range_may_match(const struct query_cond *cond, double lo, double hi);
+int range_always_matches(const struct query_cond *cond, double lo, double hi);
+uint32_t query_group(struct query_table *groups, const char *code, long bucket);
+void print_query(const struct query *query, struct query_table *groups);
+int compare_query_groups(const void *a, const void *b);
+
+/* Batch kernel used for columnar input, picked by select_batch_kernel. */
+batch_kernel_fn batch_kernel = batch_stats_scalar;
+
+/* Whether parse_record rejects lines with malformed fields; cleared by
+ * --no-validate. */
+int validate_records = 1;
+
+/**
+ * main is meant to take arguments of file names, where "-" reads from stdin
+ * and names ending in .gz or .zst are decompressed on the fly (see
+ * open_input). Options come before the file names: --mmap selects the
+ * memory-mapped ingest path and --stream the buffered one, -j N spreads the
+ * files (and with --mmap, pieces of each file) over N worker threads, and
+ * --bench-parser times the record parser against the old strtok one on the
+ * given file instead of producing a report. --save-partial writes the
+ * collected aggregates to a file, and --merge reads such files back in
+ * place of TDV files, so new data can be folded into earlier results
+ * without re-reading it. --convert writes the records of the files into a
+ * columnar cache file, which can then be passed in place of the TDV files.
+ * --kernel picks the batch kernel used on those (scalar, avx2, neon or the
+ * default auto). --generate writes a synthetic TDV file and --bench times
+ * each stage of a run, optionally against a saved baseline (see run_bench).
+ * --bucket adds an hourly, daily or monthly series per state to the report,
+ * and --geohash P adds totals per geohash cell of P characters (see
+ * geo_index), optionally rolled up to coarser levels as well. --quantiles
+ * adds temperature and humidity percentiles to each state, --stddev their
+ * standard deviations, and --iso-time prints timestamps in ISO 8601 (UTC)
+ * instead of local time. --metrics adds the average, min and max of
+ * optional per-record metrics such as pressure and dew point. --from and
+ * --to keep only records in a time range and --states only those of the
+ * listed states; both are checked before the rest of a line is parsed, and
+ * let whole blocks of columnar files be skipped. --format csv, jsonl or bin
+ * replaces the text report with a machine-readable one on stdout, and sends
+ * the messages that would otherwise be mixed into it to stderr. --watch dir
+ * keeps running instead (see run_daemon), serving the report on the Unix
+ * socket given with --socket, which --fetch reads it from. --stats ends the
+ * run with times and counters per stage (see print_stats). Lines with
+ * malformed fields are skipped (see parse_record) unless --no-validate is
+ * given, and --rejects copies them to a file. --workers spreads the files
+ * over other hosts, each running --serve-shards, and merges what they send
+ * back (see run_workers). --query answers a query with its own grouping and
+ * conditions from columnar files instead of printing the report (see
+ * parse_query). --verify reads the files every way there is and fails if
+ * any of them gives a different report, a file's report is not the one
+ * checked in next to it, or, against a baseline, a way runs slower (see
+ * run_verify).
  */
-void print_report(struct climate_info *states[], int num_states) {
-    printf("States found: ");
+int main(int argc, char *argv[]) {
+    enum ingest_mode mode = INGEST_FGETS;
+    const char *save_path = NULL;
+    const char *convert_path = NULL;
+    const char *generate_path = NULL;
+    const char *baseline = NULL;
+    const char *save_baseline = NULL;
+    unsigned long records = 1000000;
+    int num_codes = NUM_STATES;
+    int counted_codes = 0;
+    double threshold = 10;
+    enum bucket_kind bucket = BUCKET_NONE;
+    int quantiles = 0;
+    int stats = 0;
+    const char *rejects_path = NULL;
+    int metrics[NUM_METRICS];
+    int num_metrics = 0;
+    struct record_filter filter = { LONG_MIN, LONG_MAX, 0, NULL };
+    int filtered = 0;
+    struct report_options options = { 0, 0, FORMAT_TEXT };
+    FILE *report = stdout;
+    int geo_precision = 0;
+    size_t geo_cells = 1 << 20;
+    int geo_levels[12];
+    int num_geo_levels = 0;
+    int bench = 0;
+    int verify = 0;
+    int merge = 0;
+    int jobs = 1;
+    int first = 1;
     int i;
-    for (i = 0; i < num_states; ++i) {
-        if (states[i] != NULL) {
-            struct climate_info *info = states[i];
-            printf("%s ", info->code);
+    const char *watch_dir = NULL;
+    const char *socket_path = NULL;
+    const char *workers = NULL;
+    const char *query = NULL;
+    char *shard_options = NULL;
+    size_t shard_options_len = 0;
+
+    select_batch_kernel("auto");
+
+    while (first < argc && argv[first][0] == '-' && argv[first][1] != '\0') {
+        /* Copied before parsing, which may cut up the values in place. */
+        int arity = shard_option_arity(argv[first]);
+
+        for (i = 0; arity >= 0 && first + arity < argc && i <= arity; ++i) {
+            append_text(&shard_options, &shard_options_len, argv[first + i],
+                    strlen(argv[first + i]) + 1);
+        }
+
+        if (strcmp(argv[first], "--mmap") == 0) {
+            mode = INGEST_MMAP;
+        } else if (strcmp(argv[first], "--stream") == 0) {
+            mode = INGEST_STREAM;
+        } else if (strcmp(argv[first], "--prefetch") == 0) {
+            mode = INGEST_PREFETCH;
+        } else if (strcmp(argv[first], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[first], "--no-validate") == 0) {
+            validate_records = 0;
+        } else if (strcmp(argv[first], "--rejects") == 0 && first + 1 < argc) {
+            rejects_path = argv[++first];
+        } else if (strcmp(argv[first], "-j") == 0 && first + 1 < argc) {
+            jobs = atoi(argv[++first]);
+            if (jobs < 1) {
+                printf("ERROR: -j needs a positive number of jobs\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[first], "--save-partial") == 0 && first + 1 < argc) {
+            save_path = argv[++first];
+        } else if (strcmp(argv[first], "--convert") == 0 && first + 1 < argc) {
+            convert_path = argv[++first];
+        } else if (strcmp(argv[first], "--query") == 0 && first + 1 < argc) {
+            query = argv[++first];
+        } else if (strcmp(argv[first], "--kernel") == 0 && first + 1 < argc) {
+            if (!select_batch_kernel(argv[++first])) {
+                printf("ERROR: batch kernel %s is not available\n", argv[first]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[first], "--bucket") == 0 && first + 1 < argc) {
+            ++first;
+            if (strcmp(argv[first], "hour") == 0) {
+                bucket = BUCKET_HOUR;
+            } else if (strcmp(argv[first], "day") == 0) {
+                bucket = BUCKET_DAY;
+            } else if (strcmp(argv[first], "month") == 0) {
+                bucket = BUCKET_MONTH;
+            } else {
+                printf("ERROR: --bucket takes hour, day or month\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[first], "--quantiles") == 0) {
+            quantiles = 1;
+        } else if (strcmp(argv[first], "--metrics") == 0 && first + 1 < argc) {
+            char *name;
+
+            for (name = strtok(argv[++first], ","); name != NULL; name = strtok(NULL, ",")) {
+                int id = find_metric(name);
+
+                if (id < 0) {
+                    printf("ERROR: unknown metric %s (try pressure or dewpoint)\n", name);
+                    return EXIT_FAILURE;
+                }
+                for (i = 0; i < num_metrics && metrics[i] != id; ++i) {
+                }
+                if (i == num_metrics) {
+                    metrics[num_metrics++] = id;
+                }
+            }
+        } else if (strcmp(argv[first], "--stddev") == 0) {
+            options.show_stddev = 1;
+        } else if (strcmp(argv[first], "--iso-time") == 0) {
+            options.iso_time = 1;
+        } else if (strcmp(argv[first], "--format") == 0 && first + 1 < argc) {
+            ++first;
+            if (strcmp(argv[first], "text") == 0) {
+                options.format = FORMAT_TEXT;
+            } else if (strcmp(argv[first], "csv") == 0) {
+                options.format = FORMAT_CSV;
+            } else if (strcmp(argv[first], "jsonl") == 0) {
+                options.format = FORMAT_JSONL;
+            } else if (strcmp(argv[first], "bin") == 0) {
+                options.format = FORMAT_BIN;
+            } else {
+                printf("ERROR: --format takes text, csv, jsonl or bin\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[first], "--geohash") == 0 && first + 1 < argc) {
+            geo_precision = atoi(argv[++first]);
+            if (geo_precision < 1 || geo_precision > 12) {
+                printf("ERROR: --geohash precision must be between 1 and 12\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[first], "--geohash-cells") == 0 && first + 1 < argc) {
+            geo_cells = strtoul(argv[++first], NULL, 10);
+            if (geo_cells < 1) {
+                geo_cells = 1;
+            }
+        } else if (strcmp(argv[first], "--geohash-rollup") == 0 && first + 1 < argc) {
+            char *level = argv[++first];
+
+            for (num_geo_levels = 0; *level != '\0' && num_geo_levels < 12; ++num_geo_levels) {
+                geo_levels[num_geo_levels] = (int) strtol(level, &level, 10);
+                if (*level == ',') {
+                    ++level;
+                }
+            }
+        } else if (strcmp(argv[first], "--watch") == 0 && first + 1 < argc) {
+            watch_dir = argv[++first];
+        } else if (strcmp(argv[first], "--socket") == 0 && first + 1 < argc) {
+            socket_path = argv[++first];
+        } else if (strcmp(argv[first], "--fetch") == 0 && first + 1 < argc) {
+            return fetch_report(argv[first + 1]);
+        } else if (strcmp(argv[first], "--merge") == 0) {
+            merge = 1;
+        } else if (strcmp(argv[first], "--workers") == 0 && first + 1 < argc) {
+            workers = argv[++first];
+        } else if (strcmp(argv[first], "--serve-shards") == 0 && first + 1 < argc) {
+            return serve_shards(argv[first + 1], argv[0]);
+        } else if (strcmp(argv[first], "--generate") == 0 && first + 1 < argc) {
+            generate_path = argv[++first];
+        } else if (strcmp(argv[first], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[first], "--verify") == 0) {
+            verify = 1;
+        } else if (strcmp(argv[first], "--records") == 0 && first + 1 < argc) {
+            records = strtoul(argv[++first], NULL, 10);
+        } else if (strcmp(argv[first], "--from") == 0 && first + 1 < argc) {
+            if (!parse_time_arg(argv[++first], &filter.from)) {
+                printf("ERROR: --from takes YYYY-MM-DD[THH:MM[:SS]] or Unix seconds\n");
+                return EXIT_FAILURE;
+            }
+            filtered = 1;
+        } else if (strcmp(argv[first], "--to") == 0 && first + 1 < argc) {
+            if (!parse_time_arg(argv[++first], &filter.to)) {
+                printf("ERROR: --to takes YYYY-MM-DD[THH:MM[:SS]] or Unix seconds\n");
+                return EXIT_FAILURE;
+            }
+            filtered = 1;
+        } else if (strcmp(argv[first], "--states") == 0 && first + 1 < argc) {
+            /* A number is the state count for --generate and --bench. */
+            ++first;
+            if ((unsigned) (argv[first][0] - '0') < 10) {
+                num_codes = atoi(argv[first]);
+                counted_codes = 1;
+            } else if (!parse_state_list(argv[first], &filter)) {
+                printf("ERROR: --states takes a comma separated list of state codes\n");
+                return EXIT_FAILURE;
+            } else {
+                filtered = 1;
+            }
+        } else if (strcmp(argv[first], "--baseline") == 0 && first + 1 < argc) {
+            baseline = argv[++first];
+        } else if (strcmp(argv[first], "--save-baseline") == 0 && first + 1 < argc) {
+            save_baseline = argv[++first];
+        } else if (strcmp(argv[first], "--threshold") == 0 && first + 1 < argc) {
+            threshold = atof(argv[++first]);
+        } else if (strcmp(argv[first], "--bench-parser") == 0 && first + 1 < argc) {
+            return bench_parser(argv[first + 1]);
+        } else {
+            printf("ERROR: unknown option %s\n", argv[first]);
+            return EXIT_FAILURE;
         }
+        ++first;
+    }
+
+    if (counted_codes && generate_path == NULL && !bench && !verify) {
+        printf("ERROR: --states N only sets the number of states for --generate, --bench"
+                " and --verify; list state codes (--states XX,YY,...) to filter\n");
+        return EXIT_FAILURE;
+    }
+    if (generate_path != NULL) {
+        return generate_tdv(generate_path, records, num_codes);
+    }
+    if (bench) {
+        return run_bench(first < argc ? argv[first] : NULL, records, num_codes,
+                baseline, save_baseline, threshold);
+    }
+    if (verify) {
+        return run_verify(argv + first, argc - first, records, num_codes, jobs > 1 ? jobs : 4,
+                filtered ? &filter : NULL, baseline, save_baseline, threshold);
     }
-    printf("\n");
 
     /**
-     * Another similarly incorporated for loop is used here but to
-     * to print the all of the information for each state that was collected.
-     * Averages are calculated using totals divided by number of records.
-     * Floats/doubles go to one decimal point
+     * If no arguments were passed beyond the name of the program, a message
+     * will be provided and the program will terminate.
      */
-    for (i = 0; i < num_states; ++i) {
-        if (states[i] != NULL) {
-	    printf("-- State: %s --\n", states[i]->code);
-    	    printf("Number of Records: %ld\n", states[i]->num_records);
-	    printf("Average Humidity: %0.1f%%\n",(double) (states[i]->sum_humidity / states[i]->num_records));
-	    printf("Average Temperature: %0.1fF\n",(double) (states[i]->sum_temperature / states[i]->num_records));
-	    printf("Max Temperature: %0.1fF\n",(double) states[i]->max_temperature);
-	    printf("Max Temperature on: %s", ctime(&(states[i]->max_timestamp)));
-	    printf("Min Temperature: %0.1fF\n",(double) states[i]->min_temperature);
-            printf("Min Temperature on: %s", ctime(&(states[i]->min_timestamp)));	    
-	    printf("Lightning Strikes: %ld\n", states[i]->lightning_strikes);
-	    printf("Records with Snow Cover: %ld\n", states[i]->snow_records); 
-	    printf("Average Cloud Cover: %0.1f%%\n",(double) (states[i]->sum_cloud_cover / states[i]->num_records)); 
-	}
+
+    if (watch_dir != NULL && socket_path == NULL) {
+        printf("ERROR: --watch needs --socket to serve reports on\n");
+        return EXIT_FAILURE;
+    }
+    if (first >= argc && watch_dir == NULL) {
+        printf("Usage: %s [--mmap | --stream | --prefetch] [-j N] [--kernel K] [--bucket hour|day|month]"
+                " [--quantiles] [--stddev] [--iso-time] [--stats]\n"
+                "        [--no-validate] [--rejects file]\n"
+                "        [--metrics pressure,dewpoint]\n"
+                "        [--format text|csv|jsonl|bin] [--from T] [--to T] [--states XX,YY,...]\n"
+                "        [--geohash P [--geohash-cells N] [--geohash-rollup L,...]]"
+                " [--save-partial out.agg] tdv_file1 tdv_file2 ... tdv_fileN \n", argv[0]);
+        printf("       %s --watch dir --socket path [report options] [tdv_file ...]\n", argv[0]);
+        printf("       %s --fetch path\n", argv[0]);
+        printf("       %s --merge [--save-partial out.agg] a.agg b.agg ...\n", argv[0]);
+        printf("       %s --workers host:port,... [options] tdv_file1 ... tdv_fileN\n", argv[0]);
+        printf("       %s --serve-shards [host:]port\n", argv[0]);
+        printf("       %s --convert out.col [--from T] [--to T] [--states XX,...]"
+                " tdv_file1 ... tdv_fileN\n", argv[0]);
+        printf("       %s --query 'avg(temperature), max(humidity) group by state, month"
+                " where snow = 1' [--from T] [--to T] [--states XX,...] file1.col ...\n",
+                argv[0]);
+        printf("       %s --generate out.tdv [--records N] [--states N]\n", argv[0]);
+        printf("       %s --bench [--records N] [--states N] [--baseline file] "
+                "[--save-baseline file] [--threshold pct] [tdv_file]\n", argv[0]);
+        printf("       %s --verify [-j N] [--records N] [--states N] [--baseline file] "
+                "[--save-baseline file] [--threshold pct] [tdv_file ...]\n", argv[0]);
+        printf("       %s --bench-parser tdv_file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (filtered && merge) {
+        printf("ERROR: --from, --to and --states cannot be applied to partial results\n");
+        return EXIT_FAILURE;
+    }
+    if (workers != NULL && (merge || watch_dir != NULL || convert_path != NULL
+                || bucket != BUCKET_NONE || geo_precision > 0 || rejects_path != NULL)) {
+        printf("ERROR: --workers cannot be combined with --merge, --watch, --convert,"
+                " --bucket, --geohash or --rejects\n");
+        return EXIT_FAILURE;
+    }
+    if (convert_path != NULL) {
+        return convert_files(convert_path, argv + first, argc - first,
+                filtered ? &filter : NULL);
+    }
+    if (query != NULL) {
+        return run_query(query, filtered ? &filter : NULL, argv + first, argc - first);
+    }
+
+    /**
+     * For the machine-readable formats stdout is kept for the report alone:
+     * the report gets its own stream on the original stdout, and stdout
+     * itself (where "Opening file" and error messages are printed) is
+     * pointed at stderr.
+     */
+    if (options.format != FORMAT_TEXT) {
+        int fd;
+
+        if ((options.format == FORMAT_CSV || options.format == FORMAT_BIN)
+                && (bucket != BUCKET_NONE || geo_precision > 0)) {
+            printf("ERROR: --bucket and --geohash rows are only available as text or jsonl\n");
+            return EXIT_FAILURE;
+        }
+        fflush(stdout);
+        fd = dup(STDOUT_FILENO);
+        if (fd < 0 || (report = fdopen(fd, "w")) == NULL
+                || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            printf("ERROR: could not set up the report output\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Let's create a table to store our state data in. As we know, there are
+     * 50 US states, but it grows to fit DC, territories or provinces too. */
+    struct state_table table = { .bucket = bucket, .quantiles = quantiles, .stats = stats };
+    double stage[4];
+
+    if (filtered) {
+        table.filter = &filter;
+    }
+    if (rejects_path != NULL && (table.rejects = fopen(rejects_path, "w")) == NULL) {
+        printf("ERROR: %s could not be written\n", rejects_path);
+        return EXIT_FAILURE;
+    }
+    memcpy(table.metrics, metrics, sizeof(metrics));
+    table.num_metrics = num_metrics;
+
+    if (geo_precision > 0) {
+        table.geo = geo_create(geo_precision, geo_cells);
+    }
+
+    /**
+     * Loop will run for each file name that was found, sending it through
+     * analyze_path. With more than one job the files are handed to
+     * analyze_parallel instead, which gives the same results. With --merge
+     * the files are partial results from --save-partial, merged in order,
+     * and with --workers they are analyzed on other hosts (see run_workers).
+     */
+    stage[0] = now_seconds();
+    stage[1] = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    if (merge) {
+        for (i = first; i < argc; ++i) {
+            load_partial(argv[i], &table);
+        }
+    } else if (workers != NULL) {
+        if (!run_workers(workers, shard_options, shard_options_len, argv + first, argc - first,
+                    &table)) {
+            return EXIT_FAILURE;
+        }
+    } else if (jobs > 1) {
+        analyze_parallel(argv + first, argc - first, mode, jobs, &table);
+    } else {
+        for (i = first; i < argc; ++i) {
+            analyze_path(argv[i], mode, &table);
+        }
+    }
+    stage[0] = now_seconds() - stage[0];
+    stage[1] = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID) - stage[1];
+
+    if (watch_dir != NULL) {
+        return run_daemon(watch_dir, socket_path, &table, &options, geo_levels, num_geo_levels);
+    }
+
+    if (save_path != NULL && !save_partial(save_path, &table)) {
+        return EXIT_FAILURE;
+    }
+
+    /**
+     * If no files were read from (no states are in the table), nothing
+     * further needs to be done. In most cases though, print_report will be
+     * called in order to output the statistics.
+     */
+    stage[2] = now_seconds();
+    stage[3] = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    if (table.num_states > 0 || options.format != FORMAT_TEXT) {
+        static struct output out;
+
+        out_init(&out, report);
+        print_all(&out, &table, &options, geo_levels, num_geo_levels);
+        out_flush(&out);
+        if (fflush(report) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (stats) {
+        stage[2] = now_seconds() - stage[2];
+        stage[3] = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID) - stage[3];
+        print_stats(&table, stage);
+    }
+    if (table.rejects != NULL && fclose(table.rejects) != 0) {
+        printf("ERROR: %s could not be written\n", rejects_path);
+        return EXIT_FAILURE;
+    }
+
+    free_table(&table);
+    free(shard_options);
+    return 0;
+}
+
+/**
+ * analyze_path attempts to open the named file. If it is not found, an
+ * error message is outputted and nothing else is done. Otherwise, the file
+ * is sent through analyze_opened to collect its data and closed afterward.
+ */
+void analyze_path(const char *path, enum ingest_mode mode, struct state_table *table) {
+    pid_t child;
+    FILE *file = open_input(path, &child);
+
+    if (file == NULL) {
+        printf("ERROR: %s does not exist\n", path);
+        return;
+    }
+    printf("Opening file: %s\n", path);
+    analyze_opened(file, mode, table);
+    close_input(file, child, path);
+}
+
+/**
+ * open_input opens a file named on the command line for reading, with
+ * "-" standing for stdin. A .gz or .zst file is opened as the read end of
+ * a pipe from a gzip or zstd process decompressing it, which runs as its
+ * own pipeline stage alongside the parsing; child is set to its pid, or
+ * to 0 for a plain file.
+ */
+FILE *open_input(const char *path, pid_t *child) {
+    const char *tool = decompressor_for(path);
+    FILE *file;
+    int fd;
+
+    *child = 0;
+    if (strcmp(path, "-") == 0) {
+        return stdin;
+    }
+    if (tool == NULL) {
+        return fopen(path, "r");
+    }
+    if (access(path, R_OK) != 0) {
+        return NULL;
+    }
+    fd = spawn_decompressor(tool, path, -1, child);
+    if (fd < 0) {
+        return NULL;
+    }
+    file = fdopen(fd, "r");
+    if (file == NULL) {
+        close(fd);
+        waitpid(*child, NULL, 0);
+    }
+    return file;
+}
+
+/**
+ * close_input closes a file from open_input. If it came through a
+ * decompressor, the process is waited for, and an error is outputted if
+ * it failed (a corrupt or truncated file, or no gzip or zstd installed).
+ */
+void close_input(FILE *file, pid_t child, const char *path) {
+    int status;
+
+    if (file != stdin) {
+        fclose(file);
+    }
+    if (child > 0 && (waitpid(child, &status, 0) != child
+            || !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        printf("ERROR: %s could not be decompressed\n", path);
+    }
+}
+
+/**
+ * decompressor_for names the program that decompresses path, going by its
+ * extension, or returns NULL if it is not compressed.
+ */
+const char *decompressor_for(const char *path) {
+    size_t len = strlen(path);
+
+    if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+        return "gzip";
+    }
+    if (len > 4 && strcmp(path + len - 4, ".zst") == 0) {
+        return "zstd";
+    }
+    return NULL;
+}
+
+/**
+ * spawn_decompressor starts tool decompressing either the file at path or,
+ * if path is NULL, whatever is written into the pipe fd in. Returns the
+ * read end of a pipe carrying the decompressed text, and sets child to
+ * the pid, or returns -1 if the process could not be started. All pipes
+ * are close-on-exec, so a decompressor started by one thread does not
+ * hold open the pipes of another.
+ */
+int spawn_decompressor(const char *tool, const char *path, int in, pid_t *child) {
+    int out[2];
+
+    if (open_pipe(out) != 0) {
+        return -1;
+    }
+    *child = fork();
+    if (*child == 0) {
+        if ((in >= 0 && dup2(in, STDIN_FILENO) < 0) || dup2(out[1], STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        if (path != NULL) {
+            execlp(tool, tool, "-dcq", "--", path, (char *) NULL);
+        } else {
+            execlp(tool, tool, "-dcq", (char *) NULL);
+        }
+        _exit(127);
+    }
+    close(out[1]);
+    if (*child < 0) {
+        close(out[0]);
+        return -1;
+    }
+    return out[0];
+}
+
+/**
+ * open_pipe creates a pipe with both ends marked close-on-exec.
+ */
+int open_pipe(int fds[2]) {
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+/**
+ * zstd_frame_end returns the end of the zstd frame (or skippable frame)
+ * starting at p, by walking its frame and block headers without
+ * decompressing anything, or NULL if p does not hold a whole valid frame
+ * before end.
+ */
+const char *zstd_frame_end(const char *p, const char *end) {
+    static const size_t dict_id_size[4] = { 0, 1, 2, 4 };
+    const unsigned char *q = (const unsigned char *) p;
+    size_t avail = (size_t) (end - p);
+    size_t pos;
+    unsigned fhd;
+    uint32_t magic;
+
+    if (avail < 8) {
+        return NULL;
+    }
+    magic = get_u32(q);
+    if ((magic & 0xFFFFFFF0u) == 0x184D2A50u) {
+        uint32_t size = get_u32(q + 4);
+
+        return size <= avail - 8 ? p + 8 + size : NULL;
+    }
+    if (magic != 0xFD2FB528u || (q[4] & 0x08) != 0) {
+        return NULL;
+    }
+
+    /* Frame header: window descriptor unless single segment, dictionary */
+    /* id, then a content size whose width depends on its flag. */
+    fhd = q[4];
+    pos = 5 + !(fhd & 0x20) + dict_id_size[fhd & 3];
+    pos += (fhd >> 6) == 0 ? (fhd & 0x20) != 0 : (size_t) 1 << (fhd >> 6);
+
+    for (;;) {
+        uint32_t block;
+        unsigned type;
+
+        if (pos + 3 > avail) {
+            return NULL;
+        }
+        block = q[pos] | (uint32_t) q[pos + 1] << 8 | (uint32_t) q[pos + 2] << 16;
+        type = (block >> 1) & 3;
+        if (type == 3) {
+            return NULL;
+        }
+        pos += 3 + (type == 1 ? 1 : block >> 3);
+        if (pos > avail) {
+            return NULL;
+        }
+        if (block & 1) {
+            break;
+        }
+    }
+    pos += (fhd & 0x04) ? 4 : 0;
+    return pos <= avail ? p + pos : NULL;
+}
+
+/**
+ * analyze_zstd_frames decompresses the run of whole frames in task through
+ * a zstd process, fed from the mapping by a feed_decompressor thread, and
+ * parses the text it gives back the way analyze_stream does. The text
+ * before the first newline (unless the task starts the file) and after
+ * the last one are kept in the task for analyze_parallel instead.
+ */
+void analyze_zstd_frames(struct parse_task *task) {
+    struct decompressor_feed feed;
+    pthread_t feeder;
+    char *buf = malloc(STREAM_BUFFER_SIZE);
+    int in[2];
+    int fd;
+    pid_t child;
+    int status;
+    size_t have = 0;
+    int skipping = 0;
+    int in_head = !task->first;
+
+    if (buf == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    if (open_pipe(in) != 0) {
+        task->failed = 1;
+        free(buf);
+        return;
+    }
+    fd = spawn_decompressor("zstd", NULL, in[0], &child);
+    close(in[0]);
+    feed.fd = in[1];
+    feed.data = task->data;
+    feed.len = task->len;
+    if (fd < 0 || pthread_create(&feeder, NULL, feed_decompressor, &feed) != 0) {
+        close(in[1]);
+        if (fd >= 0) {
+            close(fd);
+            waitpid(child, NULL, 0);
+        }
+        task->failed = 1;
+        free(buf);
+        return;
+    }
+
+    for (;;) {
+        double start = now_seconds();
+        ssize_t n = read(fd, buf + have, STREAM_BUFFER_SIZE - have);
+        const char *p = buf;
+        const char *end;
+        const char *eol;
+
+        task->table.counts.read_seconds += now_seconds() - start;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            task->failed |= n < 0;
+            break;
+        }
+
+        task->table.counts.bytes += (uint64_t) n;
+        end = buf + have + n;
+        if (in_head) {
+            eol = memchr(p, '\n', (size_t) (end - p));
+            append_text(&task->head, &task->head_len, p,
+                    (size_t) ((eol != NULL ? eol : end) - p));
+            if (eol == NULL) {
+                continue;
+            }
+            in_head = 0;
+            task->head_ended = 1;
+            p = eol + 1;
+        }
+        while ((eol = memchr(p, '\n', (size_t) (end - p))) != NULL) {
+            if (!skipping) {
+                analyze_line(p, eol, &task->table);
+            }
+            skipping = 0;
+            p = eol + 1;
+        }
+        have = (size_t) (end - p);
+        memmove(buf, p, have);
+        if (have == STREAM_BUFFER_SIZE) {
+            task->table.counts.truncated += !skipping;
+            skipping = 1;
+            have = 0;
+        }
+    }
+
+    if (skipping) {
+        task->tail_skipped = 1;
+    } else if (have > 0) {
+        append_text(&task->tail, &task->tail_len, buf, have);
+    }
+    close(fd);
+    pthread_join(feeder, NULL);
+    if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        task->failed = 1;
+    }
+    free(buf);
+}
+
+/**
+ * feed_decompressor writes the compressed bytes of a decompressor_feed into
+ * its pipe and closes it, so the decompressor sees the end of its input.
+ */
+void *feed_decompressor(void *arg) {
+    struct decompressor_feed *feed = arg;
+    const char *p = feed->data;
+    size_t left = feed->len;
+
+    while (left > 0) {
+        ssize_t n = write(feed->fd, p, left);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        p += n;
+        left -= (size_t) n;
+    }
+    close(feed->fd);
+    return NULL;
+}
+
+/**
+ * append_text adds n bytes of text to the end of the malloc'd buffer buf
+ * of length len, growing it as needed.
+ */
+void append_text(char **buf, size_t *len, const char *text, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    *buf = realloc(*buf, *len + n);
+    if (*buf == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(*buf + *len, text, n);
+    *len += n;
+}
+
+/**
+ * is_seekable tells apart regular files from pipes and terminals.
+ */
+int is_seekable(FILE *file) {
+    return fseek(file, 0, SEEK_CUR) == 0;
+}
+
+/**
+ * analyze_opened sends an already opened file down the right path: columnar
+ * cache files are mapped and read with analyze_columnar, and TDV files go
+ * through analyze_mapped, analyze_stream or analyze_file depending on mode
+ * and on whether the file can seek.
+ */
+void analyze_opened(FILE *file, enum ingest_mode mode, struct state_table *table) {
+    if (is_columnar(file)) {
+        size_t len;
+        void *data = map_file(file, &len);
+
+        if (data == NULL) {
+            printf("ERROR: columnar file could not be mapped\n");
+            return;
+        }
+        analyze_columnar(data, len, table);
+        munmap(data, len);
+        return;
+    }
+    if (mode == INGEST_MMAP && analyze_mapped(file, table)) {
+        return;
+    }
+    if (mode == INGEST_PREFETCH) {
+        analyze_prefetch(file, table);
+    } else if (mode == INGEST_STREAM || !is_seekable(file)) {
+        analyze_stream(file, table);
+    } else {
+        analyze_file(file, table);
+    }
+}
+
+/**
+ * analyze_parallel spreads the files over a pool of jobs worker threads.
+ * With --mmap each file is also cut into newline aligned byte ranges (see
+ * split_tasks), so a single large file is parsed by several threads at
+ * once. Every task is collected into its own state_table, and once all
+ * workers are done the tables are merged into table in command line and
+ * file order, printing the same messages analyze_path would have. Merging
+ * in that order means first-seen state order, and which record wins ties
+ * on max and min temperature, come out exactly as in a serial run. A .zst
+ * file is cut between frames and each task decompressed by its own zstd
+ * process; the lines that straddle two tasks are put back together here,
+ * and parsed in between them.
+ */
+void analyze_parallel(char *paths[], int num_paths, enum ingest_mode mode, int jobs,
+        struct state_table *table) {
+    struct input_file *inputs = calloc((size_t) num_paths, sizeof(struct input_file));
+    struct task_pool pool;
+    pthread_t *threads = malloc((size_t) jobs * sizeof(pthread_t));
+    double merge_start;
+    double merge_cpu;
+    int started = 0;
+    int i;
+    int t;
+
+    pool.workers = calloc((size_t) jobs, sizeof(struct worker_stats));
+    pool.num_workers = 0;
+    if (inputs == NULL || threads == NULL || pool.workers == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_paths; ++i) {
+        const char *tool = decompressor_for(paths[i]);
+
+        if (tool != NULL && strcmp(tool, "zstd") == 0
+                && (inputs[i].file = fopen(paths[i], "r")) != NULL) {
+            inputs[i].map = map_file(inputs[i].file, &inputs[i].map_len);
+            if (inputs[i].map != NULL) {
+                inputs[i].compressed = 1;
+                /* A zstd process that dies early must not kill us. */
+                signal(SIGPIPE, SIG_IGN);
+                continue;
+            }
+            fclose(inputs[i].file);
+        }
+        inputs[i].file = open_input(paths[i], &inputs[i].decompressor);
+        if (inputs[i].file != NULL && mode == INGEST_MMAP && tool == NULL) {
+            inputs[i].map = map_file(inputs[i].file, &inputs[i].map_len);
+        }
+    }
+
+    pool.mode = mode;
+    pool.num_tasks = split_tasks(inputs, num_paths, jobs, &pool.tasks);
+    for (t = 0; t < pool.num_tasks; ++t) {
+        pool.tasks[t].table.bucket = table->bucket;
+        pool.tasks[t].table.quantiles = table->quantiles;
+        pool.tasks[t].table.filter = table->filter;
+        memcpy(pool.tasks[t].table.metrics, table->metrics, sizeof(table->metrics));
+        pool.tasks[t].table.num_metrics = table->num_metrics;
+        pool.tasks[t].table.stats = table->stats;
+        pool.tasks[t].table.rejects = table->rejects;
+        if (table->geo != NULL) {
+            pool.tasks[t].table.geo = geo_create(table->geo->precision, table->geo->max_cells);
+        }
+    }
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    if (jobs > pool.num_tasks) {
+        jobs = pool.num_tasks;
+    }
+    for (i = 0; i < jobs; ++i) {
+        if (pthread_create(&threads[started], NULL, analyze_worker, &pool) == 0) {
+            ++started;
+        }
+    }
+    /* If no thread could be started this thread does all of the work. */
+    if (started == 0) {
+        analyze_worker(&pool);
+    }
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    merge_start = now_seconds();
+    merge_cpu = cpu_seconds(CLOCK_THREAD_CPUTIME_ID);
+    for (i = 0, t = 0; i < num_paths; ++i) {
+        char *pending = NULL;
+        size_t pending_len = 0;
+        int pending_skipped = 0;
+        int failed = 0;
+
+        if (inputs[i].file == NULL) {
+            printf("ERROR: %s does not exist\n", paths[i]);
+            continue;
+        }
+        printf("Opening file: %s\n", paths[i]);
+        for (; t < pool.num_tasks && pool.tasks[t].input == i; ++t) {
+            struct parse_task *task = &pool.tasks[t];
+
+            /* The line cut by the frame boundary goes in between tasks. */
+            append_text(&pending, &pending_len, task->head, task->head_len);
+            if (task->head_ended) {
+                if (pending_len >= STREAM_BUFFER_SIZE && !pending_skipped) {
+                    table->counts.truncated++;
+                } else if (pending_len > 0 && !pending_skipped) {
+                    analyze_line(pending, pending + pending_len, table);
+                }
+                pending_len = 0;
+                pending_skipped = 0;
+            }
+            merge_table(table, &task->table);
+            free_table(&task->table);
+            if (task->first || task->head_ended) {
+                append_text(&pending, &pending_len, task->tail, task->tail_len);
+                pending_skipped = task->tail_skipped;
+            }
+            failed |= task->failed;
+            free(task->head);
+            free(task->tail);
+        }
+        if (pending_len >= STREAM_BUFFER_SIZE && !pending_skipped) {
+            table->counts.truncated++;
+        } else if (pending_len > 0 && !pending_skipped) {
+            analyze_line(pending, pending + pending_len, table);
+        }
+        free(pending);
+        if (failed) {
+            printf("ERROR: %s could not be decompressed\n", paths[i]);
+        }
+        if (inputs[i].map != NULL) {
+            munmap(inputs[i].map, inputs[i].map_len);
+        }
+        close_input(inputs[i].file, inputs[i].decompressor, paths[i]);
+    }
+    table->counts.merge_seconds += now_seconds() - merge_start;
+    table->counts.merge_cpu += cpu_seconds(CLOCK_THREAD_CPUTIME_ID) - merge_cpu;
+
+    if (table->stats) {
+        free(table->workers);
+        table->workers = pool.workers;
+        table->num_workers = pool.num_workers;
+    } else {
+        free(pool.workers);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.tasks);
+    free(inputs);
+    free(threads);
+}
+
+/**
+ * split_tasks builds the task list for analyze_parallel, in file order.
+ * Mapped files are cut into pieces of about a quarter of an even share of
+ * the total mapped bytes per job (but no smaller than 1 MiB), giving the
+ * pool enough tasks to balance out uneven files. Each cut is moved forward
+ * to just past the next newline so no line is split between tasks. Files
+ * that were not mapped become a single task each. Mapped columnar files
+ * are cut the same way, but only between blocks, and mapped .zst files
+ * only between frames (as a single task if the frames cannot be walked,
+ * leaving zstd to report what is wrong). Returns the number of tasks.
+ */
+int split_tasks(struct input_file *inputs, int num_inputs, int jobs, struct parse_task **tasks) {
+    const size_t min_chunk = 1 << 20;
+    size_t total = 0;
+    size_t chunk;
+    int count = 0;
+    int cap = num_inputs + 4 * jobs;
+    int i;
+
+    for (i = 0; i < num_inputs; ++i) {
+        total += inputs[i].map_len;
+    }
+    chunk = total / ((size_t) jobs * 4);
+    if (chunk < min_chunk) {
+        chunk = min_chunk;
+    }
+
+    *tasks = calloc((size_t) cap, sizeof(struct parse_task));
+    if (*tasks == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_inputs; ++i) {
+        const char *data = inputs[i].map;
+        const char *end = NULL;
+        const char *columnar = NULL;
+
+        if (inputs[i].file == NULL) {
+            continue;
+        }
+        if (data != NULL && columnar_header_ok(data, inputs[i].map_len)) {
+            columnar = data;
+            end = data + get_u64((const unsigned char *) data + COLUMNAR_INDEX_OFFSET);
+            data += COLUMNAR_HEADER_SIZE;
+        } else if (data != NULL) {
+            end = data + inputs[i].map_len;
+        }
+        do {
+            const char *cut = NULL;
+            struct parse_task *task;
+
+            if (columnar != NULL) {
+                /* Whole blocks only: walk block headers until past chunk. */
+                cut = data;
+                while (cut < end && (size_t) (cut - data) < chunk) {
+                    uint32_t n = get_u32((const unsigned char *) cut);
+                    size_t size = columnar_block_size(n);
+
+                    cut = size <= (size_t) (end - cut) ? cut + size : end;
+                }
+            } else if (inputs[i].compressed) {
+                cut = data;
+                while (cut < end && (size_t) (cut - data) < chunk) {
+                    const char *next = zstd_frame_end(cut, end);
+
+                    cut = next != NULL ? next : end;
+                }
+            } else if (data != NULL) {
+                cut = (size_t) (end - data) > chunk ? data + chunk : end;
+                if (cut < end) {
+                    cut = memchr(cut, '\n', (size_t) (end - cut));
+                    cut = cut != NULL ? cut + 1 : end;
+                }
+            }
+            if (count == cap) {
+                cap *= 2;
+                *tasks = realloc(*tasks, (size_t) cap * sizeof(struct parse_task));
+                if (*tasks == NULL) {
+                    printf("ERROR: Memory could not be allocated\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            task = &(*tasks)[count++];
+            memset(task, 0, sizeof(*task));
+            task->input = i;
+            task->file = inputs[i].file;
+            task->columnar = columnar;
+            task->compressed = inputs[i].compressed;
+            task->first = data == inputs[i].map;
+            task->data = data;
+            task->len = (size_t) (cut - data);
+            data = cut;
+        } while (data != NULL && data < end);
+    }
+    return count;
+}
+
+/**
+ * analyze_worker is the body of each worker thread of analyze_parallel.
+ */
+void *analyze_worker(void *arg) {
+    struct task_pool *pool = arg;
+    struct worker_stats *self;
+    double cpu_start = cpu_seconds(CLOCK_THREAD_CPUTIME_ID);
+
+    pthread_mutex_lock(&pool->lock);
+    self = &pool->workers[pool->num_workers++];
+    pthread_mutex_unlock(&pool->lock);
+
+    for (;;) {
+        struct parse_task *task;
+        double start;
+        int i;
+
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->num_tasks) {
+            break;
+        }
+
+        task = &pool->tasks[i];
+        start = now_seconds();
+        if (task->columnar != NULL) {
+            analyze_columnar_blocks(task->columnar, task->data, task->data + task->len,
+                    &task->table);
+        } else if (task->compressed) {
+            analyze_zstd_frames(task);
+        } else if (task->data != NULL) {
+            analyze_buffer(task->data, task->len, &task->table);
+        } else {
+            analyze_opened(task->file, pool->mode, &task->table);
+        }
+        self->tasks++;
+        self->bytes += task->table.counts.bytes;
+        self->lines += task->table.counts.lines;
+        self->busy_seconds += now_seconds() - start;
+    }
+    self->cpu_seconds = cpu_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    return NULL;
+}
+
+/**
+ * merge_table folds every state of src into dst, as if the records behind
+ * src had been read after those behind dst. Counts and sums (and the
+ * run_stats) are added; a max or min from src only replaces the one in dst
+ * if it is strictly beyond it, so on ties the earlier record keeps its
+ * timestamp.
+ */
+void merge_table(struct state_table *dst, const struct state_table *src) {
+    int i;
+
+    if (dst->geo != NULL && src->geo != NULL) {
+        geo_merge(dst->geo, src->geo);
+    }
+    dst->counts.bytes += src->counts.bytes;
+    dst->counts.lines += src->counts.lines;
+    dst->counts.malformed += src->counts.malformed;
+    dst->counts.filtered += src->counts.filtered;
+    dst->counts.truncated += src->counts.truncated;
+    dst->counts.read_seconds += src->counts.read_seconds;
+
+    for (i = 0; i < src->num_states; ++i) {
+        const struct climate_info *from = &src->states[i];
+        struct climate_info *info;
+
+        if (from->num_records == 0) {
+            continue;
+        }
+        info = find_state(dst, from->code);
+        if (info->num_records == 0) {
+            struct arena *arena = info->arena;
+
+            *info = *from;
+            info->arena = arena;
+            info->num_buckets = 0;
+            info->series_skipped = 0;
+            info->buckets = NULL;
+            info->sketch = NULL;
+            info->metrics = NULL;
+            merge_series(info, from);
+            merge_sketch(info, from);
+            merge_metrics(info, from);
+            continue;
+        }
+        merge_series(info, from);
+        merge_sketch(info, from);
+        merge_metrics(info, from);
+
+        merge_moments(&info->temperature_moments, info->num_records,
+                &from->temperature_moments, from->num_records);
+        merge_moments(&info->humidity_moments, info->num_records,
+                &from->humidity_moments, from->num_records);
+        info->num_records += from->num_records;
+        merge_compensated(&info->sum_temperature, &from->sum_temperature);
+        merge_compensated(&info->sum_humidity, &from->sum_humidity);
+        info->snow_records += from->snow_records;
+        merge_compensated(&info->sum_cloud_cover, &from->sum_cloud_cover);
+        info->lightning_strikes += from->lightning_strikes;
+
+        if (from->max_temperature > info->max_temperature) {
+            info->max_temperature = from->max_temperature;
+            info->max_timestamp = from->max_timestamp;
+        }
+        if (from->min_temperature < info->min_temperature) {
+            info->min_temperature = from->min_temperature;
+            info->min_timestamp = from->min_timestamp;
+        }
+    }
+}
+
+/**
+ * free_table releases the structs, their arena (and geohash index) held by
+ * a state_table and empties it, keeping its bucket, quantiles, filter,
+ * metrics, stats and rejects settings.
+ */
+void free_table(struct state_table *table) {
+    enum bucket_kind bucket = table->bucket;
+    int quantiles = table->quantiles;
+    const struct record_filter *filter = table->filter;
+    int metrics[NUM_METRICS];
+    int num_metrics = table->num_metrics;
+    int stats = table->stats;
+    FILE *rejects = table->rejects;
+
+    memcpy(metrics, table->metrics, sizeof(metrics));
+    arena_release(table->arena);
+    free(table->workers);
+    free(table->arena);
+    free(table->states);
+    free(table->other_slot);
+    geo_free(table->geo);
+    memset(table, 0, sizeof(*table));
+    table->bucket = bucket;
+    table->quantiles = quantiles;
+    table->filter = filter;
+    memcpy(table->metrics, metrics, sizeof(metrics));
+    table->num_metrics = num_metrics;
+    table->stats = stats;
+    table->rejects = rejects;
+}
+
+/**
+ * arena_alloc returns size bytes of zeroed memory from arena, aligned for
+ * any type. A request that does not fit in the current chunk starts a new
+ * one, unless it is larger than ARENA_LARGE_SIZE, in which case it is
+ * given a chunk to itself behind the current one, which keeps filling.
+ * Program exits if allocation fails.
+ */
+void *arena_alloc(struct arena *arena, size_t size) {
+    const size_t header = (sizeof(struct arena_chunk) + 15) & ~(size_t) 15;
+    struct arena_chunk *chunk = arena->chunks;
+
+    size = (size + 15) & ~(size_t) 15;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        int large = size > ARENA_LARGE_SIZE;
+        size_t capacity = large ? size : ARENA_CHUNK_SIZE;
+        struct arena_chunk *fresh = calloc(1, header + capacity);
+
+        if (fresh == NULL) {
+            printf("ERROR: Memory could not be allocated\n");
+            exit(EXIT_FAILURE);
+        }
+        fresh->size = capacity;
+        if (chunk != NULL && large) {
+            fresh->next = chunk->next;
+            chunk->next = fresh;
+        } else {
+            fresh->next = chunk;
+            arena->chunks = fresh;
+        }
+        chunk = fresh;
+    }
+    chunk->used += size;
+    return (char *) chunk + header + chunk->used - size;
+}
+
+/**
+ * arena_free gives back p, allocated with the given size, if that was large
+ * enough for it to have a chunk of its own. Anything else stays allocated
+ * until arena_release.
+ */
+void arena_free(struct arena *arena, void *p, size_t size) {
+    const size_t header = (sizeof(struct arena_chunk) + 15) & ~(size_t) 15;
+    struct arena_chunk **link = &arena->chunks;
+
+    size = (size + 15) & ~(size_t) 15;
+    while (p != NULL && size > ARENA_LARGE_SIZE && *link != NULL) {
+        struct arena_chunk *chunk = *link;
+
+        if ((char *) chunk + header == p) {
+            *link = chunk->next;
+            free(chunk);
+            return;
+        }
+        link = &chunk->next;
+    }
+}
+
+/**
+ * arena_release frees every chunk of arena (which may be NULL) at once,
+ * along with everything that was allocated from them.
+ */
+void arena_release(struct arena *arena) {
+    struct arena_chunk *chunk = arena != NULL ? arena->chunks : NULL;
+
+    while (chunk != NULL) {
+        struct arena_chunk *next = chunk->next;
+
+        free(chunk);
+        chunk = next;
+    }
+    if (arena != NULL) {
+        arena->chunks = NULL;
+    }
+}
+
+/**
+ * Little-endian encoding helpers for the partial result format, so .agg
+ * files can be moved between machines.
+ */
+void put_u32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char) (v >> (8 * i));
+    }
+}
+
+void put_u64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (unsigned char) (v >> (8 * i));
+    }
+}
+
+void put_f64(unsigned char *p, double v) {
+    uint64_t bits;
+
+    memcpy(&bits, &v, sizeof(bits));
+    put_u64(p, bits);
+}
+
+uint32_t get_u32(const unsigned char *p) {
+    uint32_t v = 0;
+
+    for (int i = 3; i >= 0; --i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+
+    for (int i = 7; i >= 0; --i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+double get_f64(const unsigned char *p) {
+    uint64_t bits = get_u64(p);
+    double v;
+
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+/**
+ * save_partial writes the aggregates in table to path so they can be merged
+ * later with --merge instead of re-reading the files behind them. The
+ * sums are stored as their compensated_sum pair of doubles, which keeps
+ * them exact. Each record is laid out as:
+ *
+ *   0   code (2 chars, NUL padded to 8)
+ *   8   num_records            u64
+ *   16  sum_temperature        f64 + f64
+ *   32  sum_humidity           f64 + f64
+ *   48  sum_cloud_cover        f64 + f64
+ *   64  snow_records           u64
+ *   72  lightning_strikes      u64
+ *   80  max_temperature        f32
+ *   84  min_temperature        f32
+ *   88  max_timestamp          i64
+ *   96  min_timestamp          i64
+ *   104 temperature mean, m2   f64 + f64
+ *   120 humidity mean, m2      f64 + f64
+ *
+ * After each record comes its quantile sketch, as a u32 count of non-empty
+ * bins and then a u32 bin number and u64 count for each of them, the
+ * humidity bins numbered on from the temperature ones. States without a
+ * sketch just have a count of 0 (see save_sketch). Then come its optional
+ * metrics, as a u32 count and then for each metric the state has a u32
+ * metric id and its metric_accum (u64 count, f64 + f64 sum, f64 min and
+ * f64 max; see save_metrics).
+ *
+ * Returns 1 on success, or 0 (after printing an error) on failure.
+ */
+int save_partial(const char *path, const struct state_table *table) {
+    unsigned char header[PARTIAL_HEADER_SIZE] = { 0 };
+    unsigned char rec[PARTIAL_RECORD_SIZE];
+    FILE *file = fopen(path, "wb");
+    int ok;
+    int i;
+
+    if (file == NULL) {
+        printf("ERROR: %s could not be written\n", path);
+        return 0;
+    }
+
+    memcpy(header, PARTIAL_MAGIC, sizeof(PARTIAL_MAGIC));
+    put_u32(header + 8, PARTIAL_VERSION);
+    put_u32(header + 12, (uint32_t) table->num_states);
+    ok = fwrite(header, sizeof(header), 1, file) == 1;
+
+    for (i = 0; ok && i < table->num_states; ++i) {
+        const struct climate_info *info = &table->states[i];
+        const struct compensated_sum *sums[3] = { &info->sum_temperature, &info->sum_humidity,
+            &info->sum_cloud_cover };
+        uint32_t bits;
+
+        memset(rec, 0, sizeof(rec));
+        memcpy(rec, info->code, 2);
+        put_u64(rec + 8, info->num_records);
+        for (int k = 0; k < 3; ++k) {
+            put_f64(rec + 16 + 16 * k, sums[k]->sum);
+            put_f64(rec + 24 + 16 * k, sums[k]->correction);
+        }
+        put_u64(rec + 64, info->snow_records);
+        put_u64(rec + 72, info->lightning_strikes);
+        memcpy(&bits, &info->max_temperature, sizeof(bits));
+        put_u32(rec + 80, bits);
+        memcpy(&bits, &info->min_temperature, sizeof(bits));
+        put_u32(rec + 84, bits);
+        put_u64(rec + 88, (uint64_t) (int64_t) info->max_timestamp);
+        put_u64(rec + 96, (uint64_t) (int64_t) info->min_timestamp);
+        put_f64(rec + 104, info->temperature_moments.mean);
+        put_f64(rec + 112, info->temperature_moments.m2);
+        put_f64(rec + 120, info->humidity_moments.mean);
+        put_f64(rec + 128, info->humidity_moments.m2);
+        ok = fwrite(rec, sizeof(rec), 1, file) == 1;
+
+        ok = ok && save_sketch(file, info->sketch);
+        ok = ok && save_metrics(file, info->metrics);
+    }
+
+    if (fclose(file) != 0 || !ok) {
+        printf("ERROR: %s could not be written\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * save_sketch writes the quantile sketch that follows each record of a
+ * partial result file (see save_partial). Returns 1 on success.
+ */
+int save_sketch(FILE *file, const struct quantile_sketch *sketch) {
+    const uint64_t *bins[2] = { NULL, NULL };
+    long num_bins[2] = { SKETCH_TEMPERATURE_BINS, SKETCH_HUMIDITY_BINS };
+    unsigned char entry[12];
+    uint32_t used = 0;
+    uint32_t number = 0;
+    int ok;
+
+    if (sketch != NULL) {
+        bins[0] = sketch->temperature;
+        bins[1] = sketch->humidity;
+        for (int k = 0; k < 2; ++k) {
+            for (long b = 0; b < num_bins[k]; ++b) {
+                used += bins[k][b] != 0;
+            }
+        }
+    }
+    put_u32(entry, used);
+    ok = fwrite(entry, 4, 1, file) == 1;
+    for (int k = 0; ok && used > 0 && k < 2; ++k) {
+        for (long b = 0; ok && b < num_bins[k]; ++b, ++number) {
+            if (bins[k][b] != 0) {
+                put_u32(entry, number);
+                put_u64(entry + 4, bins[k][b]);
+                ok = fwrite(entry, sizeof(entry), 1, file) == 1;
+            }
+        }
+    }
+    return ok;
+}
+
+/**
+ * save_metrics writes the metrics that follow each record's sketch in a
+ * partial result file (see save_partial). Returns 1 on success.
+ */
+int save_metrics(FILE *file, const struct metric_accum *metrics) {
+    unsigned char entry[44];
+    uint32_t used = 0;
+    int ok;
+    int id;
+
+    for (id = 0; metrics != NULL && id < NUM_METRICS; ++id) {
+        used += metrics[id].count > 0;
+    }
+    put_u32(entry, used);
+    ok = fwrite(entry, 4, 1, file) == 1;
+    for (id = 0; ok && used > 0 && id < NUM_METRICS; ++id) {
+        if (metrics[id].count > 0) {
+            put_u32(entry, (uint32_t) id);
+            put_u64(entry + 4, metrics[id].count);
+            put_f64(entry + 12, metrics[id].sum.sum);
+            put_f64(entry + 20, metrics[id].sum.correction);
+            put_f64(entry + 28, metrics[id].min);
+            put_f64(entry + 36, metrics[id].max);
+            ok = fwrite(entry, sizeof(entry), 1, file) == 1;
+        }
+    }
+    return ok;
+}
+
+/**
+ * load_partial reads a file written by save_partial and merges it into
+ * table with merge_table, just as if the records behind it had been read
+ * at this point. Returns 1 on success, or 0 (after printing an error) if
+ * the file is missing or is not a partial result.
+ */
+int load_partial(const char *path, struct state_table *table) {
+    FILE *file = fopen(path, "rb");
+    uint32_t count;
+    int ok;
+
+    if (file == NULL) {
+        printf("ERROR: %s does not exist\n", path);
+        return 0;
+    }
+    if (!read_partial_header(file, path, &count)) {
+        fclose(file);
+        return 0;
+    }
+    printf("Opening file: %s\n", path);
+    ok = read_partial_states(file, path, count, table);
+    fclose(file);
+    return ok;
+}
+
+/**
+ * read_partial_header checks the header of a partial result, which name
+ * stands for in error messages, and sets count to its number of states.
+ * Returns 1 if it is one, or 0 after printing an error.
+ */
+int read_partial_header(FILE *file, const char *name, uint32_t *count) {
+    unsigned char header[PARTIAL_HEADER_SIZE];
+
+    if (fread(header, sizeof(header), 1, file) != 1
+            || memcmp(header, PARTIAL_MAGIC, sizeof(PARTIAL_MAGIC)) != 0
+            || get_u32(header + 8) != PARTIAL_VERSION) {
+        printf("ERROR: %s is not a climate partial result\n", name);
+        return 0;
+    }
+    *count = get_u32(header + 12);
+    return 1;
+}
+
+/**
+ * read_partial_states reads the count states that follow the header of a
+ * partial result and merges them into table. Returns 1 on success, or 0
+ * after printing an error if it is truncated; what was read up to there
+ * is merged all the same.
+ */
+int read_partial_states(FILE *file, const char *name, uint32_t count, struct state_table *table) {
+    unsigned char rec[PARTIAL_RECORD_SIZE];
+    struct state_table partial = { 0 };
+    uint32_t i;
+
+    for (i = 0; i < count; ++i) {
+        struct climate_info *info;
+        char code[3] = { 0 };
+        uint32_t bits;
+
+        if (fread(rec, sizeof(rec), 1, file) != 1) {
+            printf("ERROR: %s is truncated\n", name);
+            break;
+        }
+        memcpy(code, rec, 2);
+        info = find_state(&partial, code);
+        info->num_records = get_u64(rec + 8);
+        info->sum_temperature.sum = get_f64(rec + 16);
+        info->sum_temperature.correction = get_f64(rec + 24);
+        info->sum_humidity.sum = get_f64(rec + 32);
+        info->sum_humidity.correction = get_f64(rec + 40);
+        info->sum_cloud_cover.sum = get_f64(rec + 48);
+        info->sum_cloud_cover.correction = get_f64(rec + 56);
+        info->snow_records = get_u64(rec + 64);
+        info->lightning_strikes = get_u64(rec + 72);
+        bits = get_u32(rec + 80);
+        memcpy(&info->max_temperature, &bits, sizeof(bits));
+        bits = get_u32(rec + 84);
+        memcpy(&info->min_temperature, &bits, sizeof(bits));
+        info->max_timestamp = (long) (int64_t) get_u64(rec + 88);
+        info->min_timestamp = (long) (int64_t) get_u64(rec + 96);
+        info->temperature_moments.mean = get_f64(rec + 104);
+        info->temperature_moments.m2 = get_f64(rec + 112);
+        info->humidity_moments.mean = get_f64(rec + 120);
+        info->humidity_moments.m2 = get_f64(rec + 128);
+
+        uint32_t used;
+
+        if (fread(rec, 4, 1, file) != 1) {
+            printf("ERROR: %s is truncated\n", name);
+            break;
+        }
+        used = get_u32(rec);
+        if (used > 0 && info->sketch == NULL) {
+            info->sketch = arena_alloc(info->arena, sizeof(struct quantile_sketch));
+        }
+        for (; used > 0; --used) {
+            uint32_t b;
+
+            if (fread(rec, 12, 1, file) != 1) {
+                break;
+            }
+            b = get_u32(rec);
+            if (b < SKETCH_TEMPERATURE_BINS) {
+                info->sketch->temperature[b] += get_u64(rec + 4);
+            } else if (b < SKETCH_TEMPERATURE_BINS + SKETCH_HUMIDITY_BINS) {
+                info->sketch->humidity[b - SKETCH_TEMPERATURE_BINS] += get_u64(rec + 4);
+            }
+        }
+        if (used > 0) {
+            printf("ERROR: %s is truncated\n", name);
+            break;
+        }
+
+        if (fread(rec, 4, 1, file) != 1) {
+            printf("ERROR: %s is truncated\n", name);
+            break;
+        }
+        for (used = get_u32(rec); used > 0; --used) {
+            uint32_t id;
+
+            if (fread(rec, 44, 1, file) != 1) {
+                break;
+            }
+            id = get_u32(rec);
+            if (id >= NUM_METRICS) {
+                continue;
+            }
+            if (info->metrics == NULL) {
+                info->metrics = arena_alloc(info->arena, NUM_METRICS * sizeof(struct metric_accum));
+            }
+            info->metrics[id].count = get_u64(rec + 4);
+            info->metrics[id].sum.sum = get_f64(rec + 12);
+            info->metrics[id].sum.correction = get_f64(rec + 20);
+            info->metrics[id].min = get_f64(rec + 28);
+            info->metrics[id].max = get_f64(rec + 36);
+        }
+        if (used > 0) {
+            printf("ERROR: %s is truncated\n", name);
+            break;
+        }
+    }
+
+    merge_table(table, &partial);
+    free_table(&partial);
+    return i == count;
+}
+
+/**
+ * days_from_civil counts the days from 1970-01-01 to the given date in the
+ * proleptic Gregorian calendar, and civil_from_days turns such a count back
+ * into a date. Both work without the C library's time zone handling, which
+ * bucketing (always in UTC) does not need.
+ */
+long days_from_civil(long year, unsigned month, unsigned day) {
+    long era;
+    unsigned yoe;
+    unsigned doy;
+    unsigned doe;
+
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = (unsigned) (year - era * 400);
+    doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long) doe - 719468;
+}
+
+void civil_from_days(long days, long *year, unsigned *month, unsigned *day) {
+    long era;
+    unsigned doe;
+    unsigned yoe;
+    unsigned doy;
+    unsigned mp;
+
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = (unsigned) (days - era * 146097);
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = (long) yoe + era * 400 + (*month <= 2);
+}
+
+/**
+ * bucket_of numbers the hour, day or month (UTC) a timestamp falls in,
+ * counting from the start of 1970.
+ */
+long bucket_of(long timestamp, enum bucket_kind kind) {
+    long days = timestamp >= 0 ? timestamp / 86400 : -((-timestamp + 86399) / 86400);
+    long year;
+    unsigned month;
+    unsigned day;
+
+    switch (kind) {
+    case BUCKET_HOUR:
+        return timestamp >= 0 ? timestamp / 3600 : -((-timestamp + 3599) / 3600);
+    case BUCKET_DAY:
+        return days;
+    case BUCKET_MONTH:
+        civil_from_days(days, &year, &month, &day);
+        return (year - 1970) * 12 + (long) month - 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * series_slot returns the accumulator for the given bucket of a state's
+ * series. The series is a single array covering every bucket from
+ * first_bucket on; when a bucket falls outside it the array is regrown,
+ * with room to spare in the direction it grew, so that it is only
+ * regrown a handful of times however the records are ordered. The old
+ * array goes back to the arena. The array never covers more than
+ * SERIES_MAX_BUCKETS buckets, so a single bad timestamp cannot make it
+ * too large to allocate: a bucket that would take it past that gets NULL,
+ * and the caller counts the record in series_skipped instead. Program
+ * exits if allocation fails.
+ */
+struct bucket_accum *series_slot(struct climate_info *info, long bucket) {
+    if (info->num_buckets == 0 || bucket < info->first_bucket
+            || bucket >= info->first_bucket + info->num_buckets) {
+        long first = info->num_buckets == 0 ? bucket : info->first_bucket;
+        long end = info->num_buckets == 0 ? bucket + 1 : info->first_bucket + info->num_buckets;
+        long spare = info->num_buckets / 2 + 16;
+        struct bucket_accum *grown;
+
+        if (bucket < first) {
+            if (end - bucket > SERIES_MAX_BUCKETS) {
+                return NULL;
+            }
+            first = end - (bucket - spare) > SERIES_MAX_BUCKETS ? end - SERIES_MAX_BUCKETS
+                    : bucket - spare;
+        } else if (bucket >= end) {
+            if (bucket + 1 - first > SERIES_MAX_BUCKETS) {
+                return NULL;
+            }
+            end = bucket + 1 + spare - first > SERIES_MAX_BUCKETS ? first + SERIES_MAX_BUCKETS
+                    : bucket + 1 + spare;
+        }
+        grown = arena_alloc(info->arena, (size_t) (end - first) * sizeof(struct bucket_accum));
+        if (info->num_buckets > 0) {
+            memcpy(grown + (info->first_bucket - first), info->buckets,
+                    (size_t) info->num_buckets * sizeof(struct bucket_accum));
+        }
+        arena_free(info->arena, info->buckets,
+                (size_t) info->num_buckets * sizeof(struct bucket_accum));
+        info->buckets = grown;
+        info->first_bucket = first;
+        info->num_buckets = end - first;
+    }
+    return &info->buckets[bucket - info->first_bucket];
+}
+
+/**
+ * add_to_bucket adds one record to the given bucket of a state's series,
+ * or counts it in series_skipped if the bucket is too far from the others
+ * (see series_slot).
+ */
+void add_to_bucket(struct climate_info *info, long bucket, float temperature, double humidity) {
+    struct bucket_accum *b = series_slot(info, bucket);
+
+    if (b == NULL) {
+        info->series_skipped++;
+        return;
+    }
+    if (b->num_records == 0) {
+        b->max_temperature = temperature;
+        b->min_temperature = temperature;
+    } else {
+        if (temperature > b->max_temperature) {
+            b->max_temperature = temperature;
+        }
+        if (temperature < b->min_temperature) {
+            b->min_temperature = temperature;
+        }
+    }
+    b->num_records++;
+    b->sum_temperature += temperature;
+    b->sum_humidity += humidity;
+}
+
+/**
+ * merge_series adds the buckets of src's series into dst's, and its
+ * skipped records to dst's, together with those of any bucket that does
+ * not fit in dst's series.
+ */
+void merge_series(struct climate_info *dst, const struct climate_info *src) {
+    dst->series_skipped += src->series_skipped;
+    for (long i = 0; i < src->num_buckets; ++i) {
+        const struct bucket_accum *from = &src->buckets[i];
+        struct bucket_accum *b;
+
+        if (from->num_records == 0) {
+            continue;
+        }
+        b = series_slot(dst, src->first_bucket + i);
+        if (b == NULL) {
+            dst->series_skipped += from->num_records;
+            continue;
+        }
+        if (b->num_records == 0 || from->max_temperature > b->max_temperature) {
+            b->max_temperature = from->max_temperature;
+        }
+        if (b->num_records == 0 || from->min_temperature < b->min_temperature) {
+            b->min_temperature = from->min_temperature;
+        }
+        b->num_records += from->num_records;
+        b->sum_temperature += from->sum_temperature;
+        b->sum_humidity += from->sum_humidity;
+    }
+}
+
+/**
+ * print_series prints the time series of every state after the report, one
+ * line per bucket that has records, oldest first, and then the number of
+ * records left out of it (see series_slot), if any. As JSON Lines, each
+ * line is an object of type "series" naming its state and bucket, and the
+ * records left out are an object of type "series_skipped".
+ */
+void print_series(struct output *out, const struct state_table *table,
+        const struct report_options *options) {
+    static const char *const names[] = { "", "hour", "day", "month" };
+    int i;
+
+    for (i = 0; i < table->num_states; ++i) {
+        const struct climate_info *info = &table->states[i];
+
+        if (options->format == FORMAT_TEXT) {
+            out_str(out, "-- State: ");
+            out_str(out, info->code);
+            out_str(out, " by ");
+            out_str(out, names[table->bucket]);
+            out_str(out, " --\n");
+        }
+        for (long k = 0; k < info->num_buckets; ++k) {
+            const struct bucket_accum *b = &info->buckets[k];
+            char label[48];
+
+            if (b->num_records == 0) {
+                continue;
+            }
+            bucket_label(label, sizeof(label), info->first_bucket + k, table->bucket);
+            if (options->format == FORMAT_JSONL) {
+                out_str(out, "{\"type\":\"series\",\"code\":");
+                out_quoted(out, info->code, FORMAT_JSONL);
+                out_str(out, ",\"bucket\":");
+                out_quoted(out, label, FORMAT_JSONL);
+            }
+            out_summary(out, options, label, b->num_records, b->sum_temperature,
+                    b->sum_humidity, b->max_temperature, b->min_temperature);
+            out_str(out, options->format == FORMAT_JSONL ? "}\n" : "\n");
+        }
+        if (info->series_skipped == 0) {
+            continue;
+        }
+        if (options->format == FORMAT_JSONL) {
+            out_str(out, "{\"type\":\"series_skipped\",\"code\":");
+            out_quoted(out, info->code, FORMAT_JSONL);
+            out_str(out, ",\"records\":");
+            out_ulong(out, info->series_skipped, 0);
+            out_str(out, "}\n");
+        } else {
+            out_str(out, "Left out of the series: ");
+            out_ulong(out, info->series_skipped, 0);
+            out_str(out, " records too far in time from the rest\n");
+        }
+    }
+}
+
+/**
+ * bucket_label writes the hour (2015-03-01T14), day (2015-03-01) or month
+ * (2015-03) that bucket numbers (see bucket_of) into label.
+ */
+void bucket_label(char *label, size_t size, long bucket, enum bucket_kind kind) {
+    long year;
+    unsigned month;
+    unsigned day;
+
+    if (kind == BUCKET_MONTH) {
+        long months = bucket + 1970 * 12;
+
+        year = months >= 0 ? months / 12 : -((-months + 11) / 12);
+        snprintf(label, size, "%04ld-%02ld", year, months - year * 12 + 1);
+    } else {
+        long days = kind == BUCKET_DAY ? bucket
+                : (bucket >= 0 ? bucket / 24 : -((-bucket + 23) / 24));
+
+        civil_from_days(days, &year, &month, &day);
+        if (kind == BUCKET_DAY) {
+            snprintf(label, size, "%04ld-%02u-%02u", year, month, day);
+        } else {
+            snprintf(label, size, "%04ld-%02u-%02uT%02ld", year, month, day, bucket - days * 24);
+        }
+    }
+}
+
+/**
+ * sketch_bin gives the bin of a quantile sketch that value (in whole
+ * units) falls in, for a sketch whose first bin is min tenths, clamping
+ * values outside the sketch to its end bins.
+ */
+long sketch_bin(double value, long min, long bins) {
+    double tenths = value * 10 - (double) min;
+    long bin;
+
+    if (!(tenths >= 0)) {
+        return 0;
+    }
+    if (tenths >= (double) bins) {
+        return bins - 1;
+    }
+    bin = (long) (tenths + 0.5);
+    return bin < bins ? bin : bins - 1;
+}
+
+/**
+ * sketch_add counts one record in the quantile sketch of info, creating
+ * the sketch on first use. Program exits if allocation fails.
+ */
+void sketch_add(struct climate_info *info, float temperature, double humidity) {
+    if (info->sketch == NULL) {
+        info->sketch = arena_alloc(info->arena, sizeof(struct quantile_sketch));
+    }
+    info->sketch->temperature[sketch_bin(temperature, SKETCH_TEMPERATURE_MIN,
+            SKETCH_TEMPERATURE_BINS)]++;
+    info->sketch->humidity[sketch_bin(humidity, 0, SKETCH_HUMIDITY_BINS)]++;
+}
+
+/**
+ * merge_sketch adds the quantile sketch of src, if it has one, into dst.
+ */
+void merge_sketch(struct climate_info *dst, const struct climate_info *src) {
+    long b;
+
+    if (src->sketch == NULL) {
+        return;
+    }
+    if (dst->sketch == NULL) {
+        dst->sketch = arena_alloc(dst->arena, sizeof(struct quantile_sketch));
+    }
+    for (b = 0; b < SKETCH_TEMPERATURE_BINS; ++b) {
+        dst->sketch->temperature[b] += src->sketch->temperature[b];
+    }
+    for (b = 0; b < SKETCH_HUMIDITY_BINS; ++b) {
+        dst->sketch->humidity[b] += src->sketch->humidity[b];
+    }
+}
+
+/**
+ * sketch_quantile reads the q quantile of count values off a sketch: the
+ * smallest bin by which at least ceil(q * count) values have been seen
+ * (the nearest-rank definition), returned as the value at its center.
+ */
+double sketch_quantile(const uint64_t *bins, long num_bins, long min, uint64_t count, double q) {
+    uint64_t rank = (uint64_t) (q * (double) count);
+    uint64_t seen = 0;
+    long b;
+
+    if ((double) rank < q * (double) count || rank == 0) {
+        ++rank;
+    }
+    for (b = 0; b < num_bins - 1; ++b) {
+        seen += bins[b];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return (double) (b + min) / 10;
+}
+
+/**
+ * Values of the geohash base32 characters, or -1 for those not in it.
+ */
+static signed char geohash_values[256];
+
+/**
+ * geohash_pack packs up to 12 characters of a geohash into an integer: the
+ * 5 bits of each character from the top of the low 60 bits down, with the
+ * number of characters in the top 4 bits. Packed keys cut to the same
+ * precision then sort in the same order as the geohash strings, and a
+ * cell's sub-cells are a contiguous range. Packing stops at the first
+ * character that is not part of the geohash alphabet.
+ */
+uint64_t geohash_pack(const char *geohash, size_t len) {
+    static const char base32[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+    uint64_t packed = 0;
+    size_t i;
+
+    if (geohash_values['z'] == 0) {
+        memset(geohash_values, -1, sizeof(geohash_values));
+        for (i = 0; i < 32; ++i) {
+            geohash_values[(unsigned char) base32[i]] = (signed char) i;
+        }
+    }
+
+    if (len > 12) {
+        len = 12;
+    }
+    for (i = 0; i < len; ++i) {
+        int v = geohash_values[(unsigned char) geohash[i]];
+
+        if (v < 0) {
+            break;
+        }
+        packed |= (uint64_t) v << (55 - 5 * i);
+    }
+    return packed | (uint64_t) i << 60;
+}
+
+/**
+ * geohash_prefix cuts a packed geohash to its first precision characters,
+ * or returns UINT64_MAX if it is shorter than that.
+ */
+uint64_t geohash_prefix(uint64_t packed, int precision) {
+    if ((int) (packed >> 60) < precision) {
+        return UINT64_MAX;
+    }
+    return packed & (~(uint64_t) 0 << (60 - 5 * precision)) & (((uint64_t) 1 << 60) - 1);
+}
+
+/**
+ * geo_create makes an empty geo_index. Program exits if allocation fails.
+ */
+struct geo_index *geo_create(int precision, size_t max_cells) {
+    struct geo_index *geo = calloc(1, sizeof(struct geo_index));
+
+    if (geo == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    geo->precision = precision;
+    geo->max_cells = max_cells;
+    geo->capacity = 1024;
+    geo->cells = calloc(geo->capacity, sizeof(struct geo_cell));
+    if (geo->cells == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    return geo;
+}
+
+void geo_free(struct geo_index *geo) {
+    if (geo != NULL) {
+        free(geo->cells);
+        free(geo);
+    }
+}
+
+/**
+ * geo_slot finds the cell for key, or the empty slot it belongs in. The
+ * table is kept at most half full, doubling as cells are added, so probe
+ * runs stay short. Keys carry their information in the high bits (low
+ * bits are zero below the precision), so the high bits are folded down
+ * before and after the multiply.
+ */
+struct geo_cell *geo_slot(struct geo_index *geo, uint64_t key) {
+    size_t mask = geo->capacity - 1;
+    uint64_t h = (key ^ (key >> 31)) * 0x9E3779B97F4A7C15ULL;
+    size_t i = (size_t) (h ^ (h >> 29)) & mask;
+
+    while (geo->cells[i].num_records != 0 && geo->cells[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    return &geo->cells[i];
+}
+
+/**
+ * geo_fold adds the totals of from into the cell for key, creating it if
+ * needed. When this takes the index past max_cells it is rolled up one
+ * level (or more, until it is back to half of max_cells) with
+ * geo_coarsen. Program exits if allocation fails.
+ */
+void geo_fold(struct geo_index *geo, const struct geo_cell *from, uint64_t key) {
+    struct geo_cell *cell = geo_slot(geo, key);
+
+    if (cell->num_records == 0) {
+        *cell = *from;
+        cell->key = key;
+
+        if (++geo->count * 2 > geo->capacity) {
+            struct geo_cell *old = geo->cells;
+            size_t old_capacity = geo->capacity;
+
+            geo->capacity *= 2;
+            geo->cells = calloc(geo->capacity, sizeof(struct geo_cell));
+            if (geo->cells == NULL) {
+                printf("ERROR: Memory could not be allocated\n");
+                exit(EXIT_FAILURE);
+            }
+            for (size_t i = 0; i < old_capacity; ++i) {
+                if (old[i].num_records != 0) {
+                    *geo_slot(geo, old[i].key) = old[i];
+                }
+            }
+            free(old);
+        }
+        if (geo->count > geo->max_cells) {
+            int precision = geo->precision;
+
+            while (precision > 1 && geo->count > geo->max_cells / 2) {
+                geo_coarsen(geo, --precision);
+            }
+        }
+        return;
+    }
+
+    if (from->max_temperature > cell->max_temperature) {
+        cell->max_temperature = from->max_temperature;
+    }
+    if (from->min_temperature < cell->min_temperature) {
+        cell->min_temperature = from->min_temperature;
+    }
+    cell->num_records += from->num_records;
+    cell->sum_temperature += from->sum_temperature;
+    cell->sum_humidity += from->sum_humidity;
+    cell->snow_records += from->snow_records;
+    cell->lightning_strikes += from->lightning_strikes;
+}
+
+/**
+ * geo_add adds one record to the cell its geohash falls in. Records whose
+ * geohash is shorter than the index's precision are left out.
+ */
+void geo_add(struct geo_index *geo, uint64_t packed, float temperature, double humidity,
+        int snow, int lightning) {
+    uint64_t key = geohash_prefix(packed, geo->precision);
+    struct geo_cell one;
+    struct geo_cell *cell;
+
+    if (key == UINT64_MAX) {
+        return;
+    }
+    cell = geo_slot(geo, key);
+    if (cell->num_records != 0) {
+        cell->num_records++;
+        cell->sum_temperature += temperature;
+        cell->sum_humidity += humidity;
+        cell->snow_records += snow;
+        cell->lightning_strikes += lightning;
+        if (temperature > cell->max_temperature) {
+            cell->max_temperature = temperature;
+        }
+        if (temperature < cell->min_temperature) {
+            cell->min_temperature = temperature;
+        }
+        return;
+    }
+
+    one.num_records = 1;
+    one.sum_temperature = temperature;
+    one.sum_humidity = humidity;
+    one.snow_records = snow;
+    one.lightning_strikes = lightning;
+    one.max_temperature = temperature;
+    one.min_temperature = temperature;
+    geo_fold(geo, &one, key);
+}
+
+/**
+ * geo_coarsen rolls every cell up into its parent at the given (smaller)
+ * precision. Since a parent's prefix is just the leading characters, this
+ * needs no input but the cells themselves.
+ */
+void geo_coarsen(struct geo_index *geo, int precision) {
+    struct geo_cell *old = geo->cells;
+    size_t old_capacity = geo->capacity;
+
+    geo->cells = calloc(geo->capacity, sizeof(struct geo_cell));
+    if (geo->cells == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    geo->count = 0;
+    geo->precision = precision;
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old[i].num_records != 0) {
+            geo_fold(geo, &old[i], geohash_prefix(old[i].key | (uint64_t) 12 << 60, precision));
+        }
+    }
+    free(old);
+}
+
+/**
+ * geo_merge folds every cell of src into dst, first rolling up whichever
+ * of the two is finer so they are at the same precision.
+ */
+void geo_merge(struct geo_index *dst, const struct geo_index *src) {
+    int precision = dst->precision < src->precision ? dst->precision : src->precision;
+
+    if (dst->precision > precision) {
+        geo_coarsen(dst, precision);
+    }
+    for (size_t i = 0; i < src->capacity; ++i) {
+        const struct geo_cell *cell = &src->cells[i];
+
+        if (cell->num_records != 0) {
+            geo_fold(dst, cell, geohash_prefix(cell->key | (uint64_t) 12 << 60, dst->precision));
+        }
+    }
+}
+
+int compare_geo_cells(const void *a, const void *b) {
+    uint64_t x = ((const struct geo_cell *) a)->key;
+    uint64_t y = ((const struct geo_cell *) b)->key;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * print_geo prints one line per geohash cell, in geohash order, and then
+ * does the same for each coarser level asked for. The cells are sorted
+ * once; since a coarser cell's sub-cells are then next to each other,
+ * every rollup is a single pass over the sorted cells, without going back
+ * to the records.
+ */
+void print_geo(struct output *out, const struct geo_index *geo, const int *levels,
+        int num_levels, const struct report_options *options) {
+    static const char base32[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+    struct geo_cell *sorted = malloc((geo->count + 1) * sizeof(struct geo_cell));
+    size_t n = 0;
+    int level;
+
+    if (sorted == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < geo->capacity; ++i) {
+        if (geo->cells[i].num_records != 0) {
+            sorted[n++] = geo->cells[i];
+        }
+    }
+    qsort(sorted, n, sizeof(struct geo_cell), compare_geo_cells);
+
+    for (level = -1; level < num_levels; ++level) {
+        int precision = level < 0 ? geo->precision : levels[level];
+
+        if (precision < 1 || precision > geo->precision || (level >= 0 && precision == geo->precision)) {
+            continue;
+        }
+        if (options->format == FORMAT_TEXT) {
+            out_str(out, "-- Geohash cells: precision ");
+            out_ulong(out, (unsigned long) precision, 0);
+            out_str(out, " --\n");
+        }
+        for (size_t i = 0; i < n;) {
+            uint64_t key = geohash_prefix(sorted[i].key | (uint64_t) 12 << 60, precision);
+            struct geo_cell total = sorted[i];
+            char label[13];
+
+            for (++i; i < n && geohash_prefix(sorted[i].key | (uint64_t) 12 << 60, precision) == key; ++i) {
+                total.num_records += sorted[i].num_records;
+                total.sum_temperature += sorted[i].sum_temperature;
+                total.sum_humidity += sorted[i].sum_humidity;
+                total.snow_records += sorted[i].snow_records;
+                total.lightning_strikes += sorted[i].lightning_strikes;
+                if (sorted[i].max_temperature > total.max_temperature) {
+                    total.max_temperature = sorted[i].max_temperature;
+                }
+                if (sorted[i].min_temperature < total.min_temperature) {
+                    total.min_temperature = sorted[i].min_temperature;
+                }
+            }
+            for (int c = 0; c < precision; ++c) {
+                label[c] = base32[(key >> (55 - 5 * c)) & 31];
+            }
+            label[precision] = '\0';
+            if (options->format == FORMAT_JSONL) {
+                out_str(out, "{\"type\":\"geohash\",\"cell\":");
+                out_quoted(out, label, FORMAT_JSONL);
+                out_str(out, ",\"precision\":");
+                out_ulong(out, (unsigned long) precision, 0);
+                out_summary(out, options, label, total.num_records, total.sum_temperature,
+                        total.sum_humidity, total.max_temperature, total.min_temperature);
+                out_str(out, ",\"lightning_strikes\":");
+                out_ulong(out, total.lightning_strikes, 0);
+                out_str(out, ",\"snow_records\":");
+                out_ulong(out, total.snow_records, 0);
+                out_str(out, "}\n");
+                continue;
+            }
+            out_summary(out, options, label, total.num_records, total.sum_temperature,
+                    total.sum_humidity, total.max_temperature, total.min_temperature);
+            out_str(out, ", ");
+            out_ulong(out, total.lightning_strikes, 0);
+            out_str(out, " lightning, ");
+            out_ulong(out, total.snow_records, 0);
+            out_str(out, " snow\n");
+        }
+    }
+    free(sorted);
+}
+
+/**
+ * convert_files parses the given TDV files and writes every record to a
+ * columnar cache file at out_path, for later runs to read with
+ * analyze_columnar instead of parsing text again. Lines are read with
+ * getline, so any length of line (and pipes, and compressed files) is fine.
+ * With a filter only the records it keeps are written. Returns 0 on success
+ * or EXIT_FAILURE.
+ */
+int convert_files(const char *out_path, char *paths[], int num_paths,
+        const struct record_filter *filter) {
+    struct columnar_writer writer;
+    unsigned char header[COLUMNAR_HEADER_SIZE] = { 0 };
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    int ok = 1;
+    int i;
+
+    memset(&writer, 0, sizeof(writer));
+    writer.offset = COLUMNAR_HEADER_SIZE;
+    writer.file = fopen(out_path, "wb");
+    if (writer.file == NULL) {
+        printf("ERROR: %s could not be written\n", out_path);
+        return EXIT_FAILURE;
+    }
+    writer.timestamp = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(int64_t));
+    writer.geohash = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(uint64_t));
+    writer.humidity = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(double));
+    writer.cloud_cover = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(double));
+    writer.pressure = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(double));
+    writer.temperature = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(float));
+    writer.snow = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(int32_t));
+    writer.lightning = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(int32_t));
+    writer.code = malloc(COLUMNAR_BLOCK_RECORDS);
+    if (writer.timestamp == NULL || writer.geohash == NULL || writer.humidity == NULL || writer.cloud_cover == NULL
+            || writer.pressure == NULL || writer.temperature == NULL || writer.snow == NULL
+            || writer.lightning == NULL || writer.code == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The header is written for real once the totals are known. */
+    ok = fwrite(header, sizeof(header), 1, writer.file) == 1;
+
+    for (i = 0; ok && i < num_paths; ++i) {
+        pid_t child;
+        FILE *file = open_input(paths[i], &child);
+        struct tdv_record rec;
+
+        if (file == NULL) {
+            printf("ERROR: %s does not exist\n", paths[i]);
+            continue;
+        }
+        printf("Opening file: %s\n", paths[i]);
+        while (ok && (line_len = getline(&line, &line_cap, file)) > 0) {
+            const char *eol = line + line_len;
+
+            if (eol[-1] == '\n') {
+                --eol;
+            }
+            if (parse_record(line, eol, filter, &rec)) {
+                ok = columnar_add(&writer, &rec);
+            }
+        }
+        close_input(file, child, paths[i]);
+    }
+    ok = ok && columnar_flush(&writer);
+    ok = ok && (writer.num_blocks == 0 || fwrite(writer.index, COLUMNAR_INDEX_ENTRY_SIZE,
+                writer.num_blocks, writer.file) == writer.num_blocks);
+
+    if (ok) {
+        memcpy(header, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+        put_u32(header + 8, COLUMNAR_VERSION);
+        put_u32(header + 12, COLUMNAR_BLOCK_RECORDS);
+        put_u64(header + 16, writer.num_records);
+        put_u32(header + 24, writer.num_blocks);
+        put_u32(header + 28, (uint32_t) writer.num_codes);
+        memcpy(header + 32, writer.codes, (size_t) writer.num_codes * 2);
+        put_u64(header + COLUMNAR_INDEX_OFFSET, writer.offset);
+        ok = fseek(writer.file, 0, SEEK_SET) == 0
+                && fwrite(header, sizeof(header), 1, writer.file) == 1;
+    }
+    if (fclose(writer.file) != 0 || !ok) {
+        printf("ERROR: %s could not be written\n", out_path);
+        ok = 0;
+    } else {
+        printf("Converted %llu records into %s\n", (unsigned long long) writer.num_records,
+                out_path);
+    }
+
+    free(line);
+    free(writer.index);
+    free(writer.timestamp);
+    free(writer.geohash);
+    free(writer.humidity);
+    free(writer.cloud_cover);
+    free(writer.pressure);
+    free(writer.temperature);
+    free(writer.snow);
+    free(writer.lightning);
+    free(writer.code);
+    return ok ? 0 : EXIT_FAILURE;
+}
+
+/**
+ * columnar_add appends one record to the block being built, writing the
+ * block out when it is full. Returns 0 (after printing an error) if there
+ * are more distinct state codes than a one byte id can hold or the write
+ * fails.
+ */
+int columnar_add(struct columnar_writer *writer, const struct tdv_record *rec) {
+    uint32_t n = writer->count;
+    int id;
+
+    for (id = 0; id < writer->num_codes; ++id) {
+        if (memcmp(writer->codes[id], rec->code, 2) == 0) {
+            break;
+        }
+    }
+    if (id == writer->num_codes) {
+        if (id == COLUMNAR_MAX_CODES) {
+            printf("ERROR: more than %d state codes\n", COLUMNAR_MAX_CODES);
+            return 0;
+        }
+        memcpy(writer->codes[id], rec->code, 2);
+        ++writer->num_codes;
+    }
+
+    writer->code[n] = (uint8_t) id;
+    writer->timestamp[n] = rec->timestamp;
+    writer->geohash[n] = geohash_pack(rec->geohash, rec->geohash_len);
+    writer->humidity[n] = rec->humidity;
+    writer->cloud_cover[n] = rec->cloud_cover;
+    writer->pressure[n] = rec->pressure;
+    writer->temperature[n] = rec->temperature;
+    writer->snow[n] = rec->snow;
+    writer->lightning[n] = rec->lightning;
+    writer->count = n + 1;
+
+    return writer->count < COLUMNAR_BLOCK_RECORDS || columnar_flush(writer);
+}
+
+/**
+ * columnar_block_size is the number of bytes a block of count records takes
+ * up. Every column is padded out to a multiple of 8 bytes so all of them
+ * stay aligned when the file is mapped.
+ */
+size_t columnar_block_size(uint32_t count) {
+    size_t n = count;
+
+    return COLUMNAR_BLOCK_HEADER_SIZE + 5 * (8 * n) + 3 * ((4 * n + 7) & ~(size_t) 7)
+            + ((n + 7) & ~(size_t) 7);
+}
+
+/**
+ * columnar_flush writes out the block being built, if it has any records.
+ * A block starts with a u32 record count (plus 4 bytes of padding) and the
+ * i64 lowest and highest timestamp in it, so readers filtering on time can
+ * skip blocks without looking at their columns. Then come the columns, in
+ * this order:
+ *
+ *   timestamp    i64    seconds
+ *   geohash      u64    as packed by geohash_pack
+ *   humidity     f64
+ *   cloud_cover  f64
+ *   pressure     f64
+ *   temperature  f32    Fahrenheit, as aggregated
+ *   snow         i32
+ *   lightning    i32
+ *   code         u8     index into the header's code dictionary
+ *
+ * Values are stored in host byte order, which is required to be little
+ * endian. Humidity, cloud cover and pressure stay doubles so averages come
+ * out exactly as they do from the text. Returns 0 if the write fails.
+ */
+int columnar_flush(struct columnar_writer *writer) {
+    static const char zeros[8] = { 0 };
+    unsigned char head[COLUMNAR_BLOCK_HEADER_SIZE] = { 0 };
+    size_t n = writer->count;
+    int64_t min_timestamp;
+    int64_t max_timestamp;
+    size_t pad4 = ((4 * n + 7) & ~(size_t) 7) - 4 * n;
+    size_t pad1 = ((n + 7) & ~(size_t) 7) - n;
+    FILE *f = writer->file;
+    int ok;
+
+    if (n == 0) {
+        return 1;
+    }
+    min_timestamp = max_timestamp = writer->timestamp[0];
+    for (size_t i = 1; i < n; ++i) {
+        if (writer->timestamp[i] < min_timestamp) {
+            min_timestamp = writer->timestamp[i];
+        }
+        if (writer->timestamp[i] > max_timestamp) {
+            max_timestamp = writer->timestamp[i];
+        }
+    }
+    put_u32(head, (uint32_t) n);
+    put_u64(head + 8, (uint64_t) min_timestamp);
+    put_u64(head + 16, (uint64_t) max_timestamp);
+    ok = fwrite(head, sizeof(head), 1, f) == 1
+            && fwrite(writer->timestamp, sizeof(int64_t), n, f) == n
+            && fwrite(writer->geohash, sizeof(uint64_t), n, f) == n
+            && fwrite(writer->humidity, sizeof(double), n, f) == n
+            && fwrite(writer->cloud_cover, sizeof(double), n, f) == n
+            && fwrite(writer->pressure, sizeof(double), n, f) == n
+            && fwrite(writer->temperature, sizeof(float), n, f) == n
+            && fwrite(zeros, 1, pad4, f) == pad4
+            && fwrite(writer->snow, sizeof(int32_t), n, f) == n
+            && fwrite(zeros, 1, pad4, f) == pad4
+            && fwrite(writer->lightning, sizeof(int32_t), n, f) == n
+            && fwrite(zeros, 1, pad4, f) == pad4
+            && fwrite(writer->code, 1, n, f) == n
+            && fwrite(zeros, 1, pad1, f) == pad1;
+
+    writer->index = realloc(writer->index,
+            (size_t) (writer->num_blocks + 1) * COLUMNAR_INDEX_ENTRY_SIZE);
+    if (writer->index == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    columnar_index_entry(writer,
+            writer->index + (size_t) writer->num_blocks * COLUMNAR_INDEX_ENTRY_SIZE);
+
+    writer->offset += columnar_block_size((uint32_t) n);
+    writer->num_records += n;
+    writer->num_blocks++;
+    writer->count = 0;
+    return ok;
+}
+
+/**
+ * columnar_index_entry fills in the index entry of the block being written
+ * (at writer->offset). The block index follows the last block, one entry
+ * per block in file order, so a reader can tell from it alone which blocks
+ * a filter can skip without touching the blocks themselves:
+ *
+ *   0   block offset in the file     u64
+ *   8   record count                 u32 (plus 4 bytes of padding)
+ *   16  lowest, highest timestamp    2 x i64
+ *   32  lowest, highest temperature  2 x f32
+ *   40  lowest, highest humidity     2 x f64
+ *   56  code ids present             256 bit bitmap, bit id % 8 of byte id / 8
+ */
+void columnar_index_entry(const struct columnar_writer *writer, unsigned char *entry) {
+    uint32_t n = writer->count;
+    int64_t min_timestamp = writer->timestamp[0];
+    int64_t max_timestamp = writer->timestamp[0];
+    float min_temperature = writer->temperature[0];
+    float max_temperature = writer->temperature[0];
+    double min_humidity = writer->humidity[0];
+    double max_humidity = writer->humidity[0];
+    float temperatures[2];
+
+    memset(entry, 0, COLUMNAR_INDEX_ENTRY_SIZE);
+    for (uint32_t i = 0; i < n; ++i) {
+        if (writer->timestamp[i] < min_timestamp) {
+            min_timestamp = writer->timestamp[i];
+        }
+        if (writer->timestamp[i] > max_timestamp) {
+            max_timestamp = writer->timestamp[i];
+        }
+        if (writer->temperature[i] < min_temperature) {
+            min_temperature = writer->temperature[i];
+        }
+        if (writer->temperature[i] > max_temperature) {
+            max_temperature = writer->temperature[i];
+        }
+        if (writer->humidity[i] < min_humidity) {
+            min_humidity = writer->humidity[i];
+        }
+        if (writer->humidity[i] > max_humidity) {
+            max_humidity = writer->humidity[i];
+        }
+        entry[56 + writer->code[i] / 8] |= (unsigned char) (1u << (writer->code[i] % 8));
+    }
+    temperatures[0] = min_temperature;
+    temperatures[1] = max_temperature;
+    put_u64(entry, writer->offset);
+    put_u32(entry + 8, n);
+    put_u64(entry + 16, (uint64_t) min_timestamp);
+    put_u64(entry + 24, (uint64_t) max_timestamp);
+    memcpy(entry + 32, temperatures, sizeof(temperatures));
+    put_f64(entry + 40, min_humidity);
+    put_f64(entry + 48, max_humidity);
+}
+
+/**
+ * is_columnar checks whether an opened file starts with the columnar cache
+ * magic, leaving it positioned at the start. Files that cannot seek (pipes)
+ * are never treated as columnar, since peeking would lose their first
+ * bytes.
+ */
+int is_columnar(FILE *file) {
+    char magic[sizeof(COLUMNAR_MAGIC)];
+    int found;
+
+    if (!is_seekable(file)) {
+        return 0;
+    }
+    found = fread(magic, sizeof(magic), 1, file) == 1
+            && memcmp(magic, COLUMNAR_MAGIC, sizeof(magic)) == 0;
+    rewind(file);
+    return found;
+}
+
+/**
+ * columnar_header_ok checks the magic and version of a mapped columnar
+ * file, that its block index is all there, and that this host can read
+ * its columns in place.
+ */
+int columnar_header_ok(const char *data, size_t len) {
+    const uint16_t probe = 1;
+    const unsigned char *head = (const unsigned char *) data;
+
+    return len >= COLUMNAR_HEADER_SIZE
+            && memcmp(data, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)) == 0
+            && get_u32(head + 8) == COLUMNAR_VERSION
+            && get_u64(head + COLUMNAR_INDEX_OFFSET) >= COLUMNAR_HEADER_SIZE
+            && get_u64(head + COLUMNAR_INDEX_OFFSET) <= len
+            && (len - get_u64(head + COLUMNAR_INDEX_OFFSET)) / COLUMNAR_INDEX_ENTRY_SIZE
+                    >= get_u32(head + 24)
+            && *(const unsigned char *) &probe == 1;
+}
+
+/**
+ * analyze_columnar reads a whole mapped columnar cache file.
+ */
+void analyze_columnar(const char *data, size_t len, struct state_table *table) {
+    if (!columnar_header_ok(data, len)) {
+        printf("ERROR: unsupported columnar file (wrong version, byte order or truncated)\n");
+        return;
+    }
+    analyze_columnar_blocks(data, data + COLUMNAR_HEADER_SIZE,
+            data + get_u64((const unsigned char *) data + COLUMNAR_INDEX_OFFSET), table);
+}
+
+/**
+ * analyze_columnar_blocks folds every record in the blocks from blocks up
+ * to end into table, reading the columns in place. header is the start of
+ * the file, for the code dictionary. Each block is cut into runs of
+ * records of the same state, which go through batch_kernel and are folded
+ * in with fold_batch. Each code id is looked up in the table only the
+ * first time it turns up, and kept as a position in the table (or as -1
+ * if the table's filter drops that state). With a filter, the block index
+ * is read alongside the blocks: blocks whose timestamp range lies outside
+ * the filter's, or that hold none of its states, are skipped whole without
+ * reading any of their pages, and runs in blocks that straddle an end of
+ * the time range are also cut at every record it drops. A block running
+ * past end means the file was cut short; it is reported and skipped.
+ */
+void analyze_columnar_blocks(const char *header, const char *blocks, const char *end,
+        struct state_table *table) {
+    const unsigned char *head = (const unsigned char *) header;
+    int slots[COLUMNAR_MAX_CODES + 1] = { 0 };
+    uint32_t num_codes = get_u32(head + 28);
+    uint32_t max_count = get_u32(head + 12);
+    uint32_t num_blocks = get_u32(head + 24);
+    const unsigned char *index = head + get_u64(head + COLUMNAR_INDEX_OFFSET);
+    const struct record_filter *filter = table->filter;
+    unsigned char wanted[32] = { 0 };
+    uint32_t next = 0;
+
+    table->counts.bytes += (uint64_t) (end - blocks);
+    if (filter != NULL) {
+        uint64_t offset = (uint64_t) (blocks - header);
+        uint32_t hi = num_blocks;
+
+        /* Find the index entry of the first block, then keep in step. */
+        while (next < hi) {
+            uint32_t mid = next + (hi - next) / 2;
+
+            if (get_u64(index + (size_t) mid * COLUMNAR_INDEX_ENTRY_SIZE) < offset) {
+                next = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (uint32_t id = 0; id < num_codes && id < COLUMNAR_MAX_CODES; ++id) {
+            char key[3] = { (char) head[32 + 2 * id], (char) head[33 + 2 * id], '\0' };
+
+            if (filter_code(filter, key)) {
+                wanted[id / 8] |= (unsigned char) (1u << (id % 8));
+            }
+        }
+    }
+
+    while (blocks < end) {
+        const unsigned char *entry = NULL;
+        uint32_t n;
+        size_t pad4;
+        const int64_t *timestamp;
+        const uint64_t *geohash;
+        const double *humidity;
+        const double *cloud_cover;
+        const double *pressure;
+        const float *temperature;
+        const int32_t *snow;
+        const int32_t *lightning;
+        const uint8_t *code;
+        int straddles = 0;
+
+        if (filter != NULL && next < num_blocks && get_u64(index + (size_t) next
+                    * COLUMNAR_INDEX_ENTRY_SIZE) == (uint64_t) (blocks - header)) {
+            entry = index + (size_t) next++ * COLUMNAR_INDEX_ENTRY_SIZE;
+        }
+        n = entry != NULL ? get_u32(entry + 8) : get_u32((const unsigned char *) blocks);
+        if (n > max_count || columnar_block_size(n) > (size_t) (end - blocks)) {
+            printf("ERROR: columnar file is truncated\n");
+            return;
+        }
+
+        if (filter != NULL) {
+            const unsigned char *range = entry != NULL ? entry + 16
+                    : (const unsigned char *) blocks + 8;
+            int64_t min_timestamp = (int64_t) get_u64(range);
+            int64_t max_timestamp = (int64_t) get_u64(range + 8);
+            int any = entry == NULL || filter->num_codes == 0;
+
+            for (int b = 0; !any && b < 32; ++b) {
+                any = (entry[56 + b] & wanted[b]) != 0;
+            }
+            if (!any || max_timestamp < filter->from || min_timestamp >= filter->to) {
+                blocks += columnar_block_size(n);
+                continue;
+            }
+            straddles = min_timestamp < filter->from || max_timestamp >= filter->to;
+        }
+
+        pad4 = (4 * (size_t) n + 7) & ~(size_t) 7;
+        timestamp = (const int64_t *) (blocks + COLUMNAR_BLOCK_HEADER_SIZE);
+        geohash = (const uint64_t *) (timestamp + n);
+        humidity = (const double *) (geohash + n);
+        cloud_cover = humidity + n;
+        pressure = cloud_cover + n;
+        temperature = (const float *) (pressure + n);
+        snow = (const int32_t *) ((const char *) temperature + pad4);
+        lightning = (const int32_t *) ((const char *) snow + pad4);
+        code = (const uint8_t *) ((const char *) lightning + pad4);
+
+        for (uint32_t i = 0, run_end; i < n; i = run_end) {
+            uint8_t id = code[i];
+            struct climate_info *info;
+            struct column_run run;
+            struct batch_stats stats;
+
+            if (straddles && (timestamp[i] < filter->from || timestamp[i] >= filter->to)) {
+                run_end = i + 1;
+                continue;
+            }
+            for (run_end = i + 1; run_end < n && code[run_end] == id
+                    && !(straddles && (timestamp[run_end] < filter->from
+                            || timestamp[run_end] >= filter->to)); ++run_end) {
+            }
+            if (id >= num_codes) {
+                continue;
+            }
+            if (slots[id] == 0) {
+                char key[3] = { (char) head[32 + 2 * id], (char) head[33 + 2 * id], '\0' };
+
+                slots[id] = filter_code(filter, key) ? state_index(table, key) + 1 : -1;
+            }
+            if (slots[id] < 0) {
+                continue;
+            }
+            info = &table->states[slots[id] - 1];
+            run.temperature = temperature + i;
+            run.humidity = humidity + i;
+            run.cloud_cover = cloud_cover + i;
+            run.snow = snow + i;
+            run.lightning = lightning + i;
+            run.count = run_end - i;
+            run_batch_kernel(&run, &stats);
+            fold_batch(info, &run, &stats, timestamp + i);
+            if (table->bucket != BUCKET_NONE) {
+                for (uint32_t k = i; k < run_end; ++k) {
+                    add_to_bucket(info, bucket_of(timestamp[k], table->bucket),
+                            temperature[k], humidity[k]);
+                }
+            }
+            if (table->quantiles) {
+                for (uint32_t k = i; k < run_end; ++k) {
+                    sketch_add(info, temperature[k], humidity[k]);
+                }
+            }
+            if (table->geo != NULL) {
+                for (uint32_t k = i; k < run_end; ++k) {
+                    geo_add(table->geo, geohash[k], temperature[k], humidity[k], snow[k],
+                            lightning[k]);
+                }
+            }
+            if (table->num_metrics > 0) {
+                struct tdv_record rec = { .geohash = NULL };
+
+                memcpy(rec.code, info->code, sizeof(rec.code));
+                for (uint32_t k = i; k < run_end; ++k) {
+                    rec.timestamp = timestamp[k];
+                    rec.humidity = humidity[k];
+                    rec.snow = snow[k];
+                    rec.cloud_cover = cloud_cover[k];
+                    rec.lightning = lightning[k];
+                    rec.pressure = pressure[k];
+                    rec.temperature = temperature[k];
+                    add_metrics(table, info, &rec);
+                }
+            }
+        }
+        blocks += columnar_block_size(n);
+    }
+}
+
+/**
+ * fold_batch folds the batch_stats of a run into the struct for its state,
+ * the same way update_state would for the records one at a time: a later
+ * max or min only wins if strictly beyond the current one. timestamp is the
+ * timestamp column of the run. The sums are added as whole runs, so they
+ * can differ from reading the text in the last bits, which never shows at
+ * the one decimal place the report prints. The run's own moments take a
+ * second pass over its temperature and humidity columns (deviations from
+ * the run mean, which is stable where sums of squares are not) and are
+ * then merged in like those of another worker.
+ */
+void fold_batch(struct climate_info *info, const struct column_run *run,
+        const struct batch_stats *stats, const int64_t *timestamp) {
+    struct running_moments temperature = { stats->sum_temperature / stats->num_records, 0 };
+    struct running_moments humidity = { stats->sum_humidity / stats->num_records, 0 };
+
+    for (uint32_t k = 0; k < run->count; ++k) {
+        double dt = run->temperature[k] - temperature.mean;
+        double dh = run->humidity[k] - humidity.mean;
+
+        temperature.m2 += dt * dt;
+        humidity.m2 += dh * dh;
+    }
+    merge_moments(&info->temperature_moments, info->num_records, &temperature,
+            stats->num_records);
+    merge_moments(&info->humidity_moments, info->num_records, &humidity, stats->num_records);
+
+    if (info->num_records == 0) {
+        memset(&info->sum_temperature, 0, sizeof(info->sum_temperature));
+        memset(&info->sum_humidity, 0, sizeof(info->sum_humidity));
+        memset(&info->sum_cloud_cover, 0, sizeof(info->sum_cloud_cover));
+        info->max_temperature = stats->max_temperature;
+        info->max_timestamp = timestamp[stats->argmax];
+        info->min_temperature = stats->min_temperature;
+        info->min_timestamp = timestamp[stats->argmin];
+    } else {
+        if (stats->max_temperature > info->max_temperature) {
+            info->max_temperature = stats->max_temperature;
+            info->max_timestamp = timestamp[stats->argmax];
+        }
+        if (stats->min_temperature < info->min_temperature) {
+            info->min_temperature = stats->min_temperature;
+            info->min_timestamp = timestamp[stats->argmin];
+        }
+    }
+    info->num_records += stats->num_records;
+    add_compensated(&info->sum_temperature, stats->sum_temperature);
+    add_compensated(&info->sum_humidity, stats->sum_humidity);
+    add_compensated(&info->sum_cloud_cover, stats->sum_cloud_cover);
+    info->snow_records += stats->snow_records;
+    info->lightning_strikes += stats->lightning_strikes;
+}
+
+/**
+ * select_batch_kernel picks the batch kernel by name: "scalar", "avx2",
+ * "neon", or "auto" for the best one this CPU supports. Returns 0 if the
+ * named kernel is not available in this build or on this CPU.
+ */
+int select_batch_kernel(const char *name) {
+    int automatic = strcmp(name, "auto") == 0;
+
+#ifdef HAVE_AVX2_KERNEL
+    if ((automatic || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        batch_kernel = batch_stats_avx2;
+        return 1;
+    }
+#endif
+#ifdef HAVE_NEON_KERNEL
+    if (automatic || strcmp(name, "neon") == 0) {
+        batch_kernel = batch_stats_neon;
+        return 1;
+    }
+#endif
+    if (automatic || strcmp(name, "scalar") == 0) {
+        batch_kernel = batch_stats_scalar;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * run_batch_kernel runs the selected batch kernel over run, or the scalar
+ * one if run is shorter than BATCH_MIN_RUN records. All kernels give the
+ * same batch_stats, so which one ran does not show in the results.
+ */
+void run_batch_kernel(const struct column_run *run, struct batch_stats *out) {
+    if (run->count < BATCH_MIN_RUN) {
+        batch_stats_scalar(run, out);
+    } else {
+        batch_kernel(run, out);
+    }
+}
+
+/**
+ * batch_stats_scalar is the portable batch kernel, and the reference the
+ * vector kernels have to agree with.
+ */
+void batch_stats_scalar(const struct column_run *run, struct batch_stats *out) {
+    double temperature[4] = { 0 };
+    double humidity[4] = { 0 };
+    double cloud_cover[4] = { 0 };
+    int64_t snow = 0;
+    int64_t lightning = 0;
+    float max = -FLT_MAX;
+    float min = FLT_MAX;
+    uint32_t argmax = 0;
+    uint32_t argmin = 0;
+
+    for (uint32_t i = 0; i < run->count; ++i) {
+        float t = run->temperature[i];
+
+        temperature[i & 3] += t;
+        humidity[i & 3] += run->humidity[i];
+        cloud_cover[i & 3] += run->cloud_cover[i];
+        snow += run->snow[i];
+        lightning += run->lightning[i];
+        if (t > max) {
+            max = t;
+            argmax = i;
+        }
+        if (t < min) {
+            min = t;
+            argmin = i;
+        }
+    }
+
+    out->num_records = run->count;
+    out->sum_temperature = (temperature[0] + temperature[1]) + (temperature[2] + temperature[3]);
+    out->sum_humidity = (humidity[0] + humidity[1]) + (humidity[2] + humidity[3]);
+    out->sum_cloud_cover = (cloud_cover[0] + cloud_cover[1]) + (cloud_cover[2] + cloud_cover[3]);
+    out->snow_records = snow;
+    out->lightning_strikes = lightning;
+    out->max_temperature = max;
+    out->min_temperature = min;
+    out->argmax = argmax;
+    out->argmin = argmin;
+}
+
+/**
+ * finish_batch_stats is used by the NEON kernel: it takes the lane
+ * accumulators they stored out, runs the records left over after the last
+ * full vector through the same lanes, and reduces everything into out.
+ * max and min are kept in eight lanes (record i in lane i % 8) with the
+ * position each was first seen at; ties across lanes go to the earliest.
+ */
+void finish_batch_stats(const struct column_run *run, uint32_t i,
+        double temperature[4], double humidity[4], double cloud_cover[4],
+        int64_t snow, int64_t lightning, float max[8], uint32_t argmax[8],
+        float min[8], uint32_t argmin[8], struct batch_stats *out) {
+    int lane;
+
+    for (; i < run->count; ++i) {
+        float t = run->temperature[i];
+
+        temperature[i & 3] += t;
+        humidity[i & 3] += run->humidity[i];
+        cloud_cover[i & 3] += run->cloud_cover[i];
+        snow += run->snow[i];
+        lightning += run->lightning[i];
+        if (t > max[i & 7]) {
+            max[i & 7] = t;
+            argmax[i & 7] = i;
+        }
+        if (t < min[i & 7]) {
+            min[i & 7] = t;
+            argmin[i & 7] = i;
+        }
+    }
+
+    out->num_records = run->count;
+    out->sum_temperature = (temperature[0] + temperature[1]) + (temperature[2] + temperature[3]);
+    out->sum_humidity = (humidity[0] + humidity[1]) + (humidity[2] + humidity[3]);
+    out->sum_cloud_cover = (cloud_cover[0] + cloud_cover[1]) + (cloud_cover[2] + cloud_cover[3]);
+    out->snow_records = snow;
+    out->lightning_strikes = lightning;
+    out->max_temperature = -FLT_MAX;
+    out->min_temperature = FLT_MAX;
+    out->argmax = 0;
+    out->argmin = 0;
+    for (lane = 0; lane < 8; ++lane) {
+        if (max[lane] > out->max_temperature
+                || (max[lane] == out->max_temperature && argmax[lane] < out->argmax)) {
+            out->max_temperature = max[lane];
+            out->argmax = argmax[lane];
+        }
+        if (min[lane] < out->min_temperature
+                || (min[lane] == out->min_temperature && argmin[lane] < out->argmin)) {
+            out->min_temperature = min[lane];
+            out->argmin = argmin[lane];
+        }
+    }
+}
+
+#ifdef HAVE_AVX2_KERNEL
+/**
+ * batch_stats_avx2 works through eight records at a time. The eight floats
+ * of temperature are widened to doubles in two halves, which land in the
+ * four double lanes in record order, as do the two four-wide loads of each
+ * double column. The last, partial group of eight is read with masked
+ * loads, whose unused lanes add zero and are kept out of the max and min,
+ * and the lanes are reduced in registers rather than stored for
+ * finish_batch_stats to reload one at a time.
+ */
+__attribute__((target("avx2")))
+void batch_stats_avx2(const struct column_run *run, struct batch_stats *out) {
+    __m256d sum_t = _mm256_setzero_pd();
+    __m256d sum_h = _mm256_setzero_pd();
+    __m256d sum_c = _mm256_setzero_pd();
+    __m256i sum_s = _mm256_setzero_si256();
+    __m256i sum_l = _mm256_setzero_si256();
+    __m256 maxv = _mm256_set1_ps(-FLT_MAX);
+    __m256 minv = _mm256_set1_ps(FLT_MAX);
+    __m256i maxi = _mm256_setzero_si256();
+    __m256i mini = _mm256_setzero_si256();
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+    uint32_t i = 0;
+
+    for (; i + 8 <= run->count; i += 8) {
+        __m256 t = _mm256_loadu_ps(run->temperature + i);
+        __m256i s = _mm256_loadu_si256((const __m256i *) (run->snow + i));
+        __m256i l = _mm256_loadu_si256((const __m256i *) (run->lightning + i));
+        __m256 gt = _mm256_cmp_ps(t, maxv, _CMP_GT_OQ);
+        __m256 lt = _mm256_cmp_ps(t, minv, _CMP_LT_OQ);
+
+        sum_t = _mm256_add_pd(sum_t, _mm256_cvtps_pd(_mm256_castps256_ps128(t)));
+        sum_t = _mm256_add_pd(sum_t, _mm256_cvtps_pd(_mm256_extractf128_ps(t, 1)));
+        sum_h = _mm256_add_pd(sum_h, _mm256_loadu_pd(run->humidity + i));
+        sum_h = _mm256_add_pd(sum_h, _mm256_loadu_pd(run->humidity + i + 4));
+        sum_c = _mm256_add_pd(sum_c, _mm256_loadu_pd(run->cloud_cover + i));
+        sum_c = _mm256_add_pd(sum_c, _mm256_loadu_pd(run->cloud_cover + i + 4));
+        sum_s = _mm256_add_epi64(sum_s, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(s)));
+        sum_s = _mm256_add_epi64(sum_s, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(s, 1)));
+        sum_l = _mm256_add_epi64(sum_l, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(l)));
+        sum_l = _mm256_add_epi64(sum_l, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(l, 1)));
+
+        maxv = _mm256_blendv_ps(maxv, t, gt);
+        maxi = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(maxi),
+                _mm256_castsi256_ps(idx), gt));
+        minv = _mm256_blendv_ps(minv, t, lt);
+        mini = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(mini),
+                _mm256_castsi256_ps(idx), lt));
+        idx = _mm256_add_epi32(idx, step);
+    }
+
+    if (i < run->count) {
+        int left = (int) (run->count - i);
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(left),
+                _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256i mask_lo = _mm256_cmpgt_epi64(_mm256_set1_epi64x(left),
+                _mm256_setr_epi64x(0, 1, 2, 3));
+        __m256i mask_hi = _mm256_cmpgt_epi64(_mm256_set1_epi64x(left),
+                _mm256_setr_epi64x(4, 5, 6, 7));
+        __m256 t = _mm256_maskload_ps(run->temperature + i, mask);
+        __m256i s = _mm256_maskload_epi32(run->snow + i, mask);
+        __m256i l = _mm256_maskload_epi32(run->lightning + i, mask);
+        __m256 gt = _mm256_and_ps(_mm256_cmp_ps(t, maxv, _CMP_GT_OQ), _mm256_castsi256_ps(mask));
+        __m256 lt = _mm256_and_ps(_mm256_cmp_ps(t, minv, _CMP_LT_OQ), _mm256_castsi256_ps(mask));
+
+        sum_t = _mm256_add_pd(sum_t, _mm256_cvtps_pd(_mm256_castps256_ps128(t)));
+        sum_t = _mm256_add_pd(sum_t, _mm256_cvtps_pd(_mm256_extractf128_ps(t, 1)));
+        sum_h = _mm256_add_pd(sum_h, _mm256_maskload_pd(run->humidity + i, mask_lo));
+        sum_h = _mm256_add_pd(sum_h, _mm256_maskload_pd(run->humidity + i + 4, mask_hi));
+        sum_c = _mm256_add_pd(sum_c, _mm256_maskload_pd(run->cloud_cover + i, mask_lo));
+        sum_c = _mm256_add_pd(sum_c, _mm256_maskload_pd(run->cloud_cover + i + 4, mask_hi));
+        sum_s = _mm256_add_epi64(sum_s, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(s)));
+        sum_s = _mm256_add_epi64(sum_s, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(s, 1)));
+        sum_l = _mm256_add_epi64(sum_l, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(l)));
+        sum_l = _mm256_add_epi64(sum_l, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(l, 1)));
+
+        maxv = _mm256_blendv_ps(maxv, t, gt);
+        maxi = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(maxi),
+                _mm256_castsi256_ps(idx), gt));
+        minv = _mm256_blendv_ps(minv, t, lt);
+        mini = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(mini),
+                _mm256_castsi256_ps(idx), lt));
+        i = run->count;
+    }
+
+    out->num_records = run->count;
+    out->sum_temperature = sum_lanes_avx2(sum_t);
+    out->sum_humidity = sum_lanes_avx2(sum_h);
+    out->sum_cloud_cover = sum_lanes_avx2(sum_c);
+    out->snow_records = count_lanes_avx2(sum_s);
+    out->lightning_strikes = count_lanes_avx2(sum_l);
+    out->max_temperature = pick_lane_avx2(maxv, maxi, 1, &out->argmax);
+    out->min_temperature = pick_lane_avx2(minv, mini, 0, &out->argmin);
+    /* GCC leaves out the vzeroupper in a target("avx2") function of a
+     * build without -mavx, and the SSE code of the callers then ran about
+     * 200ns a call slower. */
+    _mm256_zeroupper();
+}
+
+/**
+ * sum_lanes_avx2 adds up the four lanes of a double sum as
+ * (lane 0 + lane 1) + (lane 2 + lane 3), like the other kernels.
+ */
+__attribute__((target("avx2")))
+double sum_lanes_avx2(__m256d lanes) {
+    __m128d pairs = _mm_hadd_pd(_mm256_castpd256_pd128(lanes), _mm256_extractf128_pd(lanes, 1));
+
+    return _mm_cvtsd_f64(_mm_add_sd(pairs, _mm_unpackhi_pd(pairs, pairs)));
+}
+
+/**
+ * count_lanes_avx2 adds up the four lanes of an integer count.
+ */
+__attribute__((target("avx2")))
+int64_t count_lanes_avx2(__m256i lanes) {
+    __m128i pairs = _mm_add_epi64(_mm256_castsi256_si128(lanes),
+            _mm256_extracti128_si256(lanes, 1));
+
+    return _mm_cvtsi128_si64(_mm_add_epi64(pairs, _mm_unpackhi_epi64(pairs, pairs)));
+}
+
+/**
+ * pick_lane_avx2 returns the max (or, if max is 0, the min) of the eight
+ * lanes of values, setting at to the earliest position held for it by the
+ * same lanes of positions, as finish_batch_stats does.
+ */
+__attribute__((target("avx2")))
+float pick_lane_avx2(__m256 values, __m256i positions, int max, uint32_t *at) {
+    __m256 v = values;
+    __m256 other;
+    __m256i p;
+    __m256i q;
+
+    for (int k = 0; k < 3; ++k) {
+        if (k == 0) {
+            other = _mm256_permute2f128_ps(v, v, 1);
+        } else if (k == 1) {
+            other = _mm256_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2));
+        } else {
+            other = _mm256_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+        }
+        v = max ? _mm256_max_ps(v, other) : _mm256_min_ps(v, other);
+    }
+    p = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(_mm256_set1_epi32(-1)),
+            _mm256_castsi256_ps(positions), _mm256_cmp_ps(values, v, _CMP_EQ_OQ)));
+    q = _mm256_min_epu32(p, _mm256_permute2x128_si256(p, p, 1));
+    q = _mm256_min_epu32(q, _mm256_shuffle_epi32(q, _MM_SHUFFLE(1, 0, 3, 2)));
+    q = _mm256_min_epu32(q, _mm256_shuffle_epi32(q, _MM_SHUFFLE(2, 3, 0, 1)));
+    *at = (uint32_t) _mm256_cvtsi256_si32(q);
+    return _mm256_cvtss_f32(v);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+/**
+ * batch_stats_neon works through eight records at a time like the AVX2
+ * kernel, with each four-lane double sum held as a pair of two-lane
+ * registers (lanes 0-1 and 2-3) and max/min in a pair of four-lane ones.
+ */
+void batch_stats_neon(const struct column_run *run, struct batch_stats *out) {
+    float64x2_t sum_t[2] = { vdupq_n_f64(0), vdupq_n_f64(0) };
+    float64x2_t sum_h[2] = { vdupq_n_f64(0), vdupq_n_f64(0) };
+    float64x2_t sum_c[2] = { vdupq_n_f64(0), vdupq_n_f64(0) };
+    int64x2_t sum_s = vdupq_n_s64(0);
+    int64x2_t sum_l = vdupq_n_s64(0);
+    float32x4_t maxv[2] = { vdupq_n_f32(-FLT_MAX), vdupq_n_f32(-FLT_MAX) };
+    float32x4_t minv[2] = { vdupq_n_f32(FLT_MAX), vdupq_n_f32(FLT_MAX) };
+    uint32x4_t maxi[2] = { vdupq_n_u32(0), vdupq_n_u32(0) };
+    uint32x4_t mini[2] = { vdupq_n_u32(0), vdupq_n_u32(0) };
+    static const uint32_t lanes[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    uint32x4_t idx[2] = { vld1q_u32(lanes), vld1q_u32(lanes + 4) };
+    const uint32x4_t step = vdupq_n_u32(8);
+    double temperature[4], humidity[4], cloud_cover[4];
+    float max[8], min[8];
+    uint32_t argmax[8], argmin[8];
+    uint32_t i = 0;
+    int h;
+
+    for (; i + 8 <= run->count; i += 8) {
+        for (h = 0; h < 2; ++h) {
+            uint32_t k = i + 4 * (uint32_t) h;
+            float32x4_t t = vld1q_f32(run->temperature + k);
+            int32x4_t s = vld1q_s32(run->snow + k);
+            int32x4_t l = vld1q_s32(run->lightning + k);
+            uint32x4_t gt = vcgtq_f32(t, maxv[h]);
+            uint32x4_t lt = vcltq_f32(t, minv[h]);
+
+            sum_t[0] = vaddq_f64(sum_t[0], vcvt_f64_f32(vget_low_f32(t)));
+            sum_t[1] = vaddq_f64(sum_t[1], vcvt_high_f64_f32(t));
+            sum_h[0] = vaddq_f64(sum_h[0], vld1q_f64(run->humidity + k));
+            sum_h[1] = vaddq_f64(sum_h[1], vld1q_f64(run->humidity + k + 2));
+            sum_c[0] = vaddq_f64(sum_c[0], vld1q_f64(run->cloud_cover + k));
+            sum_c[1] = vaddq_f64(sum_c[1], vld1q_f64(run->cloud_cover + k + 2));
+            sum_s = vaddq_s64(sum_s, vaddl_s32(vget_low_s32(s), vget_high_s32(s)));
+            sum_l = vaddq_s64(sum_l, vaddl_s32(vget_low_s32(l), vget_high_s32(l)));
+
+            maxv[h] = vbslq_f32(gt, t, maxv[h]);
+            maxi[h] = vbslq_u32(gt, idx[h], maxi[h]);
+            minv[h] = vbslq_f32(lt, t, minv[h]);
+            mini[h] = vbslq_u32(lt, idx[h], mini[h]);
+            idx[h] = vaddq_u32(idx[h], step);
+        }
+    }
+
+    vst1q_f64(temperature, sum_t[0]);
+    vst1q_f64(temperature + 2, sum_t[1]);
+    vst1q_f64(humidity, sum_h[0]);
+    vst1q_f64(humidity + 2, sum_h[1]);
+    vst1q_f64(cloud_cover, sum_c[0]);
+    vst1q_f64(cloud_cover + 2, sum_c[1]);
+    for (h = 0; h < 2; ++h) {
+        vst1q_f32(max + 4 * h, maxv[h]);
+        vst1q_f32(min + 4 * h, minv[h]);
+        vst1q_u32(argmax + 4 * h, maxi[h]);
+        vst1q_u32(argmin + 4 * h, mini[h]);
+    }
+
+    finish_batch_stats(run, i, temperature, humidity, cloud_cover,
+            vgetq_lane_s64(sum_s, 0) + vgetq_lane_s64(sum_s, 1),
+            vgetq_lane_s64(sum_l, 0) + vgetq_lane_s64(sum_l, 1),
+            max, argmax, min, argmin, out);
+}
+#endif
+
+/**
+ * analyze_file works with the passed file to fill appropriate members of
+ * the structs of the array. Each line is read with fgets and handed to
+ * analyze_line. Lines that do not have all of the fields are skipped. A
+ * line longer than line_sz comes out of fgets in pieces and is counted as
+ * truncated; it is skipped as a whole (and copied to the rejects file) if
+ * records are validated, or else each piece is taken as a line.
+ */
+void analyze_file(FILE *file, struct state_table *table) {
+    const int line_sz = 100;
+    char line[line_sz];
+    int cut = 0;
+
+    /**
+     * Loop here stores retrieves and stores each line one at a time 
+     * until the end of the file has been reached.
+     */
+    while (fgets(line, line_sz, file) != NULL) {
+        size_t len = strcspn(line, "\n");
+        int whole = line[len] == '\n' || len < (size_t) line_sz - 1;
+
+        if (!whole) {
+            int c = getc(file);
+
+            whole = c == EOF;
+            ungetc(c, file);
+        }
+        table->counts.bytes += len + (line[len] == '\n');
+        if (!whole || cut) {
+            table->counts.truncated += !cut;
+            cut = !whole;
+            if (validate_records) {
+                if (table->rejects != NULL) {
+                    write_reject(table->rejects, line, line + len, whole);
+                }
+                continue;
+            }
+        }
+        analyze_line(line, line + len, table);
+    }
+}
+
+/**
+ * analyze_stream reads the file in STREAM_BUFFER_SIZE blocks with read(),
+ * straight into one buffer that is reused for the whole file, so memory
+ * use does not grow with the input. The complete lines in the buffer are
+ * parsed in place, and the partial line left at the end is moved to the
+ * front to be finished by the next read. A line that fills the whole
+ * buffer without ending is dropped, up to its newline.
+ */
+void analyze_stream(FILE *file, struct state_table *table) {
+    char *buf = malloc(STREAM_BUFFER_SIZE);
+    int fd = fileno(file);
+    size_t have = 0;
+    int skipping = 0;
+
+    if (buf == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Peeking at the header through stdio may have read ahead on fd. */
+    if (is_seekable(file)) {
+        lseek(fd, ftello(file), SEEK_SET);
+    }
+
+    for (;;) {
+        double start = now_seconds();
+        ssize_t n = read(fd, buf + have, STREAM_BUFFER_SIZE - have);
+        const char *p = buf;
+        const char *end;
+        const char *eol;
+
+        table->counts.read_seconds += now_seconds() - start;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            printf("ERROR: read failed: %s\n", strerror(errno));
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        table->counts.bytes += (uint64_t) n;
+        end = buf + have + n;
+        while ((eol = memchr(p, '\n', (size_t) (end - p))) != NULL) {
+            if (!skipping) {
+                analyze_line(p, eol, table);
+            }
+            skipping = 0;
+            p = eol + 1;
+        }
+        have = (size_t) (end - p);
+        memmove(buf, p, have);
+        if (have == STREAM_BUFFER_SIZE) {
+            table->counts.truncated += !skipping;
+            skipping = 1;
+            have = 0;
+        }
+    }
+
+    if (have > 0 && !skipping) {
+        analyze_line(buf, buf + have, table);
+    }
+    free(buf);
+}
+
+/**
+ * analyze_prefetch parses the file the way analyze_stream does, but has a
+ * second thread (prefetch_reader) do the reading, up to PREFETCH_BUFFERS
+ * buffers ahead, so waiting on slow storage overlaps with parsing the
+ * data already there instead of alternating with it. Records come out in
+ * file order, so the results are exactly those of analyze_stream, which
+ * is also used if the thread cannot be started.
+ */
+void analyze_prefetch(FILE *file, struct state_table *table) {
+    struct prefetch_ring ring;
+    pthread_t reader;
+    int i;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = fileno(file);
+    for (i = 0; i < PREFETCH_BUFFERS; ++i) {
+        ring.buffers[i] = malloc(STREAM_BUFFER_SIZE);
+        if (ring.buffers[i] == NULL) {
+            printf("ERROR: Memory could not be allocated\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Peeking at the header through stdio may have read ahead on fd. */
+    if (is_seekable(file)) {
+        lseek(ring.fd, ftello(file), SEEK_SET);
+    }
+
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.filled, NULL);
+    pthread_cond_init(&ring.drained, NULL);
+    if (pthread_create(&reader, NULL, prefetch_reader, &ring) != 0) {
+        for (i = 0; i < PREFETCH_BUFFERS; ++i) {
+            free(ring.buffers[i]);
+        }
+        analyze_stream(file, table);
+        return;
+    }
+
+    for (;;) {
+        double start = now_seconds();
+        unsigned slot;
+
+        pthread_mutex_lock(&ring.lock);
+        while (ring.tail == ring.head && !ring.done) {
+            pthread_cond_wait(&ring.filled, &ring.lock);
+        }
+        table->counts.read_seconds += now_seconds() - start;
+        if (ring.tail == ring.head) {
+            pthread_mutex_unlock(&ring.lock);
+            break;
+        }
+        slot = ring.tail % PREFETCH_BUFFERS;
+        pthread_mutex_unlock(&ring.lock);
+
+        analyze_buffer(ring.buffers[slot] + ring.start[slot], ring.len[slot] - ring.start[slot],
+                table);
+
+        pthread_mutex_lock(&ring.lock);
+        ring.tail++;
+        pthread_cond_signal(&ring.drained);
+        pthread_mutex_unlock(&ring.lock);
+    }
+
+    pthread_join(reader, NULL);
+    table->counts.truncated += ring.truncated;
+    pthread_mutex_destroy(&ring.lock);
+    pthread_cond_destroy(&ring.filled);
+    pthread_cond_destroy(&ring.drained);
+    for (i = 0; i < PREFETCH_BUFFERS; ++i) {
+        free(ring.buffers[i]);
+    }
+}
+
+/**
+ * prefetch_reader is the reader thread of analyze_prefetch. It fills each
+ * free buffer of the ring completely (short reads from pipes are topped
+ * up), hands over everything up to the last newline, and starts the next
+ * buffer with the partial line left over. A line that fills a whole
+ * buffer without ending is dropped, up to its newline, as in
+ * analyze_stream.
+ */
+void *prefetch_reader(void *arg) {
+    struct prefetch_ring *ring = arg;
+    char *carry = malloc(STREAM_BUFFER_SIZE);
+    size_t have = 0;
+    int skipping = 0;
+    int at_end = 0;
+
+    if (carry == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (!at_end) {
+        unsigned slot;
+        char *buf;
+        size_t total;
+        size_t start = 0;
+        size_t len;
+
+        pthread_mutex_lock(&ring->lock);
+        while (ring->head - ring->tail == PREFETCH_BUFFERS) {
+            pthread_cond_wait(&ring->drained, &ring->lock);
+        }
+        slot = ring->head % PREFETCH_BUFFERS;
+        pthread_mutex_unlock(&ring->lock);
+
+        buf = ring->buffers[slot];
+        memcpy(buf, carry, have);
+        total = have;
+        while (total < STREAM_BUFFER_SIZE) {
+            ssize_t n = read(ring->fd, buf + total, STREAM_BUFFER_SIZE - total);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                printf("ERROR: read failed: %s\n", strerror(errno));
+            }
+            if (n <= 0) {
+                at_end = 1;
+                break;
+            }
+            total += (size_t) n;
+        }
+
+        /* Whole lines only, unless this is all there is. */
+        for (len = total; len > 0 && buf[len - 1] != '\n'; --len) {
+        }
+        if (at_end) {
+            len = total;
+        }
+        have = total - len;
+        memcpy(carry, buf + len, have);
+        if (have == STREAM_BUFFER_SIZE) {
+            ring->truncated += !skipping;
+            skipping = 1;
+            have = 0;
+        }
+        if (skipping && len > 0) {
+            const char *eol = memchr(buf, '\n', len);
+
+            start = eol != NULL ? (size_t) (eol + 1 - buf) : len;
+            skipping = eol == NULL;
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        ring->start[slot] = start;
+        ring->len[slot] = len;
+        ring->head++;
+        pthread_cond_signal(&ring->filled);
+        pthread_mutex_unlock(&ring->lock);
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    ring->done = 1;
+    pthread_cond_signal(&ring->filled);
+    pthread_mutex_unlock(&ring->lock);
+    free(carry);
+    return NULL;
+}
+
+/**
+ * map_file tries to map the whole of an already opened file into memory
+ * for reading. Returns the mapping and sets *len to its size, or returns
+ * NULL if the file cannot be mapped (pipes, character devices, empty
+ * files).
+ */
+void *map_file(FILE *file, size_t *len) {
+    struct stat st;
+    int fd = fileno(file);
+    void *data;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        return NULL;
+    }
+
+    data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+    *len = (size_t) st.st_size;
+    return data;
+}
+
+/**
+ * analyze_mapped maps an already opened file with map_file and parses it
+ * in place with analyze_buffer. Returns 1 if the file was handled, or 0 if
+ * it could not be mapped, in which case the caller should fall back to
+ * analyze_file.
+ */
+int analyze_mapped(FILE *file, struct state_table *table) {
+    size_t len;
+    void *data = map_file(file, &len);
+
+    if (data == NULL) {
+        return 0;
+    }
+    analyze_buffer(data, len, table);
+    munmap(data, len);
+    return 1;
+}
+
+/**
+ * analyze_buffer walks a block of TDV text one line at a time, finding the
+ * end of each line itself, so lines of any length are seen whole. The
+ * mapping is not NUL-terminated, so a final line without a trailing
+ * newline is copied out into a terminated buffer before it is parsed.
+ */
+void analyze_buffer(const char *data, size_t len, struct state_table *table) {
+    const char *p = data;
+    const char *end = data + len;
+    const char *eol;
+
+    table->counts.bytes += len;
+    while (p < end) {
+        eol = memchr(p, '\n', (size_t) (end - p));
+        if (eol == NULL) {
+            size_t tail = (size_t) (end - p);
+            char *last = malloc(tail + 1);
+
+            if (last == NULL) {
+                printf("ERROR: Memory could not be allocated\n");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(last, p, tail);
+            last[tail] = '\0';
+            analyze_line(last, last + tail, table);
+            free(last);
+            break;
+        }
+        analyze_line(p, eol, table);
+        p = eol + 1;
+    }
+}
+
+/**
+ * analyze_line parses one line, [line, eol), directly from wherever it
+ * lives (such as a mapped file) and hands the values to add_record. Empty
+ * or incomplete lines are ignored.
+ */
+void analyze_line(const char *line, const char *eol, struct state_table *table) {
+    struct tdv_record rec;
+
+    table->counts.lines++;
+    if (parse_record(line, eol, table->filter, &rec)) {
+        add_record(table, &rec);
+    } else if ((table->stats || table->rejects != NULL) && table->filter != NULL
+            && parse_record(line, eol, NULL, &rec)) {
+        table->counts.filtered++;
+    } else {
+        table->counts.malformed++;
+        if (table->rejects != NULL) {
+            write_reject(table->rejects, line, eol, 1);
+        }
+    }
+}
+
+/**
+ * write_reject copies [line, eol) to the rejects file, followed by a
+ * newline if end_line is set. Worker threads share the file, so the stream
+ * is locked around the write to keep each piece in one place; under -j
+ * the rejected lines can come out in any order.
+ */
+void write_reject(FILE *file, const char *line, const char *eol, int end_line) {
+    flockfile(file);
+    fwrite(line, 1, (size_t) (eol - line), file);
+    if (end_line) {
+        putc_unlocked('\n', file);
+    }
+    funlockfile(file);
+}
+
+/**
+ * Powers of ten that are exactly representable as doubles.
+ */
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/**
+ * parse_decimal reads a plain decimal ("-12.345") from p up to the next tab
+ * or eol and returns a pointer to where it stopped. The digits are
+ * collected into an integer and divided once by a power of ten; while both
+ * are exact doubles that division is correctly rounded, so the result is
+ * the same as atof would give. Anything else (exponents, very long digit
+ * strings, stray characters) is copied out and handed to strtod, and *bad
+ * is set unless strtod takes the whole field as a finite number (or if the
+ * field is longer than the 63 characters copied).
+ */
+const char *parse_decimal(const char *p, const char *eol, double *out, int *bad) {
+    const char *start = p;
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int frac = 0;
+    int negative = 0;
+
+    if (p < eol && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+    while (p < eol && (unsigned) (*p - '0') < 10) {
+        mantissa = mantissa * 10 + (unsigned) (*p - '0');
+        ++digits;
+        ++p;
+    }
+    if (p < eol && *p == '.') {
+        ++p;
+        while (p < eol && (unsigned) (*p - '0') < 10) {
+            mantissa = mantissa * 10 + (unsigned) (*p - '0');
+            ++digits;
+            ++frac;
+            ++p;
+        }
+    }
+
+    if ((p == eol || *p == '\t') && digits > 0 && digits <= 15) {
+        double value = (double) mantissa / exact_pow10[frac];
+        *out = negative ? -value : value;
+        return p;
+    }
+
+    /* Slow path: let strtod deal with whatever this is. */
+    {
+        char buf[64];
+        char *end;
+        const char *tab = memchr(start, '\t', (size_t) (eol - start));
+        size_t len = (size_t) ((tab != NULL ? tab : eol) - start);
+
+        *bad |= len == 0 || len >= sizeof(buf);
+        if (len >= sizeof(buf)) {
+            len = sizeof(buf) - 1;
+        }
+        memcpy(buf, start, len);
+        buf[len] = '\0';
+        *out = strtod(buf, &end);
+        *bad |= end != buf + len || !isfinite(*out);
+        return tab != NULL ? tab : eol;
+    }
+}
+
+/**
+ * parse_integer reads the leading integer of the field at p the way atoll
+ * would (so "1.0" reads as 1) and returns a pointer to the tab or eol that
+ * ends the field. *bad is set if the field has no digits, or anything but
+ * a fraction of digits after them.
+ */
+const char *parse_integer(const char *p, const char *eol, long long *out, int *bad) {
+    unsigned long long value = 0;
+    int negative = 0;
+    const char *digits;
+
+    if (p < eol && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+    digits = p;
+    while (p < eol && (unsigned) (*p - '0') < 10) {
+        value = value * 10 + (unsigned) (*p - '0');
+        ++p;
+    }
+    *out = negative ? -(long long) value : (long long) value;
+    *bad |= p == digits;
+
+    if (p < eol && *p == '.') {
+        ++p;
+        while (p < eol && (unsigned) (*p - '0') < 10) {
+            ++p;
+        }
+    }
+    *bad |= p < eol && *p != '\t';
+    while (p < eol && *p != '\t') {
+        ++p;
+    }
+    return p;
+}
+
+/**
+ * parse_record splits [line, eol) on tabs in a single forward pass and
+ * converts each field into rec. Returns 1 if all nine fields were found,
+ * or 0 for an empty or short line, or one that filter (if not NULL)
+ * drops. The state code and timestamp come first in a line, so filtered
+ * lines are given up on before any of the decimal fields are parsed.
+ * Nothing is written into the line, so it can point into read-only memory.
+ * The syntax checks ride along with the conversions, collecting into bad
+ * without branching off the fast path: an empty code or geohash, a number
+ * that does not parse or has anything after it, or more than nine fields.
+ * With validate_records set such a line is rejected (returns 0) too;
+ * otherwise it is taken as is, reading what can be read from each field.
+ */
+int parse_record(const char *line, const char *eol, const struct record_filter *filter,
+        struct tdv_record *rec) {
+    const char *p = line;
+    const char *field;
+    long long integer;
+    double kelvin;
+    int bad = 0;
+
+    if (eol > line && eol[-1] == '\r') {
+        --eol;
+    }
+
+    /* State code: up to two characters, anything longer is cut short. */
+    field = p;
+    while (p < eol && *p != '\t') {
+        ++p;
+    }
+    if (p == eol) {
+        return 0;
+    }
+    bad |= p == field;
+    rec->code[0] = p - field > 0 ? field[0] : '\0';
+    rec->code[1] = p - field > 1 ? field[1] : '\0';
+    rec->code[2] = '\0';
+    if (filter != NULL && !filter_code(filter, rec->code)) {
+        return 0;
+    }
+
+    p = parse_integer(p + 1, eol, &integer, &bad);
+    rec->timestamp = integer / 1000;
+    if (p == eol) {
+        return 0;
+    }
+    if (filter != NULL && (rec->timestamp < filter->from || rec->timestamp >= filter->to)) {
+        return 0;
+    }
+
+    field = ++p;
+    while (p < eol && *p != '\t') {
+        ++p;
+    }
+    rec->geohash = field;
+    rec->geohash_len = (size_t) (p - field);
+    bad |= p == field;
+    if (p == eol) {
+        return 0;
+    }
+
+    p = parse_decimal(p + 1, eol, &rec->humidity, &bad);
+    if (p == eol) {
+        return 0;
+    }
+    p = parse_integer(p + 1, eol, &integer, &bad);
+    rec->snow = (int) integer;
+    if (p == eol) {
+        return 0;
+    }
+    p = parse_decimal(p + 1, eol, &rec->cloud_cover, &bad);
+    if (p == eol) {
+        return 0;
+    }
+    p = parse_integer(p + 1, eol, &integer, &bad);
+    rec->lightning = (int) integer;
+    if (p == eol) {
+        return 0;
+    }
+    p = parse_decimal(p + 1, eol, &rec->pressure, &bad);
+    if (p == eol) {
+        return 0;
+    }
+    p = parse_decimal(p + 1, eol, &kelvin, &bad);
+    rec->temperature = kelvin * 1.8 - 459.67;
+    bad |= p != eol;
+    return !(bad & validate_records);
+}
+
+/**
+ * filter_code checks whether filter keeps records of the given state code:
+ * always without a filter or without a --states list.
+ */
+int filter_code(const struct record_filter *filter, const char *code) {
+    int i;
+
+    if (filter == NULL || filter->num_codes == 0) {
+        return 1;
+    }
+    for (i = 0; i < filter->num_codes; ++i) {
+        if (strcmp(filter->codes[i], code) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * parse_time_arg reads a --from or --to time into *out, in Unix seconds:
+ * either a plain number of seconds, or a UTC date as YYYY-MM-DD optionally
+ * followed by THH:MM or THH:MM:SS (and a Z). Returns 0 if text is neither.
+ */
+int parse_time_arg(const char *text, long *out) {
+    int year;
+    unsigned month;
+    unsigned day;
+    unsigned hour = 0;
+    unsigned minute = 0;
+    unsigned second = 0;
+    int used = 0;
+    char *end;
+
+    if (sscanf(text, "%d-%u-%u%n", &year, &month, &day, &used) == 3) {
+        const char *rest = text + used;
+
+        if (*rest == 'T' && sscanf(rest, "T%u:%u%n", &hour, &minute, &used) == 2) {
+            rest += used;
+            if (*rest == ':' && sscanf(rest, ":%u%n", &second, &used) == 1) {
+                rest += used;
+            }
+        }
+        if (*rest == 'Z') {
+            ++rest;
+        }
+        if (*rest != '\0' || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23
+                || minute > 59 || second > 60) {
+            return 0;
+        }
+        *out = days_from_civil(year, month, day) * 86400L + hour * 3600L + minute * 60L
+                + (long) second;
+        return 1;
+    }
+    errno = 0;
+    *out = strtol(text, &end, 10);
+    return end != text && *end == '\0' && errno == 0;
+}
+
+/**
+ * parse_state_list splits a comma separated list of state codes ("CA,NV")
+ * into filter's codes. Codes are cut to two characters like those in the
+ * data. Returns 0 if the list has no codes.
+ */
+int parse_state_list(char *list, struct record_filter *filter) {
+    char *code;
+
+    for (code = strtok(list, ","); code != NULL; code = strtok(NULL, ",")) {
+        filter->codes = realloc(filter->codes, (size_t) (filter->num_codes + 1) * 3);
+        if (filter->codes == NULL) {
+            printf("ERROR: Memory could not be allocated\n");
+            exit(EXIT_FAILURE);
+        }
+        filter->codes[filter->num_codes][0] = code[0];
+        filter->codes[filter->num_codes][1] = code[0] != '\0' ? code[1] : '\0';
+        filter->codes[filter->num_codes][2] = '\0';
+        ++filter->num_codes;
+    }
+    return filter->num_codes > 0;
+}
+
+/**
+ * parse_record_strtok is the original strtok/atof based line parser. It is
+ * only kept around so bench_parser has something to compare against.
+ * Unlike parse_record it writes into line.
+ */
+int parse_record_strtok(char *line, struct tdv_record *rec) {
+    char delim[] = "\t\n";
+    char *token = strtok(line, delim);
+    char *fields[8];
+    int i;
+
+    if (token == NULL) {
+        return 0;
+    }
+    for (i = 0; i < 8; ++i) {
+        if ((fields[i] = strtok(NULL, delim)) == NULL) {
+            return 0;
+        }
+    }
+    strncpy(rec->code, token, 2);
+    rec->code[2] = '\0';
+    rec->timestamp = atoll(fields[0]) / 1000;
+    rec->geohash = fields[1];
+    rec->geohash_len = strlen(fields[1]);
+    rec->humidity = atof(fields[2]);
+    rec->snow = atoi(fields[3]);
+    rec->cloud_cover = atof(fields[4]);
+    rec->lightning = atoi(fields[5]);
+    rec->pressure = atof(fields[6]);
+    rec->temperature = atof(fields[7]) * 1.8 - 459.67;
+    return 1;
+}
+
+/**
+ * find_state returns the struct for the given state code, adding an empty
+ * one (num_records of 0) at the end of the table the first time a code is
+ * seen. The pointer is only good until the next code is added; callers
+ * that keep hold of a state across lookups use state_index instead.
+ */
+struct climate_info *find_state(struct state_table *table, const char *code) {
+    int i = state_index(table, code);
+
+    return &table->states[i];
+}
+
+/**
+ * state_index gives the position of the given state code in the table,
+ * adding it first if it has not been seen. Two uppercase letter codes are
+ * found through slot in one step and anything else through other_slot,
+ * which is doubled whenever it gets half full. Program exits if
+ * allocation fails.
+ */
+int state_index(struct state_table *table, const char *code) {
+    unsigned row = (unsigned) (code[0] - 'A');
+    unsigned col = (unsigned) (code[1] - 'A');
+    unsigned h;
+    int i;
+
+    if (row < 26 && col < 26 && code[2] == '\0') {
+        int key = row * 26 + col;
+
+        if (table->slot[key] == 0) {
+            table->slot[key] = add_state(table, code) + 1;
+        }
+        return table->slot[key] - 1;
+    }
+
+    if ((table->num_others + 1) * 2 > table->other_capacity) {
+        int *old = table->other_slot;
+        int old_capacity = table->other_capacity;
+
+        table->other_capacity = old_capacity > 0 ? old_capacity * 2 : 16;
+        table->other_slot = calloc(table->other_capacity, sizeof(int));
+        if (table->other_slot == NULL) {
+            printf("ERROR: Memory could not be allocated\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < old_capacity; ++i) {
+            if (old[i] != 0) {
+                table->other_slot[other_slot_of(table, table->states[old[i] - 1].code)] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    h = other_slot_of(table, code);
+    if (table->other_slot[h] == 0) {
+        table->other_slot[h] = add_state(table, code) + 1;
+        table->num_others++;
+    }
+    return table->other_slot[h] - 1;
+}
+
+/**
+ * other_slot_of finds where code is in other_slot, or the empty entry
+ * where it would go.
+ */
+unsigned other_slot_of(const struct state_table *table, const char *code) {
+    unsigned mask = (unsigned) table->other_capacity - 1;
+    unsigned h = ((unsigned char) code[0] * 257u + (unsigned char) code[1]) * 2654435761u;
+
+    for (h = (h >> 16) & mask; table->other_slot[h] != 0; h = (h + 1) & mask) {
+        if (strcmp(table->states[table->other_slot[h] - 1].code, code) == 0) {
+            break;
+        }
+    }
+    return h;
+}
+
+/**
+ * add_state appends an empty struct for code to the table and returns its
+ * position, doubling the array (starting from room for NUM_STATES) when
+ * it is full. Program exits if allocation fails.
+ */
+int add_state(struct state_table *table, const char *code) {
+    struct climate_info *info;
+
+    if (table->num_states == table->capacity) {
+        int capacity = table->capacity > 0 ? table->capacity * 2 : NUM_STATES;
+        struct climate_info *states = realloc(table->states, capacity * sizeof(struct climate_info));
+
+        if (states == NULL) {
+            printf("ERROR: Memory could not be allocated\n");
+            exit(EXIT_FAILURE);
+        }
+        table->states = states;
+        table->capacity = capacity;
+    }
+    if (table->arena == NULL) {
+        table->arena = calloc(1, sizeof(struct arena));
+        if (table->arena == NULL) {
+            printf("ERROR: Memory could not be allocated\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    info = &table->states[table->num_states];
+    memset(info, 0, sizeof(*info));
+    strcpy(info->code, code);
+    info->arena = table->arena;
+    return table->num_states++;
+}
+
+/**
+ * add_record folds the values of one line into the struct for its state.
+ * If this is the first record for the state, the struct has all its
+ * members set to the ones of the current line. Otherwise values are
+ * updated including max and mins if it makes sense in the given case.
+ */
+void add_record(struct state_table *table, const struct tdv_record *rec) {
+    struct climate_info *info = find_state(table, rec->code);
+
+    update_state(info, rec);
+    if (table->bucket != BUCKET_NONE) {
+        add_to_bucket(info, bucket_of(rec->timestamp, table->bucket), rec->temperature,
+                rec->humidity);
+    }
+    if (table->geo != NULL) {
+        geo_add(table->geo, geohash_pack(rec->geohash, rec->geohash_len), rec->temperature,
+                rec->humidity, rec->snow, rec->lightning);
+    }
+    if (table->quantiles) {
+        sketch_add(info, rec->temperature, rec->humidity);
+    }
+    if (table->num_metrics > 0) {
+        add_metrics(table, info, rec);
+    }
+}
+
+/**
+ * update_state is the part of add_record that folds rec into the struct
+ * for its state, for callers that have already found it.
+ */
+void update_state(struct climate_info *info, const struct tdv_record *rec) {
+    float temperature = rec->temperature;
+    double weight;
+
+    if (info->num_records == 0) {
+        info->num_records = 1;
+        info->max_timestamp = rec->timestamp;
+        info->min_timestamp = rec->timestamp;
+        info->sum_humidity = (struct compensated_sum) { rec->humidity, 0 };
+        info->snow_records = rec->snow;
+        info->sum_cloud_cover = (struct compensated_sum) { rec->cloud_cover, 0 };
+        info->lightning_strikes = rec->lightning;
+        info->sum_temperature = (struct compensated_sum) { temperature, 0 };
+        info->max_temperature = temperature;
+        info->min_temperature = temperature;
+        info->temperature_moments = (struct running_moments) { temperature, 0 };
+        info->humidity_moments = (struct running_moments) { rec->humidity, 0 };
+        return;
+    }
+
+    info->num_records++;
+    add_compensated(&info->sum_humidity, rec->humidity);
+    info->snow_records += rec->snow;
+    add_compensated(&info->sum_cloud_cover, rec->cloud_cover);
+    info->lightning_strikes += rec->lightning;
+    add_compensated(&info->sum_temperature, temperature);
+    weight = 1.0 / info->num_records;
+    add_moment(&info->temperature_moments, weight, temperature);
+    add_moment(&info->humidity_moments, weight, rec->humidity);
+
+    if (temperature > info->max_temperature) {
+        info->max_temperature = temperature;
+        info->max_timestamp = rec->timestamp;
+    }
+    if (temperature < info->min_temperature) {
+        info->min_temperature = temperature;
+        info->min_timestamp = rec->timestamp;
+    }
+}
+
+/**
+ * metric_defs are the optional metrics --metrics can add to the report.
+ * Each is a function computing its value from one record (NaN when it
+ * cannot be computed, and the record is then not counted). Only the
+ * metrics that were asked for are called, from a list kept in the
+ * state_table, so the others cost nothing per record.
+ */
+static const struct {
+    const char *name;
+    const char *label;
+    const char *unit;
+    double (*value)(const struct tdv_record *rec);
+} metric_defs[NUM_METRICS] = {
+    { "pressure", "Pressure", " Pa", metric_pressure },
+    { "dewpoint", "Dew Point", "F", metric_dew_point }
+};
+
+/**
+ * find_metric returns the id of the metric called name, or -1.
+ */
+int find_metric(const char *name) {
+    int id;
+
+    for (id = 0; id < NUM_METRICS; ++id) {
+        if (strcmp(metric_defs[id].name, name) == 0) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+/**
+ * metric_pressure is the surface pressure, in Pa.
+ */
+double metric_pressure(const struct tdv_record *rec) {
+    return rec->pressure;
+}
+
+/**
+ * metric_dew_point estimates the dew point (in Fahrenheit) from the
+ * temperature and relative humidity with the Magnus formula, using the
+ * constants of Sonntag (1990), good to about 0.35C between -45C and 60C.
+ * There is none at 0% humidity.
+ */
+double metric_dew_point(const struct tdv_record *rec) {
+    const double b = 17.62;
+    const double c = 243.12;
+    double celsius = (rec->temperature - 32) / 1.8;
+    double gamma;
+
+    if (rec->humidity <= 0) {
+        return NAN;
+    }
+    gamma = log(rec->humidity / 100) + b * celsius / (c + celsius);
+    return c * gamma / (b - gamma) * 1.8 + 32;
+}
+
+/**
+ * add_metrics adds rec to each metric the table has turned on, creating
+ * the metric totals of info on first use. Program exits if allocation
+ * fails.
+ */
+void add_metrics(const struct state_table *table, struct climate_info *info,
+        const struct tdv_record *rec) {
+    if (info->metrics == NULL) {
+        info->metrics = arena_alloc(info->arena, NUM_METRICS * sizeof(struct metric_accum));
+    }
+    for (int m = 0; m < table->num_metrics; ++m) {
+        int id = table->metrics[m];
+
+        add_metric(&info->metrics[id], metric_defs[id].value(rec));
+    }
+}
+
+/**
+ * add_metric counts one value in accum, skipping NaNs.
+ */
+void add_metric(struct metric_accum *accum, double value) {
+    if (isnan(value)) {
+        return;
+    }
+    if (accum->count == 0) {
+        accum->min = value;
+        accum->max = value;
+    } else if (value < accum->min) {
+        accum->min = value;
+    } else if (value > accum->max) {
+        accum->max = value;
+    }
+    accum->count++;
+    add_compensated(&accum->sum, value);
+}
+
+/**
+ * merge_metrics adds the metric totals of src, if it has any, into dst.
+ */
+void merge_metrics(struct climate_info *dst, const struct climate_info *src) {
+    int id;
+
+    if (src->metrics == NULL) {
+        return;
+    }
+    if (dst->metrics == NULL) {
+        dst->metrics = arena_alloc(dst->arena, NUM_METRICS * sizeof(struct metric_accum));
+    }
+    for (id = 0; id < NUM_METRICS; ++id) {
+        struct metric_accum *to = &dst->metrics[id];
+        const struct metric_accum *from = &src->metrics[id];
+
+        if (from->count == 0) {
+            continue;
+        }
+        if (to->count == 0 || from->min < to->min) {
+            to->min = from->min;
+        }
+        if (to->count == 0 || from->max > to->max) {
+            to->max = from->max;
+        }
+        to->count += from->count;
+        merge_compensated(&to->sum, &from->sum);
+    }
+}
+
+/**
+ * print_report handles all of the ouput for the program starting by
+ * giving the codes of the states that were found in the files. A for
+ * loop that goes through the states that have records is utilized
+ * for this. options adds standard deviations or changes how timestamps
+ * are printed, and everything goes through out. The machine-readable
+ * formats are handed to print_rows and write_report_bin.
+ */
+void print_report(struct output *out, const struct climate_info *states, int num_states,
+        const struct report_options *options) {
+    if (options->format == FORMAT_BIN) {
+        write_report_bin(out, states, num_states);
+        return;
+    }
+    if (options->format != FORMAT_TEXT) {
+        print_rows(out, states, num_states, options);
+        return;
+    }
+
+    out_str(out, "States found: ");
+    int i;
+    for (i = 0; i < num_states; ++i) {
+        if (states[i].num_records > 0) {
+            const struct climate_info *info = &states[i];
+            out_str(out, info->code);
+            out_str(out, " ");
+        }
+    }
+    out_str(out, "\n");
+
+    /**
+     * Another similarly incorporated for loop is used here but to
+     * to print the all of the information for each state that was collected.
+     * Averages are calculated using totals divided by number of records.
+     * Floats/doubles go to one decimal point
+     */
+    for (i = 0; i < num_states; ++i) {
+        if (states[i].num_records > 0) {
+            const struct climate_info *info = &states[i];
+
+            out_str(out, "-- State: ");
+            out_str(out, info->code);
+            out_str(out, " --\nNumber of Records: ");
+            out_ulong(out, info->num_records, 0);
+            out_str(out, "\nAverage Humidity: ");
+            out_fixed1(out, compensated_value(&info->sum_humidity) / info->num_records);
+            out_str(out, "%\nAverage Temperature: ");
+            out_fixed1(out, compensated_value(&info->sum_temperature) / info->num_records);
+            out_str(out, "F\nMax Temperature: ");
+            out_fixed1(out, info->max_temperature);
+            out_str(out, "F\nMax Temperature on: ");
+            out_time(out, info->max_timestamp, options);
+            out_str(out, "Min Temperature: ");
+            out_fixed1(out, info->min_temperature);
+            out_str(out, "F\nMin Temperature on: ");
+            out_time(out, info->min_timestamp, options);
+            out_str(out, "Lightning Strikes: ");
+            out_ulong(out, info->lightning_strikes, 0);
+            out_str(out, "\nRecords with Snow Cover: ");
+            out_ulong(out, info->snow_records, 0);
+            out_str(out, "\nAverage Cloud Cover: ");
+            out_fixed1(out, compensated_value(&info->sum_cloud_cover) / info->num_records);
+            out_str(out, "%\n");
+            if (options->show_stddev) {
+                out_str(out, "Temperature Std Dev: ");
+                out_fixed1(out, moments_stddev(&info->temperature_moments, info->num_records));
+                out_str(out, "F\nHumidity Std Dev: ");
+                out_fixed1(out, moments_stddev(&info->humidity_moments, info->num_records));
+                out_str(out, "%\n");
+            }
+            if (info->sketch != NULL) {
+                const struct quantile_sketch *sketch = info->sketch;
+                uint64_t n = info->num_records;
+
+                out_str(out, "Temperature p50/p95/p99: ");
+                out_fixed1(out, sketch_quantile(sketch->temperature, SKETCH_TEMPERATURE_BINS,
+                            SKETCH_TEMPERATURE_MIN, n, 0.50));
+                out_str(out, "F / ");
+                out_fixed1(out, sketch_quantile(sketch->temperature, SKETCH_TEMPERATURE_BINS,
+                            SKETCH_TEMPERATURE_MIN, n, 0.95));
+                out_str(out, "F / ");
+                out_fixed1(out, sketch_quantile(sketch->temperature, SKETCH_TEMPERATURE_BINS,
+                            SKETCH_TEMPERATURE_MIN, n, 0.99));
+                out_str(out, "F\nHumidity p50/p95/p99: ");
+                out_fixed1(out, sketch_quantile(sketch->humidity, SKETCH_HUMIDITY_BINS, 0, n, 0.50));
+                out_str(out, "% / ");
+                out_fixed1(out, sketch_quantile(sketch->humidity, SKETCH_HUMIDITY_BINS, 0, n, 0.95));
+                out_str(out, "% / ");
+                out_fixed1(out, sketch_quantile(sketch->humidity, SKETCH_HUMIDITY_BINS, 0, n, 0.99));
+                out_str(out, "%\n");
+            }
+            for (int id = 0; info->metrics != NULL && id < NUM_METRICS; ++id) {
+                const struct metric_accum *metric = &info->metrics[id];
+
+                if (metric->count == 0) {
+                    continue;
+                }
+                out_str(out, metric_defs[id].label);
+                out_str(out, " avg/min/max: ");
+                out_fixed1(out, compensated_value(&metric->sum) / metric->count);
+                out_str(out, metric_defs[id].unit);
+                out_str(out, " / ");
+                out_fixed1(out, metric->min);
+                out_str(out, metric_defs[id].unit);
+                out_str(out, " / ");
+                out_fixed1(out, metric->max);
+                out_str(out, metric_defs[id].unit);
+                out_str(out, "\n");
+            }
+        }
+    }
+}
+
+/**
+ * out_summary prints the part of a time series or geohash line shared by
+ * both: the label, the number of records, the averages and the max and
+ * min temperature, without a newline. As JSON Lines it prints them as
+ * members to add to an object the caller has started (label is then left
+ * to the caller).
+ */
+void out_summary(struct output *out, const struct report_options *options, const char *label,
+        unsigned long num_records, double sum_temperature, double sum_humidity,
+        float max_temperature, float min_temperature) {
+    if (options->format == FORMAT_JSONL) {
+        out_key(out, "records", FORMAT_JSONL);
+        out_ulong(out, num_records, 0);
+        out_key(out, "avg_temperature", FORMAT_JSONL);
+        out_double(out, sum_temperature / num_records, FORMAT_JSONL);
+        out_key(out, "avg_humidity", FORMAT_JSONL);
+        out_double(out, sum_humidity / num_records, FORMAT_JSONL);
+        out_key(out, "max_temperature", FORMAT_JSONL);
+        out_double(out, max_temperature, FORMAT_JSONL);
+        out_key(out, "min_temperature", FORMAT_JSONL);
+        out_double(out, min_temperature, FORMAT_JSONL);
+        return;
+    }
+    out_str(out, label);
+    out_str(out, ": ");
+    out_ulong(out, num_records, 0);
+    out_str(out, " records, average ");
+    out_fixed1(out, sum_temperature / num_records);
+    out_str(out, "F, ");
+    out_fixed1(out, sum_humidity / num_records);
+    out_str(out, "% humidity, max ");
+    out_fixed1(out, max_temperature);
+    out_str(out, "F, min ");
+    out_fixed1(out, min_temperature);
+    out_str(out, "F");
+}
+
+/**
+ * Columns of the CSV report, in order. JSON Lines rows have the same
+ * members (plus "type"), and the binary records the same fields.
+ */
+static const char *const report_columns[] = {
+    "code", "records", "avg_humidity", "avg_temperature", "max_temperature",
+    "max_timestamp", "min_temperature", "min_timestamp", "lightning_strikes",
+    "snow_records", "avg_cloud_cover", "temperature_stddev", "humidity_stddev",
+    "temperature_p50", "temperature_p95", "temperature_p99",
+    "humidity_p50", "humidity_p95", "humidity_p99"
+};
+
+/**
+ * print_rows prints one CSV or JSON Lines row per state, with a header
+ * line first for CSV. Values are printed in full (timestamps as Unix
+ * seconds, averages with every significant digit) rather than rounded as
+ * in the text report, and percentiles are empty (null) without
+ * --quantiles. Each metric that any state has adds avg_, min_ and max_
+ * columns named after it; states without it leave them empty (null).
+ */
+void print_rows(struct output *out, const struct climate_info *states, int num_states,
+        const struct report_options *options) {
+    enum report_format format = options->format;
+    static const char *const stats[3] = { "avg_", "min_", "max_" };
+    double quantiles[6];
+    int present[NUM_METRICS] = { 0 };
+    char name[32];
+    size_t c;
+    int i;
+
+    for (i = 0; i < num_states; ++i) {
+        for (int id = 0; states[i].metrics != NULL && id < NUM_METRICS; ++id) {
+            present[id] |= states[i].metrics[id].count > 0;
+        }
+    }
+    if (format == FORMAT_CSV) {
+        for (c = 0; c < sizeof(report_columns) / sizeof(report_columns[0]); ++c) {
+            out_str(out, c > 0 ? "," : "");
+            out_str(out, report_columns[c]);
+        }
+        for (int id = 0; id < NUM_METRICS; ++id) {
+            for (int k = 0; present[id] && k < 3; ++k) {
+                out_str(out, ",");
+                out_str(out, stats[k]);
+                out_str(out, metric_defs[id].name);
+            }
+        }
+        out_str(out, "\n");
+    }
+
+    for (i = 0; i < num_states; ++i) {
+        const struct climate_info *info = &states[i];
+        double n = (double) info->num_records;
+        double values[] = {
+            compensated_value(&info->sum_humidity) / n,
+            compensated_value(&info->sum_temperature) / n,
+            info->max_temperature
+        };
+
+        if (info->num_records == 0) {
+            continue;
+        }
+        for (int q = 0; q < 6; ++q) {
+            static const double levels[3] = { 0.50, 0.95, 0.99 };
+
+            quantiles[q] = NAN;
+            if (info->sketch != NULL && q < 3) {
+                quantiles[q] = sketch_quantile(info->sketch->temperature,
+                        SKETCH_TEMPERATURE_BINS, SKETCH_TEMPERATURE_MIN, info->num_records,
+                        levels[q]);
+            } else if (info->sketch != NULL) {
+                quantiles[q] = sketch_quantile(info->sketch->humidity, SKETCH_HUMIDITY_BINS,
+                        0, info->num_records, levels[q - 3]);
+            }
+        }
+
+        if (format == FORMAT_JSONL) {
+            out_str(out, "{\"type\":\"state\"");
+            out_key(out, report_columns[0], format);
+        }
+        out_quoted(out, info->code, format);
+        out_key(out, report_columns[1], format);
+        out_ulong(out, info->num_records, 0);
+        for (c = 0; c < 3; ++c) {
+            out_key(out, report_columns[2 + c], format);
+            out_double(out, values[c], format);
+        }
+        out_key(out, report_columns[5], format);
+        out_str(out, info->max_timestamp < 0 ? "-" : "");
+        out_ulong(out, (unsigned long) (info->max_timestamp < 0 ? -info->max_timestamp
+                    : info->max_timestamp), 0);
+        out_key(out, report_columns[6], format);
+        out_double(out, info->min_temperature, format);
+        out_key(out, report_columns[7], format);
+        out_str(out, info->min_timestamp < 0 ? "-" : "");
+        out_ulong(out, (unsigned long) (info->min_timestamp < 0 ? -info->min_timestamp
+                    : info->min_timestamp), 0);
+        out_key(out, report_columns[8], format);
+        out_ulong(out, info->lightning_strikes, 0);
+        out_key(out, report_columns[9], format);
+        out_ulong(out, info->snow_records, 0);
+        out_key(out, report_columns[10], format);
+        out_double(out, compensated_value(&info->sum_cloud_cover) / n, format);
+        out_key(out, report_columns[11], format);
+        out_double(out, moments_stddev(&info->temperature_moments, info->num_records), format);
+        out_key(out, report_columns[12], format);
+        out_double(out, moments_stddev(&info->humidity_moments, info->num_records), format);
+        for (c = 0; c < 6; ++c) {
+            out_key(out, report_columns[13 + c], format);
+            out_double(out, quantiles[c], format);
+        }
+        for (int id = 0; id < NUM_METRICS; ++id) {
+            const struct metric_accum *metric = info->metrics != NULL
+                    && info->metrics[id].count > 0 ? &info->metrics[id] : NULL;
+            double totals[3] = { NAN, NAN, NAN };
+
+            if (!present[id]) {
+                continue;
+            }
+            if (metric != NULL) {
+                totals[0] = compensated_value(&metric->sum) / metric->count;
+                totals[1] = metric->min;
+                totals[2] = metric->max;
+            }
+            for (int k = 0; k < 3; ++k) {
+                snprintf(name, sizeof(name), "%s%s", stats[k], metric_defs[id].name);
+                out_key(out, name, format);
+                out_double(out, totals[k], format);
+            }
+        }
+        out_str(out, format == FORMAT_JSONL ? "}\n" : "\n");
+    }
+}
+
+/**
+ * write_report_bin writes the report as a fixed-width little-endian file,
+ * so that it can be mapped and indexed directly: a header of
+ *
+ *   0   magic "CLIMREP"        8 bytes
+ *   8   version                u32
+ *   12  record size (152)      u32
+ *   16  number of records      u64
+ *   24  reserved (zero)        8 bytes
+ *
+ * followed by one record per state, every field 8 bytes wide:
+ *
+ *   0   code (NUL padded)      8 bytes
+ *   8   records                u64
+ *   16  avg_humidity           f64
+ *   24  avg_temperature        f64
+ *   32  max_temperature        f64
+ *   40  max_timestamp          i64
+ *   48  min_temperature        f64
+ *   56  min_timestamp          i64
+ *   64  lightning_strikes      u64
+ *   72  snow_records           u64
+ *   80  avg_cloud_cover        f64
+ *   88  temperature_stddev     f64
+ *   96  humidity_stddev        f64
+ *   104 temperature p50/95/99  3 x f64
+ *   128 humidity p50/95/99     3 x f64
+ *
+ * Percentiles are NaN without --quantiles.
+ */
+void write_report_bin(struct output *out, const struct climate_info *states, int num_states) {
+    unsigned char header[REPORT_HEADER_SIZE] = { 0 };
+    unsigned char rec[REPORT_RECORD_SIZE];
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < num_states; ++i) {
+        count += states[i].num_records > 0;
+    }
+    memcpy(header, REPORT_MAGIC, sizeof(REPORT_MAGIC));
+    put_u32(header + 8, REPORT_VERSION);
+    put_u32(header + 12, REPORT_RECORD_SIZE);
+    put_u64(header + 16, count);
+    out_bytes(out, (const char *) header, sizeof(header));
+
+    for (i = 0; i < num_states; ++i) {
+        const struct climate_info *info = &states[i];
+        double n = (double) info->num_records;
+        static const double levels[3] = { 0.50, 0.95, 0.99 };
+
+        if (info->num_records == 0) {
+            continue;
+        }
+        memset(rec, 0, sizeof(rec));
+        memcpy(rec, info->code, strlen(info->code));
+        put_u64(rec + 8, info->num_records);
+        put_f64(rec + 16, compensated_value(&info->sum_humidity) / n);
+        put_f64(rec + 24, compensated_value(&info->sum_temperature) / n);
+        put_f64(rec + 32, info->max_temperature);
+        put_u64(rec + 40, (uint64_t) (int64_t) info->max_timestamp);
+        put_f64(rec + 48, info->min_temperature);
+        put_u64(rec + 56, (uint64_t) (int64_t) info->min_timestamp);
+        put_u64(rec + 64, info->lightning_strikes);
+        put_u64(rec + 72, info->snow_records);
+        put_f64(rec + 80, compensated_value(&info->sum_cloud_cover) / n);
+        put_f64(rec + 88, moments_stddev(&info->temperature_moments, info->num_records));
+        put_f64(rec + 96, moments_stddev(&info->humidity_moments, info->num_records));
+        for (int q = 0; q < 3; ++q) {
+            put_f64(rec + 104 + 8 * q, info->sketch == NULL ? NAN
+                    : sketch_quantile(info->sketch->temperature, SKETCH_TEMPERATURE_BINS,
+                        SKETCH_TEMPERATURE_MIN, info->num_records, levels[q]));
+            put_f64(rec + 128 + 8 * q, info->sketch == NULL ? NAN
+                    : sketch_quantile(info->sketch->humidity, SKETCH_HUMIDITY_BINS, 0,
+                        info->num_records, levels[q]));
+        }
+        out_bytes(out, (const char *) rec, sizeof(rec));
+    }
+}
+
+/**
+ * out_key starts the next field of a CSV or JSON Lines row: a comma, and
+ * for JSON the quoted member name and a colon.
+ */
+void out_key(struct output *out, const char *name, enum report_format format) {
+    if (format == FORMAT_JSONL) {
+        out_str(out, ",\"");
+        out_str(out, name);
+        out_str(out, "\":");
+    } else {
+        out_str(out, ",");
+    }
+}
+
+/**
+ * out_double prints value with the fewest digits (up to 17) that read back
+ * as the same double. NaNs and infinities, which neither format has a way
+ * to write, are printed as an empty CSV field or a JSON null.
+ */
+void out_double(struct output *out, double value, enum report_format format) {
+    char text[32];
+    int digits;
+
+    if (!isfinite(value)) {
+        out_str(out, format == FORMAT_JSONL ? "null" : "");
+        return;
+    }
+    for (digits = 15; digits < 17; ++digits) {
+        snprintf(text, sizeof(text), "%.*g", digits, value);
+        if (strtod(text, NULL) == value) {
+            break;
+        }
+    }
+    if (digits == 17) {
+        snprintf(text, sizeof(text), "%.17g", value);
+    }
+    out_str(out, text);
+}
+
+/**
+ * out_quoted prints text as a JSON string, or for CSV as is unless it
+ * holds a comma, quote or line break, in which case it is quoted with its
+ * quotes doubled.
+ */
+void out_quoted(struct output *out, const char *text, enum report_format format) {
+    const char *p;
+
+    if (format != FORMAT_JSONL && strpbrk(text, ",\"\r\n") == NULL) {
+        out_str(out, text);
+        return;
+    }
+    out_str(out, "\"");
+    for (p = text; *p != '\0'; ++p) {
+        unsigned char ch = (unsigned char) *p;
+
+        if (ch == '"') {
+            out_str(out, format == FORMAT_JSONL ? "\\\"" : "\"\"");
+        } else if (format == FORMAT_JSONL && ch == '\\') {
+            out_str(out, "\\\\");
+        } else if (format == FORMAT_JSONL && ch < 0x20) {
+            char escape[8];
+
+            snprintf(escape, sizeof(escape), "\\u%04x", ch);
+            out_str(out, escape);
+        } else {
+            out_bytes(out, p, 1);
+        }
+    }
+    out_str(out, "\"");
+}
+
+void out_init(struct output *out, FILE *file) {
+    out->file = file;
+    out->len = 0;
+    out->cached_valid = 0;
+}
+
+/**
+ * out_flush writes out whatever is in the buffer. stdio is still used
+ * underneath, so reports and the messages printed around them with
+ * printf stay in order as long as the buffer is flushed in between.
+ */
+void out_flush(struct output *out) {
+    if (out->len > 0) {
+        fwrite(out->data, 1, out->len, out->file);
+        out->len = 0;
+    }
+}
+
+void out_bytes(struct output *out, const char *text, size_t len) {
+    if (out->len + len > sizeof(out->data)) {
+        out_flush(out);
+        if (len > sizeof(out->data)) {
+            fwrite(text, 1, len, out->file);
+            return;
+        }
+    }
+    memcpy(out->data + out->len, text, len);
+    out->len += len;
+}
+
+void out_str(struct output *out, const char *text) {
+    out_bytes(out, text, strlen(text));
+}
+
+/**
+ * out_ulong prints value in decimal, zero padded to at least width digits.
+ */
+void out_ulong(struct output *out, unsigned long value, int width) {
+    char digits[24];
+    int n = sizeof(digits);
+
+    do {
+        digits[--n] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while ((int) sizeof(digits) - n < width && n > 0) {
+        digits[--n] = '0';
+    }
+    out_bytes(out, digits + n, sizeof(digits) - n);
+}
+
+/**
+ * out_fixed1 prints value the way printf's "%0.1f" does. The value is
+ * scaled to tenths and rounded directly, which gives printf's result
+ * whenever it is not within rounding error of halfway between two tenths;
+ * those values (where printf rounds the exact binary value), very large
+ * ones, infinities and NaNs are left to snprintf.
+ */
+void out_fixed1(struct output *out, double value) {
+    double scaled = value * 10;
+    double magnitude = scaled < 0 ? -scaled : scaled;
+    unsigned long tenths;
+    double fraction;
+    char text[DBL_MAX_10_EXP + 8];
+
+    if (!(magnitude < 1e9)) {
+        snprintf(text, sizeof(text), "%0.1f", value);
+        out_str(out, text);
+        return;
+    }
+    tenths = (unsigned long) magnitude;
+    fraction = magnitude - (double) tenths;
+    if (fraction > 0.5 - 1e-6 && fraction < 0.5 + 1e-6) {
+        snprintf(text, sizeof(text), "%0.1f", value);
+        out_str(out, text);
+        return;
+    }
+    if (fraction > 0.5) {
+        ++tenths;
+    }
+    if (signbit(value)) {
+        out_bytes(out, "-", 1);
+    }
+    out_ulong(out, tenths / 10, 0);
+    text[0] = '.';
+    text[1] = (char) ('0' + tenths % 10);
+    out_bytes(out, text, 2);
+}
+
+/**
+ * out_ctime prints timestamp exactly as ctime would, newline included, in
+ * local time. The broken-down local time of the start of the hour the
+ * timestamp is in is kept between calls, after checking that the UTC
+ * offset is the same at both ends of that hour (so no daylight saving or
+ * other change falls inside it); any timestamp in the same hour is then
+ * that plus its seconds into the hour. Anything else goes through
+ * localtime_r, which unlike ctime is also safe to call from threads.
+ */
+void out_ctime(struct output *out, long timestamp) {
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    long hour = timestamp >= 0 ? timestamp / 3600 : -((-timestamp + 3599) / 3600);
+    long seconds;
+    struct tm tm;
+    char text[64];
+
+    if (!out->cached_valid || out->cached_hour != hour) {
+        time_t start = (time_t) hour * 3600;
+        time_t end = start + 3599;
+        struct tm last;
+
+        out->cached_hour = hour;
+        out->cached_valid = localtime_r(&start, &out->cached_tm) != NULL
+                && localtime_r(&end, &last) != NULL
+                && last.tm_gmtoff == out->cached_tm.tm_gmtoff;
+    }
+
+    tm = out->cached_tm;
+    seconds = tm.tm_hour * 3600L + tm.tm_min * 60 + tm.tm_sec + (timestamp - hour * 3600);
+    if (!out->cached_valid || seconds >= 86400 || tm.tm_year + 1900 > 9999
+            || tm.tm_year + 1900 < 1000) {
+        time_t t = (time_t) timestamp;
+
+        if (localtime_r(&t, &tm) == NULL) {
+            out_str(out, "(null)");
+            return;
+        }
+    } else {
+        tm.tm_hour = (int) (seconds / 3600);
+        tm.tm_min = (int) (seconds / 60 % 60);
+        tm.tm_sec = (int) (seconds % 60);
+    }
+    if (tm.tm_year + 1900 > 9999 || tm.tm_year + 1900 < 1000) {
+        snprintf(text, sizeof(text), "%.3s %.3s%3d %.2d:%.2d:%.2d %d\n",
+                days + 3 * tm.tm_wday, months + 3 * tm.tm_mon, tm.tm_mday,
+                tm.tm_hour, tm.tm_min, tm.tm_sec, 1900 + tm.tm_year);
+        out_str(out, text);
+        return;
+    }
+
+    memcpy(text, days + 3 * tm.tm_wday, 3);
+    text[3] = ' ';
+    memcpy(text + 4, months + 3 * tm.tm_mon, 3);
+    text[7] = ' ';
+    text[8] = tm.tm_mday >= 10 ? (char) ('0' + tm.tm_mday / 10) : ' ';
+    text[9] = (char) ('0' + tm.tm_mday % 10);
+    text[10] = ' ';
+    text[11] = (char) ('0' + tm.tm_hour / 10);
+    text[12] = (char) ('0' + tm.tm_hour % 10);
+    text[13] = ':';
+    text[14] = (char) ('0' + tm.tm_min / 10);
+    text[15] = (char) ('0' + tm.tm_min % 10);
+    text[16] = ':';
+    text[17] = (char) ('0' + tm.tm_sec / 10);
+    text[18] = (char) ('0' + tm.tm_sec % 10);
+    text[19] = ' ';
+    out_bytes(out, text, 20);
+    out_ulong(out, (unsigned long) (tm.tm_year + 1900), 0);
+    out_bytes(out, "\n", 1);
+}
+
+/**
+ * out_iso_time prints timestamp as an ISO 8601 UTC date and time (such as
+ * 2015-08-03T16:00:00Z) and a newline, without any time zone lookup.
+ */
+void out_iso_time(struct output *out, long timestamp) {
+    long days = timestamp >= 0 ? timestamp / 86400 : -((-timestamp + 86399) / 86400);
+    long seconds = timestamp - days * 86400;
+    long year;
+    unsigned month;
+    unsigned day;
+
+    civil_from_days(days, &year, &month, &day);
+    if (year < 0) {
+        out_bytes(out, "-", 1);
+        year = -year;
+    }
+    out_ulong(out, (unsigned long) year, 4);
+    out_bytes(out, "-", 1);
+    out_ulong(out, month, 2);
+    out_bytes(out, "-", 1);
+    out_ulong(out, day, 2);
+    out_bytes(out, "T", 1);
+    out_ulong(out, (unsigned long) (seconds / 3600), 2);
+    out_bytes(out, ":", 1);
+    out_ulong(out, (unsigned long) (seconds / 60 % 60), 2);
+    out_bytes(out, ":", 1);
+    out_ulong(out, (unsigned long) (seconds % 60), 2);
+    out_bytes(out, "Z\n", 2);
+}
+
+/**
+ * out_time prints a report timestamp in the form options ask for.
+ */
+void out_time(struct output *out, long timestamp, const struct report_options *options) {
+    if (options->iso_time) {
+        out_iso_time(out, timestamp);
+    } else {
+        out_ctime(out, timestamp);
+    }
+}
+
+/**
+ * add_compensated adds value to total with Neumaier's variant of Kahan
+ * summation: whichever of the two addends is smaller in magnitude loses
+ * the bits that do not fit, and those are collected in the correction.
+ */
+void add_compensated(struct compensated_sum *total, double value) {
+    double sum = total->sum + value;
+
+    if ((total->sum >= 0 ? total->sum : -total->sum) >= (value >= 0 ? value : -value)) {
+        total->correction += (total->sum - sum) + value;
+    } else {
+        total->correction += (value - sum) + total->sum;
+    }
+    total->sum = sum;
+}
+
+/**
+ * merge_compensated adds the sum and the correction of from to total.
+ */
+void merge_compensated(struct compensated_sum *total, const struct compensated_sum *from) {
+    add_compensated(total, from->sum);
+    add_compensated(total, from->correction);
+}
+
+double compensated_value(const struct compensated_sum *total) {
+    return total->sum + total->correction;
+}
+
+/**
+ * add_moment is Welford's update of moments for one more value, weight
+ * being one over the number of values including it (passed in so that
+ * the moments of several columns share a single division).
+ */
+void add_moment(struct running_moments *moments, double weight, double value) {
+    double delta = value - moments->mean;
+
+    moments->mean += delta * weight;
+    moments->m2 += delta * (value - moments->mean);
+}
+
+/**
+ * merge_moments combines the moments of two disjoint sets of values (Chan
+ * et al.), count and from_count being the sizes of the two sets.
+ */
+void merge_moments(struct running_moments *moments, unsigned long count,
+        const struct running_moments *from, unsigned long from_count) {
+    double total = (double) count + (double) from_count;
+    double delta = from->mean - moments->mean;
+
+    if (from_count == 0) {
+        return;
+    }
+    moments->mean += delta * (double) from_count / total;
+    moments->m2 += from->m2 + delta * delta * (double) count * (double) from_count / total;
+}
+
+/**
+ * moments_stddev gives the sample standard deviation of count values.
+ */
+double moments_stddev(const struct running_moments *moments, unsigned long count) {
+    if (count < 2) {
+        return 0;
+    }
+    return sqrt(moments->m2 / (count - 1));
+}
+
+/**
+ * now_seconds reads the monotonic clock, for timing.
+ */
+double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * cpu_seconds reads a CPU time clock, CLOCK_PROCESS_CPUTIME_ID for the
+ * whole process or CLOCK_THREAD_CPUTIME_ID for the calling thread.
+ */
+double cpu_seconds(clockid_t clock) {
+    struct timespec ts;
+
+    if (clock_gettime(clock, &ts) != 0) {
+        return 0;
+    }
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * print_stats prints what --stats reports at the end of a run: the wall
+ * and CPU time of reading and parsing the input (stage[0] and stage[1])
+ * and of the report (stage[2] and stage[3]), plus the merge of -j, the
+ * time spent waiting for input, the run_stats counters of table, the
+ * totals of each worker thread, and the peak resident set size.
+ */
+void print_stats(const struct state_table *table, const double stage[4]) {
+    const struct run_stats *counts = &table->counts;
+    unsigned long records = 0;
+    struct rusage usage;
+    int i;
+
+    for (i = 0; i < table->num_states; ++i) {
+        records += table->states[i].num_records;
+    }
+    printf("-- Stats --\n");
+    printf("Input: %.3f s wall, %.3f s CPU\n", stage[0], stage[1]);
+    if (table->num_workers > 0) {
+        printf("Merge: %.3f s wall, %.3f s CPU\n", counts->merge_seconds, counts->merge_cpu);
+    }
+    printf("Report: %.3f s wall, %.3f s CPU\n", stage[2], stage[3]);
+    printf("Waiting for input: %.3f s\n", counts->read_seconds);
+    printf("Bytes read: %llu (%.1f MB/s)\n", (unsigned long long) counts->bytes,
+            stage[0] > 0 ? counts->bytes / stage[0] / 1e6 : 0);
+    printf("Lines parsed: %llu\n", (unsigned long long) counts->lines);
+    printf("Records: %lu (%.0f records/s)\n", records, stage[0] > 0 ? records / stage[0] : 0);
+    printf("Malformed lines: %llu\n", (unsigned long long) counts->malformed);
+    printf("Filtered lines: %llu\n", (unsigned long long) counts->filtered);
+    printf("Truncated lines: %llu\n", (unsigned long long) counts->truncated);
+    for (i = 0; i < table->num_workers; ++i) {
+        const struct worker_stats *w = &table->workers[i];
+
+        printf("Worker %d: %d tasks, %llu bytes, %llu lines, %.3f s busy, %.3f s CPU, %.1f MB/s\n",
+                i + 1, w->tasks, (unsigned long long) w->bytes, (unsigned long long) w->lines,
+                w->busy_seconds, w->cpu_seconds,
+                w->busy_seconds > 0 ? w->bytes / w->busy_seconds / 1e6 : 0);
+    }
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        printf("Peak RSS: %ld KB\n", usage.ru_maxrss);
+    }
+}
+
+/**
+ * bench_parser is a microbenchmark of parse_record against the original
+ * strtok path. The file is read into memory up front and both parsers are
+ * run over the same lines several times; the best run of each is reported
+ * along with a checksum, which should match between the two.
+ */
+int bench_parser(const char *path) {
+    const int runs = 5;
+    FILE *file = fopen(path, "rb");
+    char *data;
+    char line[256];
+    long size;
+    int run;
+
+    if (file == NULL) {
+        printf("ERROR: %s does not exist\n", path);
+        return EXIT_FAILURE;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    rewind(file);
+    data = malloc((size_t) size + 1);
+    if (data == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fread(data, 1, (size_t) size, file) != (size_t) size) {
+        printf("ERROR: could not read %s\n", path);
+        free(data);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+    data[size] = '\0';
+    fclose(file);
+
+    for (int which = 0; which < 2; ++which) {
+        double best = DBL_MAX;
+        double checksum = 0;
+        unsigned long records = 0;
+
+        for (run = 0; run < runs; ++run) {
+            const char *p = data;
+            const char *end = data + size;
+            struct tdv_record rec;
+            double start = now_seconds();
+            double elapsed;
+
+            checksum = 0;
+            records = 0;
+            while (p < end) {
+                const char *eol = memchr(p, '\n', (size_t) (end - p));
+                int ok;
+
+                if (eol == NULL) {
+                    eol = end;
+                }
+                if (which == 0) {
+                    size_t len = (size_t) (eol - p);
+
+                    if (len >= sizeof(line)) {
+                        len = sizeof(line) - 1;
+                    }
+                    memcpy(line, p, len);
+                    line[len] = '\0';
+                    ok = parse_record_strtok(line, &rec);
+                } else {
+                    ok = parse_record(p, eol, NULL, &rec);
+                }
+                if (ok) {
+                    checksum += rec.timestamp + rec.humidity + rec.snow + rec.cloud_cover
+                            + rec.lightning + rec.pressure + rec.temperature;
+                    ++records;
+                }
+                p = eol + 1;
+            }
+            elapsed = now_seconds() - start;
+            if (elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        printf("%-8s %lu records, %.3f s, %.1f ns/record, %.1f MB/s, checksum %.6f\n",
+                which == 0 ? "strtok" : "parser", records, best,
+                best * 1e9 / (records ? records : 1), size / best / 1e6, checksum);
+    }
+
+    free(data);
+    return 0;
+}
+
+/**
+ * State codes used by generate_tdv, US states first. Past the end of this
+ * list codes are made up from pairs of letters.
+ */
+static const char *const generated_codes[] = {
+    "AL", "AK", "AZ", "AR", "CA", "CO", "CT", "DE", "FL", "GA", "HI", "ID", "IL",
+    "IN", "IA", "KS", "KY", "LA", "ME", "MD", "MA", "MI", "MN", "MS", "MO", "MT",
+    "NE", "NV", "NH", "NJ", "NM", "NY", "NC", "ND", "OH", "OK", "OR", "PA", "RI",
+    "SC", "SD", "TN", "TX", "UT", "VT", "VA", "WA", "WV", "WI", "WY"
+};
+
+/**
+ * next_random is a xorshift64* generator, so generated files are the same
+ * on every run and machine.
+ */
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * generate_tdv writes records lines of synthetic data over the given number
+ * of state codes to path, in the format described at the top of this file:
+ * hourly timestamps within 2015, 12 character geohashes, one decimal place
+ * for humidity, cloud cover and pressure, and 0/1 snow and lightning
+ * indicators. Returns 0 on success or EXIT_FAILURE.
+ */
+int generate_tdv(const char *path, unsigned long records, int states) {
+    static const char base32[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+    const int known = (int) (sizeof(generated_codes) / sizeof(generated_codes[0]));
+    FILE *file = fopen(path, "w");
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    unsigned long i;
+
+    if (states < 1 || states > 26 * 26) {
+        printf("ERROR: --states must be between 1 and %d\n", 26 * 26);
+        return EXIT_FAILURE;
+    }
+    if (file == NULL) {
+        printf("ERROR: %s could not be written\n", path);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < records; ++i) {
+        int state = (int) (next_random(&seed) % (uint64_t) states);
+        char code[3] = { 0 };
+        char geohash[13] = { 0 };
+        long long timestamp = 1420070400000LL + (long long) (next_random(&seed) % 8760) * 3600000LL;
+        double kelvin = 240 + (next_random(&seed) % 8000000) / 100000.0;
+
+        if (state < known) {
+            memcpy(code, generated_codes[state], 2);
+        } else {
+            code[0] = (char) ('A' + state / 26);
+            code[1] = (char) ('A' + state % 26);
+        }
+        for (int k = 0; k < 12; ++k) {
+            geohash[k] = base32[next_random(&seed) % 32];
+        }
+        fprintf(file, "%s\t%lld\t%s\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.5f\n",
+                code, timestamp, geohash,
+                (double) (next_random(&seed) % 1001) / 10,
+                (double) (next_random(&seed) % 10 == 0),
+                (double) (next_random(&seed) % 1001) / 10,
+                (double) (next_random(&seed) % 50 == 0),
+                95000 + (double) (next_random(&seed) % 80000) / 10,
+                kelvin);
+    }
+
+    if (fclose(file) != 0) {
+        printf("ERROR: %s could not be written\n", path);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+/**
+ * min_seconds keeps the fastest of two timings.
+ */
+double min_seconds(double a, double b) {
+    return a < b ? a : b;
+}
+
+/**
+ * run_bench times the stages of a run over one TDV file, either the one
+ * given or (when path is NULL) a temporary one made with generate_tdv:
+ *
+ *   read       read() the whole file into memory
+ *   parse      parse_record over every line
+ *   aggregate  add_record over the already parsed records
+ *   report     print_report, with stdout sent to /dev/null
+ *
+ * Each stage is run three times and the fastest kept. Rates are printed
+ * as records/s and MB/s of input. save_baseline writes the rates to a file,
+ * and baseline compares against one written earlier, failing (returning
+ * EXIT_FAILURE) if any stage is more than threshold percent slower.
+ */
+int run_bench(const char *path, unsigned long records, int states, const char *baseline,
+        const char *save_baseline, double threshold) {
+    static const char *const stages[] = { "read", "parse", "aggregate", "report" };
+    char tmp_path[] = "/tmp/climate-bench-XXXXXX";
+    double best[4] = { DBL_MAX, DBL_MAX, DBL_MAX, DBL_MAX };
+    struct report_options options = { 0, 0, FORMAT_TEXT };
+    static struct output out;
+    struct tdv_record *parsed = NULL;
+    unsigned long num_parsed = 0;
+    char *data = NULL;
+    size_t size = 0;
+    int failed = 0;
+    int run;
+    int k;
+
+    if (path == NULL) {
+        int fd = mkstemp(tmp_path);
+
+        if (fd < 0) {
+            printf("ERROR: could not create a temporary file\n");
+            return EXIT_FAILURE;
+        }
+        close(fd);
+        if (generate_tdv(tmp_path, records, states) != 0) {
+            unlink(tmp_path);
+            return EXIT_FAILURE;
+        }
+        path = tmp_path;
+    }
+
+    for (run = 0; run < 3; ++run) {
+        struct state_table table = { 0 };
+        const char *p;
+        const char *end;
+        double start;
+        int fd = open(path, O_RDONLY);
+        int saved_stdout;
+        struct stat st;
+        size_t have = 0;
+        ssize_t n;
+
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            printf("ERROR: %s does not exist\n", path);
+            failed = 1;
+            break;
+        }
+
+        /* read */
+        start = now_seconds();
+        if (data == NULL) {
+            size = (size_t) st.st_size;
+            data = malloc(size + 1);
+            parsed = malloc((size / 32 + 1) * sizeof(struct tdv_record));
+            if (data == NULL || parsed == NULL) {
+                printf("ERROR: Memory could not be allocated\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        while (have < size && (n = read(fd, data + have, size - have)) > 0) {
+            have += (size_t) n;
+        }
+        close(fd);
+        best[0] = min_seconds(best[0], now_seconds() - start);
+
+        /* parse */
+        start = now_seconds();
+        num_parsed = 0;
+        for (p = data, end = data + have; p < end;) {
+            const char *eol = memchr(p, '\n', (size_t) (end - p));
+
+            if (eol == NULL) {
+                eol = end;
+            }
+            if (num_parsed < size / 32 + 1 && parse_record(p, eol, NULL, &parsed[num_parsed])) {
+                ++num_parsed;
+            }
+            p = eol + 1;
+        }
+        best[1] = min_seconds(best[1], now_seconds() - start);
+
+        /* aggregate */
+        start = now_seconds();
+        for (unsigned long i = 0; i < num_parsed; ++i) {
+            add_record(&table, &parsed[i]);
+        }
+        best[2] = min_seconds(best[2], now_seconds() - start);
+
+        /* report */
+        saved_stdout = quiet_stdout();
+        start = now_seconds();
+        out_init(&out, stdout);
+        print_report(&out, table.states, table.num_states, &options);
+        out_flush(&out);
+        fflush(stdout);
+        best[3] = min_seconds(best[3], now_seconds() - start);
+        restore_stdout(saved_stdout);
+
+        free_table(&table);
+    }
+
+    if (!failed) {
+        FILE *base = baseline != NULL ? fopen(baseline, "r") : NULL;
+        FILE *save = save_baseline != NULL ? fopen(save_baseline, "w") : NULL;
+
+        if (baseline != NULL && base == NULL) {
+            printf("ERROR: %s does not exist\n", baseline);
+            failed = 1;
+        }
+        printf("Benchmark: %s, %lu records, %.1f MB\n", path == tmp_path ? "synthetic" : path,
+                num_parsed, size / 1e6);
+        printf("%-10s %14s %10s %10s\n", "stage", "records/s", "MB/s", "seconds");
+        for (k = 0; k < 4; ++k) {
+            double rate = num_parsed / best[k];
+            double mb = size / best[k] / 1e6;
+
+            double old_rate = base != NULL ? baseline_rate(base, stages[k]) : 0;
+
+            printf("%-10s %14.0f %10.1f %10.4f", stages[k], rate, mb, best[k]);
+            if (old_rate > 0) {
+                double change = (rate / old_rate - 1) * 100;
+
+                printf("  %+.1f%% vs baseline", change);
+                if (change < -threshold) {
+                    printf(" REGRESSION");
+                    failed = 1;
+                }
+            }
+            printf("\n");
+            if (save != NULL) {
+                fprintf(save, "%s %.0f %.1f\n", stages[k], rate, mb);
+            }
+        }
+        if (base != NULL) {
+            fclose(base);
+        }
+        if (save != NULL && fclose(save) != 0) {
+            printf("ERROR: %s could not be written\n", save_baseline);
+            failed = 1;
+        }
+    }
+
+    if (path == tmp_path) {
+        unlink(tmp_path);
+    }
+    free(data);
+    free(parsed);
+    return failed ? EXIT_FAILURE : 0;
+}
+
+/**
+ * baseline_rate looks up the records/s saved for name in a baseline file
+ * written by run_bench or run_verify, returning 0 if it has none.
+ */
+double baseline_rate(FILE *base, const char *name) {
+    char saved[32];
+    double rate;
+    double mb;
+
+    rewind(base);
+    while (fscanf(base, "%31s %lf %lf", saved, &rate, &mb) == 3) {
+        if (strcmp(saved, name) == 0) {
+            return rate;
+        }
+    }
+    return 0;
+}
+
+/**
+ * quiet_stdout points stdout at /dev/null, so the "Opening file" lines of
+ * a timed run are not part of its time, and returns the descriptor to give
+ * restore_stdout afterward.
+ */
+int quiet_stdout(void) {
+    int saved;
+    int devnull;
+
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    return saved;
+}
+
+/**
+ * restore_stdout undoes quiet_stdout.
+ */
+void restore_stdout(int saved) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+/**
+ * run_verify reads the same records every way climate can and checks that
+ * each gives the same report. The TDV files given (or, with none, a
+ * temporary one made with generate_tdv) are read with each ingest mode,
+ * serially and with jobs threads, and so are a columnar file converted from
+ * them, gzip and zstd copies of each file, and a partial result saved from
+ * the first run. The modes that need gzip or zstd are skipped if the tool
+ * is not installed. Every run collects quantiles and all metrics, and its
+ * report (with standard deviations) must match that of the first, plain
+ * fgets run line for line.
+ *
+ * That only shows the modes agree, so a file given as data.tdv is also
+ * read on its own and its report compared with data.expected, if there is
+ * one next to it (see check_expected). Times are printed in UTC, so the
+ * expected reports do not depend on the local time zone.
+ *
+ * Like run_bench, each mode is run three times and the fastest kept, and
+ * its records/s and MB/s (of TDV text) can be saved to or compared with a
+ * baseline file. The modes are also compared with each other: reading the
+ * columnar file skips all text parsing, so a columnar mode more than
+ * threshold percent slower than fgets, with or without threads, counts as
+ * a regression even without a baseline. Returns EXIT_FAILURE if any mode
+ * gave a different report, a file's report differs from its expected one,
+ * or a mode regressed.
+ */
+int run_verify(char *paths[], int num_paths, unsigned long records, int states, int jobs,
+        const struct record_filter *filter, const char *baseline, const char *save_baseline,
+        double threshold) {
+    static const struct verify_mode modes[] = {
+        { "fgets", VERIFY_TDV, INGEST_FGETS, 0 },
+        { "mmap", VERIFY_TDV, INGEST_MMAP, 0 },
+        { "stream", VERIFY_TDV, INGEST_STREAM, 0 },
+        { "prefetch", VERIFY_TDV, INGEST_PREFETCH, 0 },
+        { "fgets", VERIFY_TDV, INGEST_FGETS, 1 },
+        { "mmap", VERIFY_TDV, INGEST_MMAP, 1 },
+        { "stream", VERIFY_TDV, INGEST_STREAM, 1 },
+        { "prefetch", VERIFY_TDV, INGEST_PREFETCH, 1 },
+        { "columnar", VERIFY_COLUMNAR, INGEST_MMAP, 0 },
+        { "columnar", VERIFY_COLUMNAR, INGEST_MMAP, 1 },
+        { "gzip", VERIFY_GZIP, INGEST_FGETS, 0 },
+        { "gzip", VERIFY_GZIP, INGEST_FGETS, 1 },
+        { "zstd", VERIFY_ZSTD, INGEST_FGETS, 0 },
+        { "zstd", VERIFY_ZSTD, INGEST_FGETS, 1 },
+        { "partial", VERIFY_PARTIAL, INGEST_FGETS, 0 }
+    };
+    int num_modes = (int) (sizeof(modes) / sizeof(modes[0]));
+    char dir[] = "/tmp/climate-verify-XXXXXX";
+    char synthetic[64];
+    char col_path[64];
+    char agg_path[64];
+    char *col_input[1] = { col_path };
+    char *agg_input[1] = { agg_path };
+    char **gzip_inputs = NULL;
+    char **zstd_inputs = NULL;
+    int have_gzip = 1;
+    int have_zstd = 1;
+    char *expected = NULL;
+    size_t expected_len = 0;
+    unsigned long num_records = 0;
+    double bytes = 0;
+    FILE *base = NULL;
+    FILE *save = NULL;
+    double text_rate[2] = { 0, 0 };
+    int differ = 0;
+    int regressed = 0;
+    int failed = 0;
+    int m;
+    int i;
+
+    if (mkdtemp(dir) == NULL) {
+        printf("ERROR: could not create a temporary directory\n");
+        return EXIT_FAILURE;
+    }
+    setenv("TZ", "UTC", 1);
+    tzset();
+    snprintf(synthetic, sizeof(synthetic), "%s/synthetic.tdv", dir);
+    snprintf(col_path, sizeof(col_path), "%s/all.col", dir);
+    snprintf(agg_path, sizeof(agg_path), "%s/all.agg", dir);
+
+    if (num_paths == 0) {
+        static char *synthetic_input[1];
+
+        if (generate_tdv(synthetic, records, states) != 0) {
+            rmdir(dir);
+            return EXIT_FAILURE;
+        }
+        synthetic_input[0] = synthetic;
+        paths = synthetic_input;
+        num_paths = 1;
+    }
+    for (i = 0; i < num_paths; ++i) {
+        struct stat st;
+
+        if (strcmp(paths[i], "-") == 0 || decompressor_for(paths[i]) != NULL) {
+            printf("ERROR: --verify reads plain TDV files, not %s\n", paths[i]);
+            failed = 1;
+        } else if (stat(paths[i], &st) != 0) {
+            printf("ERROR: %s does not exist\n", paths[i]);
+            failed = 1;
+        } else {
+            bytes += (double) st.st_size;
+        }
+    }
+    if (baseline != NULL && (base = fopen(baseline, "r")) == NULL) {
+        printf("ERROR: %s does not exist\n", baseline);
+        failed = 1;
+    }
+    if (save_baseline != NULL && (save = fopen(save_baseline, "w")) == NULL) {
+        printf("ERROR: %s could not be written\n", save_baseline);
+        failed = 1;
+    }
+
+    /* The other copies of the input, made before anything is timed. */
+    gzip_inputs = calloc((size_t) num_paths, sizeof(char *));
+    zstd_inputs = calloc((size_t) num_paths, sizeof(char *));
+    if (gzip_inputs == NULL || zstd_inputs == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!failed) {
+        int saved_stdout = quiet_stdout();
+
+        failed = convert_files(col_path, paths, num_paths, filter) != 0;
+        restore_stdout(saved_stdout);
+        if (failed) {
+            printf("ERROR: %s could not be written\n", col_path);
+        }
+    }
+    for (i = 0; !failed && i < num_paths; ++i) {
+        gzip_inputs[i] = malloc(strlen(dir) + 32);
+        zstd_inputs[i] = malloc(strlen(dir) + 32);
+        if (gzip_inputs[i] == NULL || zstd_inputs[i] == NULL) {
+            printf("ERROR: Memory could not be allocated\n");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(gzip_inputs[i], "%s/%d.gz", dir, i);
+        sprintf(zstd_inputs[i], "%s/%d.zst", dir, i);
+        have_gzip = have_gzip && compress_file("gzip", paths[i], gzip_inputs[i]);
+        have_zstd = have_zstd && compress_file("zstd", paths[i], zstd_inputs[i]);
+    }
+
+    if (!failed) {
+        printf("Verify: %d file%s, %.1f MB, -j %d\n", num_paths, num_paths == 1 ? "" : "s",
+                bytes / 1e6, jobs);
+        printf("%-12s %14s %10s %10s  %s\n", "mode", "records/s", "MB/s", "seconds", "result");
+    }
+    for (m = 0; !failed && m < num_modes; ++m) {
+        const struct verify_mode *mode = &modes[m];
+        char **inputs = paths;
+        char name[32];
+        double best = DBL_MAX;
+        long bad_line = 0;
+        int run;
+
+        if (mode->parallel) {
+            snprintf(name, sizeof(name), "%s-j%d", mode->name, jobs);
+        } else {
+            snprintf(name, sizeof(name), "%s", mode->name);
+        }
+        if ((mode->input == VERIFY_GZIP && !have_gzip)
+                || (mode->input == VERIFY_ZSTD && !have_zstd)) {
+            printf("%-12s %14s %10s %10s  skipped, %s is not installed\n", name, "-", "-", "-",
+                    mode->name);
+            continue;
+        }
+        if (mode->input == VERIFY_COLUMNAR) {
+            inputs = col_input;
+        } else if (mode->input == VERIFY_GZIP) {
+            inputs = gzip_inputs;
+        } else if (mode->input == VERIFY_ZSTD) {
+            inputs = zstd_inputs;
+        } else if (mode->input == VERIFY_PARTIAL) {
+            inputs = agg_input;
+        }
+
+        for (run = 0; run < 3; ++run) {
+            struct state_table table;
+            double start;
+            char *report;
+            size_t len;
+
+            verify_table(&table, filter);
+            start = now_seconds();
+            if (!verify_run(mode, inputs, mode->input == VERIFY_TDV || mode->input == VERIFY_GZIP
+                        || mode->input == VERIFY_ZSTD ? num_paths : 1, jobs, &table)) {
+                failed = 1;
+            }
+            best = min_seconds(best, now_seconds() - start);
+
+            report = verify_report(&table, &len);
+            if (expected == NULL) {
+                expected = report;
+                expected_len = len;
+                for (i = 0; i < table.num_states; ++i) {
+                    num_records += table.states[i].num_records;
+                }
+                failed = failed || !save_partial(agg_path, &table);
+            } else {
+                if (bad_line == 0) {
+                    bad_line = differing_line(report, len, expected, expected_len);
+                }
+                free(report);
+            }
+            free_table(&table);
+        }
+
+        printf("%-12s %14.0f %10.1f %10.4f  ", name, num_records / best, bytes / best / 1e6,
+                best);
+        if (failed) {
+            printf("failed\n");
+            break;
+        }
+        if (m == 0) {
+            printf("reference");
+        } else if (bad_line > 0) {
+            printf("DIFFERS from line %ld", bad_line);
+            differ = 1;
+        } else {
+            printf("same");
+        }
+        if (mode->input == VERIFY_TDV && mode->mode == INGEST_FGETS) {
+            text_rate[mode->parallel] = num_records / best;
+        } else if (mode->input == VERIFY_COLUMNAR
+                && num_records / best < text_rate[mode->parallel] * (1 - threshold / 100)) {
+            printf(", SLOWER than fgets");
+            regressed = 1;
+        }
+        if (base != NULL) {
+            double old_rate = baseline_rate(base, name);
+
+            if (old_rate > 0) {
+                double change = (num_records / best / old_rate - 1) * 100;
+
+                printf(", %+.1f%% vs baseline", change);
+                if (change < -threshold) {
+                    printf(" REGRESSION");
+                    regressed = 1;
+                }
+            }
+        }
+        printf("\n");
+        if (save != NULL) {
+            fprintf(save, "%s %.0f %.1f\n", name, num_records / best, bytes / best / 1e6);
+        }
+    }
+    if (!failed && !differ) {
+        printf("Every mode gave the same report for %lu records\n", num_records);
+    }
+    for (i = 0; !failed && filter == NULL && i < num_paths; ++i) {
+        int result = check_expected(paths[i]);
+
+        differ = differ || result < 0;
+        failed = result == 0;
+    }
+
+    if (base != NULL) {
+        fclose(base);
+    }
+    if (save != NULL && fclose(save) != 0) {
+        printf("ERROR: %s could not be written\n", save_baseline);
+        failed = 1;
+    }
+    for (i = 0; i < num_paths; ++i) {
+        if (gzip_inputs[i] != NULL) {
+            unlink(gzip_inputs[i]);
+        }
+        if (zstd_inputs[i] != NULL) {
+            unlink(zstd_inputs[i]);
+        }
+        free(gzip_inputs[i]);
+        free(zstd_inputs[i]);
+    }
+    unlink(synthetic);
+    unlink(col_path);
+    unlink(agg_path);
+    rmdir(dir);
+    free(gzip_inputs);
+    free(zstd_inputs);
+    free(expected);
+    return failed || differ || regressed ? EXIT_FAILURE : 0;
+}
+
+/**
+ * check_expected compares the report of the TDV file at path, read on its
+ * own in the way run_verify reads it, with the one saved next to it with
+ * the extension .expected in place of .tdv (or added), printing a line
+ * saying whether they match. Returns 1 if they do or there is no expected
+ * report, -1 if they differ, and 0 if the expected report cannot be read.
+ */
+int check_expected(const char *path) {
+    static const struct verify_mode fgets_mode = { "fgets", VERIFY_TDV, INGEST_FGETS, 0 };
+    size_t base_len = strlen(path);
+    char *expected_path = malloc(base_len + sizeof(".expected"));
+    char *inputs[1] = { (char *) path };
+    char *expected = NULL;
+    size_t expected_len = 0;
+    struct state_table table;
+    char buf[4096];
+    char *report;
+    size_t len;
+    size_t n;
+    long bad_line;
+    FILE *file;
+
+    if (expected_path == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    if (base_len > 4 && strcmp(path + base_len - 4, ".tdv") == 0) {
+        base_len -= 4;
+    }
+    memcpy(expected_path, path, base_len);
+    strcpy(expected_path + base_len, ".expected");
+    file = fopen(expected_path, "r");
+    if (file == NULL) {
+        free(expected_path);
+        return 1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+        append_text(&expected, &expected_len, buf, n);
+    }
+    if (ferror(file)) {
+        printf("ERROR: %s could not be read\n", expected_path);
+        fclose(file);
+        free(expected_path);
+        free(expected);
+        return 0;
+    }
+    fclose(file);
+
+    verify_table(&table, NULL);
+    verify_run(&fgets_mode, inputs, 1, 1, &table);
+    report = verify_report(&table, &len);
+    bad_line = differing_line(report, len, expected, expected_len);
+    if (bad_line > 0) {
+        printf("%s: DIFFERS from %s at line %ld\n", path, expected_path, bad_line);
+    } else {
+        printf("%s: same as %s\n", path, expected_path);
+    }
+
+    free_table(&table);
+    free(report);
+    free(expected);
+    free(expected_path);
+    return bad_line > 0 ? -1 : 1;
+}
+
+/**
+ * verify_table sets table up the way run_verify reads into it: empty,
+ * with quantiles and every metric turned on, and keeping what filter does.
+ */
+void verify_table(struct state_table *table, const struct record_filter *filter) {
+    memset(table, 0, sizeof(*table));
+    table->quantiles = 1;
+    table->filter = filter;
+    for (int m = 0; m < NUM_METRICS; ++m) {
+        table->metrics[m] = m;
+    }
+    table->num_metrics = NUM_METRICS;
+}
+
+/**
+ * differing_line returns the number of the first line where the report of
+ * len bytes differs from the expected one, or 0 if they are the same.
+ */
+long differing_line(const char *report, size_t len, const char *expected, size_t expected_len) {
+    long line = 1;
+    size_t k;
+
+    if (len == expected_len && (len == 0 || memcmp(report, expected, len) == 0)) {
+        return 0;
+    }
+    for (k = 0; k < len && k < expected_len && report[k] == expected[k]; ++k) {
+        line += report[k] == '\n';
+    }
+    return line;
+}
+
+/**
+ * verify_run reads inputs into table the way mode says, with the messages
+ * of the run sent to /dev/null. Returns 0 if the inputs could not be read
+ * (only a partial result reports that), or 1.
+ */
+int verify_run(const struct verify_mode *mode, char *inputs[], int num_inputs, int jobs,
+        struct state_table *table) {
+    int saved_stdout = quiet_stdout();
+    int ok = 1;
+    int i;
+
+    if (mode->input == VERIFY_PARTIAL) {
+        ok = load_partial(inputs[0], table);
+    } else if (mode->parallel) {
+        analyze_parallel(inputs, num_inputs, mode->mode, jobs, table);
+    } else {
+        for (i = 0; i < num_inputs; ++i) {
+            analyze_path(inputs[i], mode->mode, table);
+        }
+    }
+    restore_stdout(saved_stdout);
+    return ok;
+}
+
+/**
+ * verify_report returns the text report of table, with standard deviations,
+ * in a malloc'd buffer of len bytes.
+ */
+char *verify_report(const struct state_table *table, size_t *len) {
+    static struct output out;
+    struct report_options options = { 1, 0, FORMAT_TEXT };
+    char *text = NULL;
+    FILE *file = open_memstream(&text, len);
+
+    if (file == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    out_init(&out, file);
+    print_report(&out, table->states, table->num_states, &options);
+    out_flush(&out);
+    fclose(file);
+    return text;
+}
+
+/**
+ * compress_file writes a copy of path compressed by tool (gzip or zstd) to
+ * out_path. Returns 1 on success, or 0 if tool failed or is not installed.
+ */
+int compress_file(const char *tool, const char *path, const char *out_path) {
+    int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int status;
+    pid_t child;
+
+    if (fd < 0) {
+        return 0;
+    }
+    child = fork();
+    if (child == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+
+        if (dup2(fd, STDOUT_FILENO) < 0 || dup2(devnull, STDERR_FILENO) < 0) {
+            _exit(127);
+        }
+        execlp(tool, tool, "-cq", "--", path, (char *) NULL);
+        _exit(127);
+    }
+    close(fd);
+    return child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status)
+        && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * print_all prints everything a run reports: the per-state report, then
+ * the time series and geohash cells if they were asked for.
+ */
+void print_all(struct output *out, const struct state_table *table,
+        const struct report_options *options, const int *geo_levels, int num_geo_levels) {
+    print_report(out, table->states, table->num_states, options);
+    if (table->bucket != BUCKET_NONE) {
+        print_series(out, table, options);
+    }
+    if (table->geo != NULL) {
+        print_geo(out, table->geo, geo_levels, num_geo_levels, options);
+    }
+}
+
+/* Set by stop_daemon to end the run_daemon loop. */
+static volatile sig_atomic_t daemon_stopping = 0;
+
+/**
+ * stop_daemon is the SIGINT and SIGTERM handler of run_daemon.
+ */
+void stop_daemon(int signal_number) {
+    (void) signal_number;
+    daemon_stopping = 1;
+}
+
+/**
+ * run_daemon keeps table up to date with the .tdv files in dir until it
+ * is sent SIGINT or SIGTERM. Files already there are read in full first;
+ * after that inotify says which files were written to, created or moved
+ * in, and only the bytes appended since they were last read are parsed
+ * (see follow_file), so the aggregates never have to be rebuilt. Every
+ * connection to the Unix socket at socket_path gets the current report, in
+ * the format options ask for, and is then closed; printing it only walks
+ * the aggregates, so how long it takes does not depend on how much data is
+ * behind them. Returns 0 once stopped, or EXIT_FAILURE if the directory
+ * cannot be watched or the socket not set up.
+ */
+int run_daemon(const char *dir, const char *socket_path, struct state_table *table,
+        const struct report_options *options, const int *geo_levels, int num_geo_levels) {
+#ifdef HAVE_INOTIFY
+    static struct output out;
+    struct watched_file *files = NULL;
+    int num_files = 0;
+    char *buf = malloc(STREAM_BUFFER_SIZE);
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct sigaction action;
+    struct pollfd fds[2];
+    DIR *listing;
+    struct dirent *entry;
+    int i;
+
+    if (buf == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    fds[0].fd = inotify_init1(IN_CLOEXEC);
+    if (fds[0].fd < 0 || inotify_add_watch(fds[0].fd, dir,
+                IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_DELETE
+                | IN_MOVED_FROM) < 0) {
+        printf("ERROR: %s could not be watched\n", dir);
+        return EXIT_FAILURE;
+    }
+    fds[1].fd = open_report_socket(socket_path);
+    if (fds[1].fd < 0) {
+        return EXIT_FAILURE;
+    }
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_daemon;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* The watch is in place first, so nothing written from here on is missed. */
+    listing = opendir(dir);
+    while (listing != NULL && (entry = readdir(listing)) != NULL) {
+        if (is_tdv_name(entry->d_name)) {
+            follow_file(dir, watch_file(&files, &num_files, entry->d_name), buf, table);
+        }
+    }
+    if (listing != NULL) {
+        closedir(listing);
+    }
+    printf("Watching %s, reports on %s\n", dir, socket_path);
+    fflush(stdout);
+
+    while (!daemon_stopping) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("ERROR: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            ssize_t len = read(fds[0].fd, events, sizeof(events));
+            char *p;
+
+            for (p = events; len > 0 && p < events + len; ) {
+                const struct inotify_event *event = (const struct inotify_event *) p;
+
+                p += sizeof(struct inotify_event) + event->len;
+                if (event->len == 0 || !is_tdv_name(event->name)) {
+                    continue;
+                }
+                for (i = 0; i < num_files && strcmp(files[i].name, event->name) != 0; ++i) {
+                }
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    /* What was read from it stays counted; a new file of that name starts over. */
+                    if (i < num_files) {
+                        free(files[i].name);
+                        files[i] = files[--num_files];
+                    }
+                    continue;
+                }
+                follow_file(dir, i < num_files ? &files[i]
+                        : watch_file(&files, &num_files, event->name), buf, table);
+            }
+            fflush(stdout);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int client = accept(fds[1].fd, NULL, NULL);
+            struct timeval timeout = { 5, 0 };
+            FILE *file;
+
+            if (client < 0) {
+                continue;
+            }
+            /* A client that stops reading must not hold up the files. */
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            file = fdopen(client, "w");
+            if (file == NULL) {
+                close(client);
+                continue;
+            }
+            out_init(&out, file);
+            print_all(&out, table, options, geo_levels, num_geo_levels);
+            out_flush(&out);
+            fclose(file);
+        }
+    }
+
+    close(fds[0].fd);
+    close(fds[1].fd);
+    unlink(socket_path);
+    for (i = 0; i < num_files; ++i) {
+        free(files[i].name);
+    }
+    free(files);
+    free(buf);
+    return 0;
+#else
+    (void) dir;
+    (void) socket_path;
+    (void) table;
+    (void) options;
+    (void) geo_levels;
+    (void) num_geo_levels;
+    printf("ERROR: --watch needs inotify, which this system does not have\n");
+    return EXIT_FAILURE;
+#endif
+}
+
+/**
+ * watch_file adds a file called name, not read from yet, to the num_files
+ * watched files and returns it. Program exits if allocation fails.
+ */
+struct watched_file *watch_file(struct watched_file **files, int *num_files,
+        const char *name) {
+    struct watched_file *watched;
+
+    *files = realloc(*files, (size_t) (*num_files + 1) * sizeof(struct watched_file));
+    if (*files == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    watched = &(*files)[(*num_files)++];
+    watched->name = strdup(name);
+    watched->offset = 0;
+    watched->skipping = 0;
+    if (watched->name == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    return watched;
+}
+
+/**
+ * follow_file parses whatever has been appended to a watched file since
+ * it was last read, up to its last complete line; a line still being
+ * written is left for next time. If the file has shrunk it was truncated
+ * or rewritten, and reading goes on from its new end, since the records
+ * already counted cannot be taken back out. Lines longer than the
+ * STREAM_BUFFER_SIZE buffer are dropped, as analyze_stream does.
+ */
+void follow_file(const char *dir, struct watched_file *watched, char *buf,
+        struct state_table *table) {
+    char path[4096];
+    struct stat st;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, watched->name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size < watched->offset) {
+        printf("%s was truncated, following it from its new end\n", path);
+        watched->offset = st.st_size;
+        watched->skipping = 0;
+    }
+
+    for (;;) {
+        ssize_t got = pread(fd, buf, STREAM_BUFFER_SIZE, watched->offset);
+        const char *start = buf;
+        const char *last;
+
+        if (got <= 0) {
+            break;
+        }
+        last = NULL;
+        for (const char *p = buf + got; p > buf; --p) {
+            if (p[-1] == '\n') {
+                last = p;
+                break;
+            }
+        }
+        if (last == NULL) {
+            if (got < STREAM_BUFFER_SIZE) {
+                break;
+            }
+            /* Not even one line fits: drop it up to its newline. */
+            watched->offset += got;
+            watched->skipping = 1;
+            continue;
+        }
+        if (watched->skipping) {
+            start = memchr(buf, '\n', (size_t) (last - buf)) + 1;
+            watched->skipping = 0;
+        }
+        if (watched->offset == 0) {
+            printf("Opening file: %s\n", path);
+        }
+        analyze_buffer(start, (size_t) (last - start), table);
+        watched->offset += last - buf;
+    }
+    close(fd);
+}
+
+/**
+ * is_tdv_name checks whether a directory entry is one run_daemon follows:
+ * a name ending in .tdv and not starting with a dot.
+ */
+int is_tdv_name(const char *name) {
+    size_t len = strlen(name);
+
+    return name[0] != '.' && len > 4 && strcmp(name + len - 4, ".tdv") == 0;
+}
+
+/**
+ * open_report_socket creates the listening Unix socket run_daemon serves
+ * reports on, replacing a stale socket file left at path. Returns the
+ * socket, or -1 after printing an error.
+ */
+int open_report_socket(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("ERROR: socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(fd, 16) != 0) {
+        printf("ERROR: could not listen on %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * fetch_report connects to a run_daemon socket at path and copies the
+ * report it sends to stdout. Returns 0 on success or EXIT_FAILURE.
+ */
+int fetch_report(const char *path) {
+    struct sockaddr_un addr;
+    char buf[65536];
+    ssize_t got;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("ERROR: socket path %s is too long\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        printf("ERROR: could not connect to %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    while ((got = read(fd, buf, sizeof(buf))) > 0) {
+        if (fwrite(buf, 1, (size_t) got, stdout) != (size_t) got) {
+            break;
+        }
+    }
+    close(fd);
+    return got == 0 && fflush(stdout) == 0 ? 0 : EXIT_FAILURE;
+}
+
+/**
+ * shard_option_arity tells which options --workers passes on to the
+ * workers with each shard: those that change what is collected or how
+ * the files are read. Returns the number of values the option takes (0
+ * or 1), or -1 for an option that stays with the coordinator. serve_shard
+ * refuses any other option, so a worker only ever runs an analysis.
+ */
+int shard_option_arity(const char *arg) {
+    static const char *const flags[] = { "--mmap", "--stream", "--prefetch", "--quantiles",
+        "--no-validate" };
+    static const char *const valued[] = { "-j", "--metrics", "--from", "--to", "--states" };
+    size_t k;
+
+    for (k = 0; k < sizeof(flags) / sizeof(flags[0]); ++k) {
+        if (strcmp(arg, flags[k]) == 0) {
+            return 0;
+        }
+    }
+    for (k = 0; k < sizeof(valued) / sizeof(valued[0]); ++k) {
+        if (strcmp(arg, valued[k]) == 0) {
+            return 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * run_workers has the files analyzed by the workers listed (comma separated
+ * host:port pairs) in workers, each one running --serve-shards, and merges
+ * what they send back into table. The files are cut into shards of
+ * consecutive files, a few per worker so faster workers take on more of
+ * them (see split_shards), and each idle worker is sent the next shard
+ * along with the options collected by main. Once no shard is left unsent,
+ * an idle worker takes a copy of one still running elsewhere instead, and
+ * whichever copy finishes first is used, so a slow or stuck worker does not
+ * hold up the run. A worker that fails or drops the connection is sent no
+ * more work, and its shard goes back to be retried elsewhere, up to
+ * SHARD_ATTEMPTS times. When all shards are in, the messages each worker
+ * printed and its aggregates are merged in file order, so the report and
+ * the "Opening file" lines are the same as those of a local run. Returns 1
+ * on success, or 0 (after printing errors) if some files could not be
+ * analyzed.
+ */
+int run_workers(const char *workers, const char *options, size_t options_len, char *paths[],
+        int num_paths, struct state_table *table) {
+    struct shard_worker *pool = NULL;
+    struct shard *shards;
+    struct pollfd *fds;
+    int *polled;
+    char *list = strdup(workers);
+    char *address;
+    int num_workers = 0;
+    int num_shards;
+    int remaining;
+    int ok = 1;
+    int i;
+    int s;
+
+    if (list == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    for (address = strtok(list, ","); address != NULL; address = strtok(NULL, ",")) {
+        pool = realloc(pool, (size_t) (num_workers + 1) * sizeof(struct shard_worker));
+        if (pool == NULL) {
+            printf("ERROR: Memory could not be allocated\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(&pool[num_workers], 0, sizeof(struct shard_worker));
+        pool[num_workers].address = address;
+        pool[num_workers].fd = -1;
+        ++num_workers;
+    }
+    if (num_workers == 0) {
+        printf("ERROR: --workers takes a comma separated list of host:port pairs\n");
+        free(list);
+        return 0;
+    }
+
+    num_shards = num_paths < SHARDS_PER_WORKER * num_workers ? num_paths
+        : SHARDS_PER_WORKER * num_workers;
+    shards = calloc((size_t) num_shards, sizeof(struct shard));
+    fds = malloc((size_t) num_workers * sizeof(struct pollfd));
+    polled = malloc((size_t) num_workers * sizeof(int));
+    if (shards == NULL || fds == NULL || polled == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    split_shards(paths, num_paths, shards, num_shards);
+
+    remaining = num_shards;
+    while (remaining > 0) {
+        int active = 0;
+
+        for (i = 0; i < num_workers; ++i) {
+            if (pool[i].fd < 0 && !pool[i].dead && (s = next_shard(shards, num_shards)) >= 0) {
+                start_shard(&pool[i], s, &shards[s], options, options_len, paths);
+            }
+            if (pool[i].fd >= 0) {
+                fds[active].fd = pool[i].fd;
+                fds[active].events = POLLIN;
+                polled[active++] = i;
+            }
+        }
+        if (active == 0) {
+            printf("ERROR: no worker is left to send the rest of the files to\n");
+            break;
+        }
+        if (poll(fds, (nfds_t) active, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("ERROR: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int k = 0; k < active; ++k) {
+            struct shard_worker *worker = &pool[polled[k]];
+            struct shard *shard;
+            int result;
+
+            /* The worker may have been stopped as a copy of a shard that just finished. */
+            if (fds[k].revents == 0 || worker->fd != fds[k].fd) {
+                continue;
+            }
+            shard = &shards[worker->shard];
+            result = receive_shard(worker, shard);
+            if (result == 0) {
+                continue;
+            }
+            stop_shard(worker, shard);
+            if (result > 0) {
+                --remaining;
+                for (i = 0; i < num_workers; ++i) {
+                    if (pool[i].fd >= 0 && pool[i].shard == worker->shard) {
+                        stop_shard(&pool[i], shard);
+                    }
+                }
+                continue;
+            }
+            worker->dead = 1;
+            if (!shard->done && ++shard->failures >= SHARD_ATTEMPTS
+                    && shard->running == 0) {
+                printf("ERROR: giving up on %s after %d attempts\n", paths[shard->first],
+                        shard->failures);
+                shard->done = 1;
+                ok = 0;
+                --remaining;
+            }
+        }
+    }
+
+    for (i = 0; i < num_workers; ++i) {
+        if (pool[i].fd >= 0) {
+            stop_shard(&pool[i], &shards[pool[i].shard]);
+        }
+        free(pool[i].buf);
+    }
+    for (s = 0; s < num_shards; ++s) {
+        char name[4200];
+        FILE *file;
+        uint32_t count;
+
+        if (shards[s].partial == NULL) {
+            ok = 0;
+            free(shards[s].log);
+            continue;
+        }
+        fwrite(shards[s].log, 1, shards[s].log_len, stdout);
+        snprintf(name, sizeof(name), "the result for %s", paths[shards[s].first]);
+        file = fmemopen(shards[s].partial, shards[s].partial_len, "rb");
+        if (file == NULL || !read_partial_header(file, name, &count)
+                || !read_partial_states(file, name, count, table)) {
+            ok = 0;
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        free(shards[s].log);
+        free(shards[s].partial);
+    }
+    free(polled);
+    free(fds);
+    free(shards);
+    free(pool);
+    free(list);
+    return ok;
+}
+
+/**
+ * split_shards cuts the num_paths files into num_shards runs of
+ * consecutive files of about the same total size, going by what stat says
+ * here; files the coordinator cannot see count as one byte each.
+ */
+void split_shards(char *paths[], int num_paths, struct shard *shards, int num_shards) {
+    off_t *sizes = malloc((size_t) num_paths * sizeof(off_t));
+    off_t total = 0;
+    int next = 0;
+    int i;
+
+    if (sizes == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < num_paths; ++i) {
+        struct stat st;
+
+        sizes[i] = stat(paths[i], &st) == 0 && st.st_size > 0 ? st.st_size : 1;
+        total += sizes[i];
+    }
+    for (i = 0; i < num_shards; ++i) {
+        off_t want = total / (num_shards - i);
+        off_t got = 0;
+
+        shards[i].first = next;
+        do {
+            got += sizes[next++];
+        } while (num_paths - next > num_shards - i - 1 && got + sizes[next] / 2 <= want);
+        shards[i].count = next - shards[i].first;
+        total -= got;
+    }
+    free(sizes);
+}
+
+/**
+ * next_shard picks the shard for an idle worker: the first one not yet
+ * sent anywhere or, once there are none, a copy of the first one still
+ * running on just one worker. Returns -1 if there is nothing to do.
+ */
+int next_shard(const struct shard *shards, int num_shards) {
+    int s;
+
+    for (s = 0; s < num_shards; ++s) {
+        if (!shards[s].done && shards[s].running == 0) {
+            return s;
+        }
+    }
+    for (s = 0; s < num_shards; ++s) {
+        if (!shards[s].done && shards[s].running == 1) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+/**
+ * start_shard connects to worker and sends it shard number s: a
+ * SHARD_RUN frame holding the options and then, after an empty string,
+ * the file names, all NUL terminated. A worker that cannot be connected
+ * to is marked dead.
+ */
+void start_shard(struct shard_worker *worker, int s, struct shard *shard, const char *options,
+        size_t options_len, char *paths[]) {
+    char *request = NULL;
+    size_t len = 0;
+    int fd = open_tcp(worker->address, 0);
+    int i;
+
+    if (fd < 0) {
+        worker->dead = 1;
+        return;
+    }
+    append_text(&request, &len, options, options_len);
+    append_text(&request, &len, "", 1);
+    for (i = shard->first; i < shard->first + shard->count; ++i) {
+        append_text(&request, &len, paths[i], strlen(paths[i]) + 1);
+    }
+    if (!send_frame(fd, SHARD_RUN, request, len)) {
+        printf("ERROR: could not send work to %s: %s\n", worker->address, strerror(errno));
+        close(fd);
+        worker->dead = 1;
+    } else {
+        worker->fd = fd;
+        worker->shard = s;
+        worker->len = 0;
+        ++shard->running;
+    }
+    free(request);
+}
+
+/**
+ * receive_shard reads what worker has sent so far. The reply is a
+ * SHARD_LOG frame with the messages the worker printed, then either a
+ * SHARD_PARTIAL frame with the aggregates in the --save-partial format or
+ * a SHARD_FAILED frame saying what went wrong. Returns 0 while the reply
+ * is incomplete, 1 once the aggregates are in (kept in shard unless
+ * another copy got there first), or -1 if the attempt failed.
+ */
+int receive_shard(struct shard_worker *worker, struct shard *shard) {
+    char chunk[65536];
+    ssize_t got = read(worker->fd, chunk, sizeof(chunk));
+    const char *log = NULL;
+    size_t log_len = 0;
+    size_t at = 0;
+
+    if (got < 0 && errno == EINTR) {
+        return 0;
+    }
+    if (got <= 0) {
+        printf("ERROR: %s dropped the connection\n", worker->address);
+        return -1;
+    }
+    append_text(&worker->buf, &worker->len, chunk, (size_t) got);
+
+    while (worker->len - at >= SHARD_FRAME_HEADER) {
+        const unsigned char *header = (const unsigned char *) worker->buf + at;
+        uint32_t type = get_u32(header);
+        size_t len = get_u32(header + 4);
+        const char *data = worker->buf + at + SHARD_FRAME_HEADER;
+
+        if (len > SHARD_FRAME_MAX) {
+            printf("ERROR: %s sent a malformed reply\n", worker->address);
+            return -1;
+        }
+        if (worker->len - at - SHARD_FRAME_HEADER < len) {
+            break;
+        }
+        at += SHARD_FRAME_HEADER + len;
+        if (type == SHARD_LOG) {
+            log = data;
+            log_len = len;
+        } else if (type == SHARD_PARTIAL) {
+            if (!shard->done) {
+                append_text(&shard->log, &shard->log_len, log, log_len);
+                append_text(&shard->partial, &shard->partial_len, data, len);
+                shard->done = 1;
+            }
+            return 1;
+        } else {
+            printf("ERROR: %s could not analyze its files: %.*s\n", worker->address,
+                    (int) len, type == SHARD_FAILED ? data : "malformed reply");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * stop_shard closes worker's connection, leaving it idle. A worker still
+ * running a copy of a finished shard sees the connection close and stops.
+ */
+void stop_shard(struct shard_worker *worker, struct shard *shard) {
+    close(worker->fd);
+    worker->fd = -1;
+    worker->len = 0;
+    --shard->running;
+}
+
+/**
+ * serve_shards is the worker side of --workers: it listens on address
+ * ([host:]port) and serves each connection in a process of its own (see
+ * serve_shard), so a run that crashes takes nothing else with it. There
+ * is no authentication, so it should only listen where the hosts that
+ * can reach it are trusted to read any file this user can. Finished
+ * connection processes are reaped by the kernel (SA_NOCLDWAIT), so none
+ * is left a zombie while it waits for the next connection. Runs until it
+ * is killed, or returns EXIT_FAILURE if it cannot listen.
+ */
+int serve_shards(const char *address, const char *self) {
+    struct sigaction reap;
+    int fd = open_tcp(address, 1);
+
+    if (fd < 0) {
+        return EXIT_FAILURE;
+    }
+    memset(&reap, 0, sizeof(reap));
+    reap.sa_handler = SIG_DFL;
+    reap.sa_flags = SA_NOCLDWAIT;
+    sigemptyset(&reap.sa_mask);
+    sigaction(SIGCHLD, &reap, NULL);
+    printf("Serving shards on %s\n", address);
+    fflush(stdout);
+
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        pid_t child;
+
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            printf("ERROR: accept failed: %s\n", strerror(errno));
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+        child = fork();
+        if (child == 0) {
+            /* run_shard waits for its own child, so that one is not reaped. */
+            reap.sa_flags = 0;
+            sigaction(SIGCHLD, &reap, NULL);
+            close(fd);
+            serve_shard(client, self);
+            _exit(0);
+        }
+        close(client);
+    }
+}
+
+/**
+ * serve_shard reads one SHARD_RUN request from client (see start_shard),
+ * checks that it holds only options shard_option_arity passes on and then
+ * file names, runs it with run_shard, and sends back the reply
+ * receive_shard expects.
+ */
+void serve_shard(int client, const char *self) {
+    struct timeval timeout = { 30, 0 };
+    unsigned char header[SHARD_FRAME_HEADER];
+    char *request = NULL;
+    char *log = NULL;
+    char *partial = NULL;
+    size_t log_len = 0;
+    size_t partial_len = 0;
+    size_t len;
+    char **args = NULL;
+    const char *error = NULL;
+    char *p;
+    char *end;
+    int num_args = 0;
+    int num_files = 0;
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (recv(client, header, sizeof(header), MSG_WAITALL) != (ssize_t) sizeof(header)
+            || get_u32(header) != SHARD_RUN || (len = get_u32(header + 4)) == 0
+            || len > SHARD_FRAME_MAX) {
+        send_frame(client, SHARD_FAILED, "bad request", 11);
+        close(client);
+        return;
+    }
+    request = malloc(len);
+    args = malloc((len + 6) * sizeof(char *));
+    if (request == NULL || args == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    if (recv(client, request, len, MSG_WAITALL) != (ssize_t) len || request[len - 1] != '\0') {
+        error = "bad request";
+    }
+
+    /* After the options comes an empty string, then the files. */
+    args[num_args++] = (char *) self;
+    p = request;
+    end = request + len;
+    while (error == NULL && p < end && *p != '\0') {
+        int arity = shard_option_arity(p);
+
+        if (arity < 0) {
+            error = "option not allowed";
+            break;
+        }
+        args[num_args++] = p;
+        p += strlen(p) + 1;
+        if (arity > 0) {
+            if (p >= end) {
+                error = "bad request";
+                break;
+            }
+            args[num_args++] = p;
+            p += strlen(p) + 1;
+        }
+    }
+    if (error == NULL && p >= end) {
+        error = "bad request";
+    }
+    args[num_args++] = "--format";
+    args[num_args++] = "bin";
+    args[num_args++] = "--save-partial";
+    args[num_args++] = "/dev/fd/3";
+    for (++p; error == NULL && p < end; p += strlen(p) + 1, ++num_files) {
+        if (*p == '-' || *p == '\0') {
+            error = "bad file name";
+        }
+        args[num_args++] = p;
+    }
+    args[num_args] = NULL;
+    if (error == NULL && num_files == 0) {
+        error = "no files";
+    }
+
+    if (error == NULL && !run_shard(client, self, args, &log, &log_len, &partial, &partial_len)) {
+        error = "the run failed";
+    }
+    if (send_frame(client, SHARD_LOG, log, log_len)) {
+        if (error == NULL) {
+            send_frame(client, SHARD_PARTIAL, partial, partial_len);
+        } else {
+            send_frame(client, SHARD_FAILED, error, strlen(error));
+        }
+    }
+    close(client);
+    free(partial);
+    free(log);
+    free(args);
+    free(request);
+}
+
+/**
+ * run_shard runs this program again with args, an ordinary analysis that
+ * writes its aggregates with --save-partial to fd 3 and (thanks to
+ * --format bin) its messages to stderr, and collects both from pipes
+ * into log and partial. If client hangs up meanwhile (another worker was
+ * quicker) the run is killed. Returns 1 if it finished cleanly.
+ */
+int run_shard(int client, const char *self, char *args[], char **log, size_t *log_len,
+        char **partial, size_t *partial_len) {
+    int log_pipe[2];
+    int partial_pipe[2];
+    struct pollfd fds[3];
+    char chunk[65536];
+    int hung_up = 0;
+    int status;
+    pid_t child;
+
+    if (open_pipe(log_pipe) != 0) {
+        return 0;
+    }
+    if (open_pipe(partial_pipe) != 0) {
+        close(log_pipe[0]);
+        close(log_pipe[1]);
+        return 0;
+    }
+    child = fork();
+    if (child == 0) {
+        int null = open("/dev/null", O_RDWR);
+
+        /* The report itself goes to /dev/null; dup2 onto itself keeps close-on-exec. */
+        if (null < 0 || dup2(null, STDIN_FILENO) < 0 || dup2(null, STDOUT_FILENO) < 0
+                || dup2(log_pipe[1], STDERR_FILENO) < 0
+                || (partial_pipe[1] == 3 ? fcntl(3, F_SETFD, 0) : dup2(partial_pipe[1], 3)) < 0) {
+            _exit(127);
+        }
+        execv("/proc/self/exe", args);
+        execvp(self, args);
+        _exit(127);
+    }
+    close(log_pipe[1]);
+    close(partial_pipe[1]);
+    if (child < 0) {
+        close(log_pipe[0]);
+        close(partial_pipe[0]);
+        return 0;
+    }
+
+    fds[0].fd = log_pipe[0];
+    fds[1].fd = partial_pipe[0];
+    fds[2].fd = client;
+    for (int k = 0; k < 3; ++k) {
+        fds[k].events = POLLIN;
+    }
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[2].revents != 0) {
+            hung_up = 1;
+            kill(child, SIGTERM);
+            break;
+        }
+        for (int k = 0; k < 2; ++k) {
+            ssize_t got;
+
+            if (fds[k].fd < 0 || fds[k].revents == 0) {
+                continue;
+            }
+            got = read(fds[k].fd, chunk, sizeof(chunk));
+            if (got > 0) {
+                append_text(k == 0 ? log : partial, k == 0 ? log_len : partial_len, chunk,
+                        (size_t) got);
+            } else if (got == 0 || errno != EINTR) {
+                close(fds[k].fd);
+                fds[k].fd = -1;
+            }
+        }
+    }
+    for (int k = 0; k < 2; ++k) {
+        if (fds[k].fd >= 0) {
+            close(fds[k].fd);
+        }
+    }
+    if (waitpid(child, &status, 0) != child) {
+        return 0;
+    }
+    return !hung_up && WIFEXITED(status) && WEXITSTATUS(status) == 0 && *partial_len > 0;
+}
+
+/**
+ * open_tcp listens on (if listening is set) or connects to address, a
+ * [host:]port; with no host it listens on every interface, or connects
+ * to this host. Connecting gives up after SO_SNDTIMEO's 5 seconds.
+ * Returns the socket, or -1 after printing an error.
+ */
+int open_tcp(const char *address, int listening) {
+    const char *colon = strrchr(address, ':');
+    const char *port = colon != NULL ? colon + 1 : address;
+    size_t host_len = colon != NULL ? (size_t) (colon - address) : 0;
+    struct addrinfo hints;
+    struct addrinfo *found;
+    struct addrinfo *ai;
+    char host[256];
+    int fd = -1;
+    int err;
+
+    if (host_len >= sizeof(host)) {
+        printf("ERROR: host name in %s is too long\n", address);
+        return -1;
+    }
+    /* An IPv6 address is written in brackets, as in [::1]:7070. */
+    if (host_len >= 2 && address[0] == '[' && address[host_len - 1] == ']') {
+        memcpy(host, address + 1, host_len - 2);
+        host[host_len - 2] = '\0';
+    } else {
+        memcpy(host, address, host_len);
+        host[host_len] = '\0';
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    err = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &found);
+    if (err != 0) {
+        printf("ERROR: %s could not be resolved: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+
+    err = 0;
+    for (ai = found; ai != NULL && fd < 0; ai = ai->ai_next) {
+        struct timeval timeout = { 5, 0 };
+        int on = 1;
+
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+                break;
+            }
+        } else {
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+        }
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    if (fd < 0) {
+        printf("ERROR: could not %s %s: %s\n", listening ? "listen on" : "connect to", address,
+                strerror(err));
+    }
+    return fd;
+}
+
+/**
+ * send_frame writes one frame of the --workers protocol to fd: its type
+ * and length as u32s (see SHARD_FRAME_HEADER), then len bytes of data.
+ * Returns 1 on success.
+ */
+int send_frame(int fd, uint32_t type, const char *data, size_t len) {
+    unsigned char header[SHARD_FRAME_HEADER];
+    const char *parts[2] = { (const char *) header, data };
+    size_t sizes[2] = { sizeof(header), len };
+
+    put_u32(header, type);
+    put_u32(header + 4, (uint32_t) len);
+    for (int k = 0; k < 2; ++k) {
+        size_t sent = 0;
+
+        while (sent < sizes[k]) {
+            ssize_t n = send(fd, parts[k] + sent, sizes[k] - sent, MSG_NOSIGNAL);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return 0;
+            }
+            sent += (size_t) n;
+        }
+    }
+    return 1;
+}
+
+/**
+ * run_query answers the query in text (see parse_query) from the columnar
+ * cache files in paths, and prints one tab separated line per group
+ * (see print_query). filter holds --from, --to and --states, which the
+ * query's own time and state conditions narrow further. Returns 0, or
+ * EXIT_FAILURE if the query does not parse.
+ */
+int run_query(const char *text, const struct record_filter *filter, char *paths[],
+        int num_paths) {
+    struct query query;
+    struct query_table groups = { 0 };
+    uint32_t *sel = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(uint32_t));
+    uint32_t *slots = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(uint32_t));
+    double *values = malloc(COLUMNAR_BLOCK_RECORDS * sizeof(double));
+    int i;
+
+    if (sel == NULL || slots == NULL || values == NULL) {
+        printf("ERROR: Memory could not be allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(&query, 0, sizeof(query));
+    query.filter.from = filter != NULL ? filter->from : LONG_MIN;
+    query.filter.to = filter != NULL ? filter->to : LONG_MAX;
+    if (filter != NULL && filter->num_codes > 0) {
+        for (i = 0; i < filter->num_codes; ++i) {
+            char code[3];
+
+            memcpy(code, filter->codes[i], sizeof(code));
+            parse_state_list(code, &query.filter);
+        }
+    }
+    if (!parse_query(text, &query)) {
+        free(query.filter.codes);
+        free(values);
+        free(slots);
+        free(sel);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < num_paths; ++i) {
+        FILE *file = fopen(paths[i], "rb");
+        size_t len;
+        void *data;
+
+        if (file == NULL) {
+            printf("ERROR: %s does not exist\n", paths[i]);
+            continue;
+        }
+        if (!is_columnar(file)) {
+            printf("ERROR: %s is not a columnar file (write one with --convert)\n", paths[i]);
+            fclose(file);
+            continue;
+        }
+        data = map_file(file, &len);
+        if (data == NULL) {
+            printf("ERROR: columnar file could not be mapped\n");
+        } else {
+            printf("Opening file: %s\n", paths[i]);
+            if (columnar_header_ok(data, len)) {
+                query_columnar(&query, data, &groups, sel, slots, values);
+            } else {
+                printf("ERROR: unsupported columnar file (wrong version, byte order or"
+                        " truncated)\n");
+            }
+            munmap(data, len);
+        }
+        fclose(file);
+    }
+
+    print_query(&query, &groups);
+    free(groups.groups);
+    free(groups.hash);
+    free(query.filter.codes);
+    free(values);
+    free(slots);
+    free(sel);
+    return 0;
+}
+
+/**
+ * parse_query reads a query of the form
+ *
+ *   avg(temperature), max(humidity) group by state, month where snow = 1
+ *
+ * into query: one or more aggregates (count, or sum, avg, min or max of a
+ * column), then optionally "group by" with state and/or one of hour, day
+ * or month, and "where" with conditions joined by "and". A condition
+ * compares a column with a number (=, !=, <, <=, > or >=), time with a
+ * time as --from takes it, or is state = XX or state in (XX, YY). The
+ * columns are temperature, humidity, cloud_cover, pressure, snow and
+ * lightning. Keywords are not case sensitive. Time and state conditions
+ * go into query's record_filter, narrowing what it already keeps (see
+ * intersect_states). Returns 1, or 0 after printing an error.
+ */
+int parse_query(const char *text, struct query *query) {
+    static const char *const funcs[] = { "count", "sum", "avg", "min", "max" };
+    char words[QUERY_MAX_WORDS][QUERY_MAX_WORD];
+    int num_words = 0;
+    int t = 0;
+    int c;
+
+    while (*text != '\0') {
+        size_t n;
+
+        if (*text == ' ' || *text == '\t' || *text == '\n') {
+            ++text;
+            continue;
+        }
+        if (strchr("(),*", *text) != NULL) {
+            n = 1;
+        } else if (strchr("=!<>", *text) != NULL) {
+            n = text[1] == '=' ? 2 : 1;
+        } else {
+            n = strcspn(text, " \t\n(),*=!<>");
+        }
+        if (num_words == QUERY_MAX_WORDS || n >= QUERY_MAX_WORD) {
+            printf("ERROR: query is too long\n");
+            return 0;
+        }
+        memcpy(words[num_words], text, n);
+        words[num_words++][n] = '\0';
+        text += n;
+    }
+
+    do {
+        struct query_agg *agg = &query->aggs[query->num_aggs];
+        int func;
+
+        for (func = 0; t < num_words && func <= QUERY_MAX; ++func) {
+            if (strcasecmp(words[t], funcs[func]) == 0) {
+                break;
+            }
+        }
+        if (t >= num_words || func > QUERY_MAX) {
+            printf("ERROR: query needs an aggregate such as count or avg(temperature)"
+                    " where it has %s\n", t < num_words ? words[t] : "nothing");
+            return 0;
+        }
+        if (query->num_aggs == QUERY_MAX_TERMS) {
+            printf("ERROR: query has more than %d aggregates\n", QUERY_MAX_TERMS);
+            return 0;
+        }
+        agg->func = (enum query_func) func;
+        agg->column = -1;
+        ++t;
+        if (t < num_words && strcmp(words[t], "(") == 0) {
+            ++t;
+            if (t < num_words && strcmp(words[t], ")") != 0) {
+                if (func != QUERY_COUNT || strcmp(words[t], "*") != 0) {
+                    agg->column = find_query_column(words[t]);
+                    if (agg->column < 0) {
+                        printf("ERROR: unknown column %s\n", words[t]);
+                        return 0;
+                    }
+                }
+                ++t;
+            }
+            if (t >= num_words || strcmp(words[t], ")") != 0) {
+                printf("ERROR: missing ) after %s(\n", funcs[func]);
+                return 0;
+            }
+            ++t;
+        }
+        if (func == QUERY_COUNT) {
+            agg->column = -1;
+        } else if (agg->column < 0) {
+            printf("ERROR: %s needs a column, as in %s(temperature)\n", funcs[func], funcs[func]);
+            return 0;
+        } else {
+            query->used[agg->column] = 1;
+        }
+        ++query->num_aggs;
+    } while (t < num_words && strcmp(words[t], ",") == 0 && ++t);
+
+    while (t < num_words) {
+        if (strcasecmp(words[t], "group") == 0 && t + 1 < num_words
+                && strcasecmp(words[t + 1], "by") == 0) {
+            static const char *const kinds[] = { "", "hour", "day", "month" };
+
+            t += 2;
+            do {
+                int kind;
+
+                for (kind = BUCKET_HOUR; t < num_words && kind <= BUCKET_MONTH; ++kind) {
+                    if (strcasecmp(words[t], kinds[kind]) == 0) {
+                        break;
+                    }
+                }
+                if (t < num_words && strcasecmp(words[t], "state") == 0) {
+                    query->by_state = 1;
+                } else if (t < num_words && kind <= BUCKET_MONTH
+                        && query->bucket == BUCKET_NONE) {
+                    query->bucket = (enum bucket_kind) kind;
+                } else {
+                    printf("ERROR: query can group by state and one of hour, day or month,"
+                            " not %s\n", t < num_words ? words[t] : "nothing");
+                    return 0;
+                }
+                ++t;
+            } while (t < num_words && strcmp(words[t], ",") == 0 && ++t);
+        } else if (strcasecmp(words[t], "where") == 0) {
+            ++t;
+            do {
+                if (t >= num_words) {
+                    printf("ERROR: query ends without a condition after %s\n", words[t - 1]);
+                    return 0;
+                }
+                if (!parse_query_cond(words, num_words, &t, query)) {
+                    return 0;
+                }
+            } while (t < num_words && strcasecmp(words[t], "and") == 0 && ++t);
+        } else {
+            printf("ERROR: unexpected %s in query\n", words[t]);
+            return 0;
+        }
+    }
+
+    /* The batch kernels give count, sums and the temperature max and min. */
+    query->batched = !query->used[QUERY_PRESSURE];
+    for (c = 0; c < query->num_aggs; ++c) {
+        if ((query->aggs[c].func == QUERY_MIN || query->aggs[c].func == QUERY_MAX)
+                && query->aggs[c].column != QUERY_TEMPERATURE) {
+            query->batched = 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * parse_query_cond reads the condition at words[*t] into query, moving *t
+ * past it. Returns 1, or 0 after printing an error.
+ */
+int parse_query_cond(char words[][QUERY_MAX_WORD], int num_words, int *t, struct query *query) {
+    static const char *const ops[] = { "=", "!=", "<", "<=", ">", ">=" };
+    const char *name;
+    int op;
+
+    if (*t + 2 >= num_words) {
+        printf("ERROR: incomplete condition at %s\n", *t < num_words ? words[*t] : "end");
+        return 0;
+    }
+    name = words[*t];
+    for (op = 0; op <= QUERY_GE && strcmp(words[*t + 1], ops[op]) != 0; ++op) {
+    }
+
+    if (strcasecmp(name, "state") == 0) {
+        struct record_filter picked = { 0, 0, 0, NULL };
+        int ok = 0;
+
+        if (op == QUERY_EQ) {
+            parse_state_list(words[*t + 2], &picked);
+            *t += 3;
+            ok = 1;
+        } else if (strcasecmp(words[*t + 1], "in") == 0 && strcmp(words[*t + 2], "(") == 0) {
+            for (*t += 3; *t < num_words && strcmp(words[*t], ")") != 0; ++*t) {
+                if (strcmp(words[*t], ",") != 0) {
+                    parse_state_list(words[*t], &picked);
+                }
+            }
+            if (*t < num_words && picked.num_codes > 0) {
+                ++*t;
+                ok = 1;
+            }
+        }
+        if (!ok) {
+            printf("ERROR: state conditions are state = XX or state in (XX, YY, ...)\n");
+            free(picked.codes);
+            return 0;
+        }
+        intersect_states(&query->filter, &picked);
+        return 1;
+    }
+
+    if (op > QUERY_GE) {
+        printf("ERROR: unknown comparison %s\n", words[*t + 1]);
+        return 0;
+    }
+    if (strcasecmp(name, "time") == 0) {
+        struct record_filter *filter = &query->filter;
+        long at;
+
+        if (!parse_time_arg(words[*t + 2], &at) || op == QUERY_NE) {
+            printf("ERROR: time conditions compare with =, <, <=, > or >= to"
+                    " YYYY-MM-DD[THH:MM[:SS]] or Unix seconds\n");
+            return 0;
+        }
+        if ((op == QUERY_GT || op == QUERY_EQ || op == QUERY_GE)
+                && at + (op == QUERY_GT) > filter->from) {
+            filter->from = at + (op == QUERY_GT);
+        }
+        if ((op == QUERY_LT || op == QUERY_EQ || op == QUERY_LE)
+                && at + (op != QUERY_LT) < filter->to) {
+            filter->to = at + (op != QUERY_LT);
+        }
+    } else {
+        struct query_cond *cond = &query->conds[query->num_conds];
+        char *end;
+
+        if (query->num_conds == QUERY_MAX_TERMS) {
+            printf("ERROR: query has more than %d conditions\n", QUERY_MAX_TERMS);
+            return 0;
+        }
+        cond->column = find_query_column(name);
+        if (cond->column < 0) {
+            printf("ERROR: unknown column %s\n", name);
+            return 0;
+        }
+        cond->op = (enum query_op) op;
+        cond->value = strtod(words[*t + 2], &end);
+        if (*end != '\0' || end == words[*t + 2]) {
+            printf("ERROR: %s is not a number\n", words[*t + 2]);
+            return 0;
+        }
+        ++query->num_conds;
+    }
+    *t += 3;
+    return 1;
+}
+
+/**
+ * intersect_states narrows the states filter keeps to those also in
+ * picked, and frees picked. A filter without states takes picked as is.
+ * If no state is left, the filter's time range is emptied instead, as
+ * num_codes of 0 would mean every state.
+ */
+void intersect_states(struct record_filter *filter, struct record_filter *picked) {
+    int kept = 0;
+    int i;
+
+    if (filter->num_codes == 0) {
+        filter->codes = picked->codes;
+        filter->num_codes = picked->num_codes;
+        return;
+    }
+    for (i = 0; i < filter->num_codes; ++i) {
+        if (filter_code(picked, filter->codes[i])) {
+            memcpy(filter->codes[kept++], filter->codes[i], sizeof(filter->codes[i]));
+        }
+    }
+    filter->num_codes = kept;
+    if (kept == 0) {
+        filter->from = LONG_MAX;
+        filter->to = LONG_MIN;
+    }
+    free(picked->codes);
+}
+
+/**
+ * find_query_column looks up a column by the name queries use for it, or
+ * returns -1.
+ */
+int find_query_column(const char *name) {
+    static const char *const names[] = { "temperature", "humidity", "cloud_cover", "pressure",
+        "snow", "lightning" };
+    int column;
+
+    for (column = 0; column < NUM_QUERY_COLUMNS; ++column) {
+        if (strcasecmp(name, names[column]) == 0) {
+            return column;
+        }
+    }
+    return -1;
+}
+
+/**
+ * query_columnar runs query over a mapped columnar file, adding to groups.
+ * The block index is read first: blocks outside the time range, holding
+ * none of the states asked for, or whose temperature or humidity range
+ * rules out a condition on them are skipped without touching their pages,
+ * and conditions that the range shows hold for every record of a block are
+ * dropped for it. A block with no conditions left and a single time bucket,
+ * whose runs of records of one state are long enough, goes through the
+ * batch kernels a run at a time (see query_batches). Otherwise it is
+ * processed a column at a time: a selection vector (sel) of the records
+ * meeting the time and state conditions is narrowed by each remaining
+ * condition in turn (see select_matching), each record left gets its group
+ * in slots, and then each column is aggregated over the selection. The
+ * scratch arrays hold COLUMNAR_BLOCK_RECORDS entries.
+ */
+void query_columnar(const struct query *query, const char *data, struct query_table *groups,
+        uint32_t *sel, uint32_t *slots, double *values) {
+    const unsigned char *head = (const unsigned char *) data;
+    uint32_t num_codes = get_u32(head + 28);
+    uint32_t num_blocks = get_u32(head + 24);
+    uint64_t index_offset = get_u64(head + COLUMNAR_INDEX_OFFSET);
+    const unsigned char *index = head + index_offset;
+    const struct record_filter *filter = &query->filter;
+    unsigned char wanted[32] = { 0 };
+    uint32_t id;
+
+    for (id = 0; id < num_codes && id < COLUMNAR_MAX_CODES; ++id) {
+        char key[3] = { (char) head[32 + 2 * id], (char) head[33 + 2 * id], '\0' };
+
+        if (filter_code(filter, key)) {
+            wanted[id / 8] |= (unsigned char) (1u << (id % 8));
+        }
+    }
+
+    for (uint32_t b = 0; b < num_blocks; ++b) {
+        const unsigned char *entry = index + (size_t) b * COLUMNAR_INDEX_ENTRY_SIZE;
+        uint64_t offset = get_u64(entry);
+        uint32_t n = get_u32(entry + 8);
+        int64_t min_timestamp = (int64_t) get_u64(entry + 16);
+        int64_t max_timestamp = (int64_t) get_u64(entry + 24);
+        float temperatures[2];
+        int checks[QUERY_MAX_TERMS];
+        int num_checks = 0;
+        struct column_block cols;
+        uint32_t count = 0;
+        int straddles;
+        int any = 0;
+        int c;
+
+        if (n > COLUMNAR_BLOCK_RECORDS || offset < COLUMNAR_HEADER_SIZE
+                || offset + columnar_block_size(n) > index_offset) {
+            printf("ERROR: columnar file is truncated\n");
+            return;
+        }
+        for (int k = 0; !any && k < 32; ++k) {
+            any = (entry[56 + k] & wanted[k]) != 0;
+        }
+        if (!any || max_timestamp < filter->from || min_timestamp >= filter->to) {
+            continue;
+        }
+        memcpy(temperatures, entry + 32, sizeof(temperatures));
+        for (c = 0; c < query->num_conds; ++c) {
+            const struct query_cond *cond = &query->conds[c];
+            double lo = cond->column == QUERY_TEMPERATURE ? temperatures[0] : get_f64(entry + 40);
+            double hi = cond->column == QUERY_TEMPERATURE ? temperatures[1] : get_f64(entry + 48);
+
+            if (cond->column != QUERY_TEMPERATURE && cond->column != QUERY_HUMIDITY) {
+                checks[num_checks++] = c;
+            } else if (!range_may_match(cond, lo, hi)) {
+                break;
+            } else if (!range_always_matches(cond, lo, hi)) {
+                checks[num_checks++] = c;
+            }
+        }
+        if (c < query->num_conds) {
+            continue;
+        }
+        straddles = min_timestamp < filter->from || max_timestamp >= filter->to;
+        block_columns(data + offset, n, &cols);
+
+        if (query->batched && num_checks == 0 && !straddles && (query->bucket == BUCKET_NONE
+                    || bucket_of(min_timestamp, query->bucket)
+                            == bucket_of(max_timestamp, query->bucket))) {
+            uint32_t runs = 1;
+
+            /* Short runs cost more in kernel calls than the column loops do. */
+            for (uint32_t i = 1; query->by_state && i < n; ++i) {
+                runs += cols.code[i] != cols.code[i - 1];
+            }
+            if (n / runs >= QUERY_MIN_RUN) {
+                query_batches(query, head, &cols, wanted, groups);
+                continue;
+            }
+        }
+
+        for (uint32_t i = 0; i < n; ++i) {
+            uint8_t code = cols.code[i];
+
+            sel[count] = i;
+            count += code < num_codes && ((wanted[code / 8] >> (code % 8)) & 1)
+                    && (!straddles || (cols.timestamp[i] >= filter->from
+                                && cols.timestamp[i] < filter->to));
+        }
+        for (c = 0; c < num_checks && count > 0; ++c) {
+            const struct query_cond *cond = &query->conds[checks[c]];
+
+            count = select_matching(column_values(&cols, cond->column, values), cond->op,
+                    cond->value, sel, count);
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        for (uint32_t k = 0, last = UINT32_MAX; k < count; ++k) {
+            uint32_t i = sel[k];
+            long bucket = query->bucket != BUCKET_NONE ? bucket_of(cols.timestamp[i],
+                    query->bucket) : 0;
+            uint32_t key = query->by_state ? cols.code[i] : 0;
+
+            /* Neighbouring records often share a group, so the last one is tried first. */
+            if (last == UINT32_MAX || groups->groups[slots[last]].bucket != bucket
+                    || (query->by_state && cols.code[sel[last]] != key)) {
+                slots[k] = query_group(groups, query->by_state ? (const char *) head + 32 + 2 * key
+                        : "", bucket);
+                last = k;
+            } else {
+                slots[k] = slots[last];
+            }
+        }
+        for (uint32_t k = 0; k < count; ++k) {
+            groups->groups[slots[k]].count++;
+        }
+        for (c = 0; c < NUM_QUERY_COLUMNS; ++c) {
+            const double *column;
+
+            if (!query->used[c]) {
+                continue;
+            }
+            column = column_values(&cols, c, values);
+            for (uint32_t k = 0; k < count; ++k) {
+                add_metric(&groups->groups[slots[k]].columns[c], column[sel[k]]);
+            }
+        }
+    }
+}
+
+/**
+ * query_batches aggregates a whole block that no condition needs to look
+ * into, whose records all fall in one time bucket: each run of records of
+ * a wanted state goes through batch_kernel, and its batch_stats are
+ * folded into the run's group.
+ */
+void query_batches(const struct query *query, const unsigned char *head,
+        const struct column_block *cols, const unsigned char *wanted, struct query_table *groups) {
+    long bucket = query->bucket != BUCKET_NONE ? bucket_of(cols->timestamp[0], query->bucket) : 0;
+
+    for (uint32_t i = 0, run_end; i < cols->count; i = run_end) {
+        uint8_t id = cols->code[i];
+        struct query_group *group;
+        struct column_run run;
+        struct batch_stats stats;
+        uint32_t slot;
+
+        if (!((wanted[id / 8] >> (id % 8)) & 1)) {
+            run_end = i + 1;
+            continue;
+        }
+        /* Without grouping by state a run goes on over every wanted state. */
+        for (run_end = i + 1; run_end < cols->count; ++run_end) {
+            uint8_t next = cols->code[run_end];
+
+            if (query->by_state ? next != id : !((wanted[next / 8] >> (next % 8)) & 1)) {
+                break;
+            }
+        }
+        slot = query_group(groups, query->by_state ? (const char *) head + 32 + 2 * id : "",
+                bucket);
+        group = &groups->groups[slot];
+        run.temperature = cols->temperature + i;
+        run.humidity = cols->humidity + i;
+        run.cloud_cover = cols->cloud_cover + i;
+        run.snow = cols->snow + i;
+        run.lightning = cols->lightning + i;
+        run.count = run_end - i;
+        run_batch_kernel(&run, &stats);
+
+        /* Only the temperature has a max and min here; parse_query checks
+         * that no other one is asked for. */
+        group->count += stats.num_records;
+        fold_accum(&group->columns[QUERY_TEMPERATURE], stats.num_records, stats.sum_temperature,
+                stats.min_temperature, stats.max_temperature);
+        fold_accum(&group->columns[QUERY_HUMIDITY], stats.num_records, stats.sum_humidity, 0, 0);
+        fold_accum(&group->columns[QUERY_CLOUD_COVER], stats.num_records, stats.sum_cloud_cover,
+                0, 0);
+        fold_accum(&group->columns[QUERY_SNOW], stats.num_records, (double) stats.snow_records,
+                0, 0);
+        fold_accum(&group->columns[QUERY_LIGHTNING], stats.num_records,
+                (double) stats.lightning_strikes, 0, 0);
+    }
+}
+
+/**
+ * fold_accum adds count values with the given sum, min and max to accum.
+ */
+void fold_accum(struct metric_accum *accum, unsigned long count, double sum, double min,
+        double max) {
+    if (accum->count == 0 || min < accum->min) {
+        accum->min = min;
+    }
+    if (accum->count == 0 || max > accum->max) {
+        accum->max = max;
+    }
+    accum->count += count;
+    add_compensated(&accum->sum, sum);
+}
+
+/**
+ * block_columns points cols at the columns of the block of n records at
+ * block (see columnar_flush for the layout).
+ */
+void block_columns(const char *block, uint32_t n, struct column_block *cols) {
+    size_t pad4 = (4 * (size_t) n + 7) & ~(size_t) 7;
+
+    cols->count = n;
+    cols->timestamp = (const int64_t *) (block + COLUMNAR_BLOCK_HEADER_SIZE);
+    cols->humidity = (const double *) (cols->timestamp + 2 * (size_t) n);
+    cols->cloud_cover = cols->humidity + n;
+    cols->pressure = cols->cloud_cover + n;
+    cols->temperature = (const float *) (cols->pressure + n);
+    cols->snow = (const int32_t *) ((const char *) cols->temperature + pad4);
+    cols->lightning = (const int32_t *) ((const char *) cols->snow + pad4);
+    cols->code = (const uint8_t *) ((const char *) cols->lightning + pad4);
+}
+
+/**
+ * column_values gives a column of a block as doubles: the double columns
+ * as they are, and the others converted into scratch.
+ */
+const double *column_values(const struct column_block *cols, int column, double *scratch) {
+    switch (column) {
+    case QUERY_HUMIDITY:
+        return cols->humidity;
+    case QUERY_CLOUD_COVER:
+        return cols->cloud_cover;
+    case QUERY_PRESSURE:
+        return cols->pressure;
+    case QUERY_TEMPERATURE:
+        for (uint32_t i = 0; i < cols->count; ++i) {
+            scratch[i] = cols->temperature[i];
+        }
+        return scratch;
+    default:
+        for (uint32_t i = 0; i < cols->count; ++i) {
+            scratch[i] = column == QUERY_SNOW ? cols->snow[i] : cols->lightning[i];
+        }
+        return scratch;
+    }
+}
+
+/**
+ * select_matching keeps the entries of the selection vector sel (count
+ * record numbers) whose value in values compares to value as op says,
+ * and returns how many are left. The loops do not branch on the
+ * comparison, so they cost the same however selective it is.
+ */
+uint32_t select_matching(const double *values, enum query_op op, double value, uint32_t *sel,
+        uint32_t count) {
+    uint32_t kept = 0;
+    uint32_t k;
+
+    switch (op) {
+    case QUERY_EQ:
+        for (k = 0; k < count; ++k) {
+            sel[kept] = sel[k];
+            kept += values[sel[k]] == value;
+        }
+        break;
+    case QUERY_NE:
+        for (k = 0; k < count; ++k) {
+            sel[kept] = sel[k];
+            kept += values[sel[k]] != value;
+        }
+        break;
+    case QUERY_LT:
+        for (k = 0; k < count; ++k) {
+            sel[kept] = sel[k];
+            kept += values[sel[k]] < value;
+        }
+        break;
+    case QUERY_LE:
+        for (k = 0; k < count; ++k) {
+            sel[kept] = sel[k];
+            kept += values[sel[k]] <= value;
+        }
+        break;
+    case QUERY_GT:
+        for (k = 0; k < count; ++k) {
+            sel[kept] = sel[k];
+            kept += values[sel[k]] > value;
+        }
+        break;
+    case QUERY_GE:
+        for (k = 0; k < count; ++k) {
+            sel[kept] = sel[k];
+            kept += values[sel[k]] >= value;
+        }
+        break;
+    }
+    return kept;
+}
+
+/**
+ * range_may_match tells whether some value from lo to hi can meet cond,
+ * and range_always_matches whether all of them do.
+ */
+int range_may_match(const struct query_cond *cond, double lo, double hi) {
+    switch (cond->op) {
+    case QUERY_EQ:
+        return lo <= cond->value && cond->value <= hi;
+    case QUERY_NE:
+        return !(lo == cond->value && hi == cond->value);
+    case QUERY_LT:
+        return lo < cond->value;
+    case QUERY_LE:
+        return lo <= cond->value;
+    case QUERY_GT:
+        return hi > cond->value;
+    case QUERY_GE:
+        return hi >= cond->value;
+    }
+    return 1;
+}
+
+int range_always_matches(const struct query_cond *cond, double lo, double hi) {
+    switch (cond->op) {
+    case QUERY_EQ:
+        return lo == cond->value && hi == cond->value;
+    case QUERY_NE:
+        return cond->value < lo || cond->value > hi;
+    case QUERY_LT:
+        return hi < cond->value;
+    case QUERY_LE:
+        return hi <= cond->value;
+    case QUERY_GT:
+        return lo > cond->value;
+    case QUERY_GE:
+        return lo >= cond->value;
+    }
+    return 0;
+}
+
+/**
+ * query_group finds the group of state code (two characters, or "" when
+ * not grouping by state) and bucket in groups, adding it if it is new, and
+ * returns its position in groups->groups. Positions stay the same as the
+ * table grows; only the hash of them is rebuilt. Program exits if
+ * allocation fails.
+ */
+uint32_t query_group(struct query_table *groups, const char *code, long bucket) {
+    uint64_t key = ((uint64_t) (unsigned char) code[0] << 56)
+            | ((uint64_t) (unsigned char) (code[0] != '\0' ? code[1] : 0) << 48)
+            | ((uint64_t) bucket & (((uint64_t) 1 << 48) - 1));
+    uint64_t h = (key ^ (key >> 31)) * 0x9E3779B97F4A7C15ULL;
+    size_t mask = groups->capacity - 1;
+    size_t i = (size_t) (h ^ (h >> 29)) & mask;
+    struct query_group *group;
+
+    while (groups->capacity > 0 && groups->hash[i] != 0) {
+        if (groups->groups[groups->hash[i] - 1].key == key) {
+            return groups->hash[i] - 1;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if ((groups->count + 1) * 2 > groups->capacity) {
+        size_t capacity = groups->capacity > 0 ? groups->capacity * 2 : 64;
+
+        free(groups->hash);
+        groups->hash = calloc(capacity, sizeof(uint32_t));
+        groups->groups = realloc(groups->groups, capacity / 2 * sizeof(struct query_group));
+        if (groups->hash == NULL || groups->groups == NULL) {
+            printf("ERROR: Memory could not be allocated\n");
+            exit(EXIT_FAILURE);
+        }
+        groups->capacity = capacity;
+        for (uint32_t g = 0; g < groups->count; ++g) {
+            uint64_t k = groups->groups[g].key;
+
+            h = (k ^ (k >> 31)) * 0x9E3779B97F4A7C15ULL;
+            for (i = (size_t) (h ^ (h >> 29)) & (capacity - 1); groups->hash[i] != 0;
+                    i = (i + 1) & (capacity - 1)) {
+            }
+            groups->hash[i] = g + 1;
+        }
+        h = (key ^ (key >> 31)) * 0x9E3779B97F4A7C15ULL;
+        for (i = (size_t) (h ^ (h >> 29)) & (capacity - 1); groups->hash[i] != 0;
+                i = (i + 1) & (capacity - 1)) {
+        }
+    }
+
+    group = &groups->groups[groups->count];
+    memset(group, 0, sizeof(*group));
+    group->key = key;
+    group->code[0] = code[0];
+    group->code[1] = code[0] != '\0' ? code[1] : '\0';
+    group->bucket = bucket;
+    groups->hash[i] = (uint32_t) ++groups->count;
+    return (uint32_t) (groups->count - 1);
+}
+
+/**
+ * print_query prints a header line naming the group keys and aggregates,
+ * then one line per group, ordered by state and then time, with the
+ * fields separated by tabs. Counts and the snow and lightning sums, mins
+ * and maxes are whole numbers, the snow and lightning averages (the share
+ * of records with snow or lightning) get three decimals, and everything
+ * else one, as in the report. A "-" stands for an aggregate with no
+ * values.
+ */
+void print_query(const struct query *query, struct query_table *groups) {
+    static const char *const funcs[] = { "count", "sum", "avg", "min", "max" };
+    static const char *const columns[] = { "temperature", "humidity", "cloud_cover", "pressure",
+        "snow", "lightning" };
+    static const char *const kinds[] = { "", "hour", "day", "month" };
+    int a;
+
+    if (query->by_state) {
+        printf("state\t");
+    }
+    if (query->bucket != BUCKET_NONE) {
+        printf("%s\t", kinds[query->bucket]);
+    }
+    for (a = 0; a < query->num_aggs; ++a) {
+        const struct query_agg *agg = &query->aggs[a];
+
+        if (agg->func == QUERY_COUNT) {
+            printf("count%s", a + 1 < query->num_aggs ? "\t" : "\n");
+        } else {
+            printf("%s(%s)%s", funcs[agg->func], columns[agg->column],
+                    a + 1 < query->num_aggs ? "\t" : "\n");
+        }
+    }
+
+    /* Without grouping there is one line even if no record matched. */
+    if (!query->by_state && query->bucket == BUCKET_NONE && groups->count == 0) {
+        query_group(groups, "", 0);
+    }
+    if (groups->count > 0) {
+        qsort(groups->groups, groups->count, sizeof(struct query_group), compare_query_groups);
+    }
+    for (size_t g = 0; g < groups->count; ++g) {
+        const struct query_group *group = &groups->groups[g];
+
+        if (query->by_state) {
+            printf("%s\t", group->code);
+        }
+        if (query->bucket != BUCKET_NONE) {
+            char label[48];
+
+            bucket_label(label, sizeof(label), group->bucket, query->bucket);
+            printf("%s\t", label);
+        }
+        for (a = 0; a < query->num_aggs; ++a) {
+            const struct query_agg *agg = &query->aggs[a];
+            const struct metric_accum *accum = agg->column >= 0 ? &group->columns[agg->column]
+                : NULL;
+            int whole = agg->column == QUERY_SNOW || agg->column == QUERY_LIGHTNING;
+            double value;
+
+            if (agg->func == QUERY_COUNT) {
+                printf("%lu", group->count);
+            } else if (accum->count == 0) {
+                printf("-");
+            } else {
+                value = agg->func == QUERY_MIN ? accum->min : agg->func == QUERY_MAX ? accum->max
+                    : compensated_value(&accum->sum);
+                if (agg->func == QUERY_AVG) {
+                    printf("%.*f", whole ? 3 : 1, value / (double) accum->count);
+                } else {
+                    printf("%.*f", whole ? 0 : 1, value);
+                }
+            }
+            printf("%s", a + 1 < query->num_aggs ? "\t" : "\n");
+        }
+    }
+}
+
+/**
+ * compare_query_groups orders groups by state code and then bucket, for
+ * qsort.
+ */
+int compare_query_groups(const void *a, const void *b) {
+    const struct query_group *x = a;
+    const struct query_group *y = b;
+    int order = strcmp(x->code, y->code);
+
+    if (order != 0) {
+        return order;
     }
+    return (x->bucket > y->bucket) - (x->bucket < y->bucket);
 }